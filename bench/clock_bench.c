@@ -0,0 +1,67 @@
+/**
+ * @file clock_bench.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Стоимость чтения монотонного времени
+ *
+ * Сравнивает clock_gettime(CLOCK_MONOTONIC_RAW) и svc_get_monotime() на
+ * счетчике процессора, проверяет расхождение шкал за время теста.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <svc/clock.h>
+#include <svc/svc.h>
+
+#define BENCH_CALLS (10000000U)
+
+static uint64_t
+raw_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t)ts.tv_nsec + ((uint64_t)ts.tv_sec * TIME_S);
+}
+
+static double
+bench(uint64_t (*fn)(void))
+{
+	volatile uint64_t sink = 0ULL;
+	uint32_t i;
+
+	uint64_t start = raw_time();
+	for (i = 0U; i < BENCH_CALLS; i++) {
+		sink += fn();
+	}
+	uint64_t end = raw_time();
+
+	(void)sink;
+
+	return (double)(end - start) / (double)BENCH_CALLS;
+}
+
+int
+main(void)
+{
+	svc_context_t *ctx = svc_create_context("clock_bench");
+	svc_init_context(ctx);
+	ctx->log_buffer = log_create("clock_bench");
+	log_init();
+
+	svc_clock_init();
+
+	int64_t skew_start = (int64_t)(svc_get_monotime() - raw_time());
+
+	printf("%-24s %8.1f ns/call\n", "clock_gettime(RAW)", bench(raw_time));
+	printf("%-24s %8.1f ns/call\n", svc_clock_source(), bench(svc_get_monotime));
+
+	int64_t skew_end = (int64_t)(svc_get_monotime() - raw_time());
+
+	printf("skew %lld ns -> %lld ns\n", (long long)skew_start, (long long)skew_end);
+
+	return 0;
+}
@@ -0,0 +1,493 @@
+/**
+ * @file shm_bench.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Нагрузочный тест каналов общей памяти
+ *
+ * Писатель и читатель запускаются в разных процессах, закрепленных за
+ * разными ядрами. Для каждого типа канала и размера данных измеряются
+ * задержка от публикации до получения (перцентили), пропускная
+ * способность и доля разорванных (несогласованных) чтений.
+ */
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <svc/ring.h>
+#include <svc/sharedmem.h>
+#include <svc/svc.h>
+
+#define BENCH_CHANNEL "bench"
+
+/* имена объектов в /dev/shm: префиксы из sharedmem.c и ring.c */
+#define BENCH_SHM_NAME "/SHM_RC_" BENCH_CHANNEL
+#define BENCH_RING_NAME "/RING_RC_" BENCH_CHANNEL
+
+#define BENCH_RING_COUNT (1024U)
+
+#define SEQ_STOP (0xFFFFFFFFU)
+
+/* читатель сдается, если данных нет так долго */
+#define CONSUMER_TMO (2ULL * TIME_S)
+
+typedef enum {
+	CHAN_SHM,      /* опрос shm_map_index() + shm_map_read() */
+	CHAN_SHM_WAIT, /* shm_map_wait() + shm_map_read() */
+	CHAN_RING,     /* ring_push() / ring_pop() */
+	CHAN_COUNT
+} chan_type_t;
+
+static const char *chan_names[CHAN_COUNT] = {
+    [CHAN_SHM] = "shm", [CHAN_SHM_WAIT] = "shm_wait", [CHAN_RING] = "ring"};
+
+static const size_t payload_sizes[] = {16U, 64U, 256U, 1024U, 4096U, 16384U};
+
+/* заголовок каждой записи, остаток заполняется младшим байтом seq */
+typedef struct {
+	uint32_t seq;
+	uint32_t seq_check; /* ~seq */
+	uint64_t ts;
+} bench_hdr_t;
+
+typedef struct {
+	uint64_t samples;
+	uint64_t torn;
+	uint64_t lat_min;
+	uint64_t lat_p50;
+	uint64_t lat_p90;
+	uint64_t lat_p99;
+	uint64_t lat_p999;
+	uint64_t lat_max;
+	uint64_t overflow;
+} bench_result_t;
+
+typedef struct {
+	chan_type_t type;
+	size_t size;
+	uint32_t count;
+	uint64_t interval; /* 0 - писать без пауз (пропускная способность) */
+	int prod_cpu;
+	int cons_cpu;
+} bench_case_t;
+
+static void
+pin_cpu(int cpu)
+{
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET((size_t)cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			fprintf(stderr, "cannot pin to cpu %i\n", cpu);
+		}
+	}
+}
+
+static void
+fill_record(uint8_t *rec, size_t size, uint32_t seq)
+{
+	bench_hdr_t *hdr = (bench_hdr_t *)(void *)rec;
+
+	memset(&rec[sizeof(bench_hdr_t)], (int)(seq & 0xFFU), size - sizeof(bench_hdr_t));
+	hdr->seq = seq;
+	hdr->seq_check = ~seq;
+	hdr->ts = svc_get_monotime();
+}
+
+static bool
+check_record(const uint8_t *rec, size_t size)
+{
+	const bench_hdr_t *hdr = (const bench_hdr_t *)(const void *)rec;
+
+	if (hdr->seq_check != ~hdr->seq) {
+		return false;
+	}
+
+	uint8_t b = (uint8_t)(hdr->seq & 0xFFU);
+	size_t i;
+	for (i = sizeof(bench_hdr_t); i < size; i++) {
+		if (rec[i] != b) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t lat[], uint64_t n, uint64_t p_x10)
+{
+	uint64_t idx = (n * p_x10) / 1000U;
+	if (idx >= n) {
+		idx = n - 1U;
+	}
+
+	return lat[idx];
+}
+
+static bool
+chan_create(const bench_case_t *bc)
+{
+	bool result;
+
+	if (bc->type == CHAN_RING) {
+		result = ring_init(BENCH_CHANNEL, bc->size, BENCH_RING_COUNT);
+	} else {
+		result = shm_map_init(BENCH_CHANNEL, bc->size, SHM_COPIES);
+	}
+
+	return result;
+}
+
+static void
+chan_remove(const bench_case_t *bc)
+{
+	shm_unlink((bc->type == CHAN_RING) ? BENCH_RING_NAME : BENCH_SHM_NAME);
+}
+
+static void
+run_consumer(const bench_case_t *bc, int ready_fd, int result_fd)
+{
+	pin_cpu(bc->cons_cpu);
+
+	shm_t shm;
+	ring_t ring;
+	bool opened;
+
+	if (bc->type == CHAN_RING) {
+		opened = ring_open(BENCH_CHANNEL, &ring);
+	} else {
+		opened = shm_map_open(BENCH_CHANNEL, &shm);
+	}
+
+	bench_result_t res;
+	memset(&res, 0, sizeof(res));
+
+	uint64_t *lat = calloc(bc->count + 1U, sizeof(uint64_t));
+	uint8_t *rec = malloc(bc->size);
+
+	char c = opened ? 1 : 0;
+	if (write(ready_fd, &c, 1U) != 1) {
+		opened = false;
+	}
+
+	uint32_t last_seq = SEQ_STOP;
+	uint32_t index = opened && (bc->type != CHAN_RING) ? shm_map_index(&shm) : 0U;
+	uint64_t last_rx = svc_get_monotime();
+
+	while (opened && (lat != NULL) && (rec != NULL)) {
+		bool got = false;
+
+		switch (bc->type) {
+		case CHAN_SHM_WAIT:
+			if (shm_map_wait(&shm, index, 100ULL * TIME_MS) <= 0) {
+				break;
+			}
+			/* fall through */
+		case CHAN_SHM: {
+			uint32_t cur = shm_map_index(&shm);
+			if (cur != index) {
+				index = cur;
+				got = (shm_map_read(&shm, rec, bc->size) == 0);
+			}
+			break;
+		}
+
+		case CHAN_RING:
+			got = (ring_pop(&ring, rec, bc->size) == 1);
+			break;
+
+		default:
+			break;
+		}
+
+		uint64_t now = svc_get_monotime();
+
+		if (!got) {
+			if ((now - last_rx) > CONSUMER_TMO) {
+				break;
+			}
+			continue;
+		}
+		last_rx = now;
+
+		const bench_hdr_t *hdr = (const bench_hdr_t *)(void *)rec;
+
+		if (!check_record(rec, bc->size)) {
+			res.torn++;
+			continue;
+		}
+
+		if (hdr->seq == SEQ_STOP) {
+			break;
+		}
+
+		if (hdr->seq != last_seq) {
+			last_seq = hdr->seq;
+			if (res.samples <= bc->count) {
+				lat[res.samples++] = now - hdr->ts;
+			}
+		}
+	}
+
+	if ((res.samples > 0U) && (lat != NULL)) {
+		qsort(lat, res.samples, sizeof(uint64_t), cmp_u64);
+		res.lat_min = lat[0];
+		res.lat_p50 = percentile(lat, res.samples, 500U);
+		res.lat_p90 = percentile(lat, res.samples, 900U);
+		res.lat_p99 = percentile(lat, res.samples, 990U);
+		res.lat_p999 = percentile(lat, res.samples, 999U);
+		res.lat_max = lat[res.samples - 1U];
+	}
+
+	if (opened && (bc->type == CHAN_RING)) {
+		res.overflow = ring_overflow(&ring);
+	}
+
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res)) {
+		fprintf(stderr, "cannot send result\n");
+	}
+
+	free(lat);
+	free(rec);
+}
+
+static void
+publish(const bench_case_t *bc, shm_t *shm, ring_t *ring, uint8_t *rec, uint32_t seq)
+{
+	switch (bc->type) {
+	case CHAN_RING:
+		fill_record(rec, bc->size, seq);
+		if (seq == SEQ_STOP) {
+			/* стоп-запись не должна потеряться */
+			while (ring_push(ring, rec, bc->size) == 0) {
+			}
+		} else {
+			ring_push(ring, rec, bc->size);
+		}
+		break;
+
+	case CHAN_SHM:
+	case CHAN_SHM_WAIT:
+	default: {
+		uint8_t *slot = shm_map_begin_write(shm);
+		if (slot != NULL) {
+			fill_record(slot, bc->size, seq);
+			shm_map_commit(shm);
+		}
+		break;
+	}
+	}
+}
+
+static bool
+run_case(const bench_case_t *bc, bench_result_t *res, double *rate)
+{
+	bool result = false;
+	int ready[2];
+	int results[2];
+
+	if (!chan_create(bc)) {
+		return false;
+	}
+
+	if (pipe(ready) != 0) {
+		chan_remove(bc);
+		return false;
+	}
+
+	if (pipe(results) != 0) {
+		close(ready[0]);
+		close(ready[1]);
+		chan_remove(bc);
+		return false;
+	}
+
+	/* буфер stdout иначе будет выведен еще раз из дочернего процесса */
+	fflush(stdout);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		close(ready[0]);
+		close(ready[1]);
+		close(results[0]);
+		close(results[1]);
+		chan_remove(bc);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(ready[0]);
+		close(results[0]);
+		run_consumer(bc, ready[1], results[1]);
+		_exit(0);
+	}
+
+	close(ready[1]);
+	close(results[1]);
+
+	do {
+		pin_cpu(bc->prod_cpu);
+
+		char c = 0;
+		if ((read(ready[0], &c, 1U) != 1) || (c == 0)) {
+			break;
+		}
+
+		shm_t shm;
+		ring_t ring;
+		bool opened;
+
+		if (bc->type == CHAN_RING) {
+			opened = ring_open(BENCH_CHANNEL, &ring);
+		} else {
+			opened = shm_map_open(BENCH_CHANNEL, &shm);
+		}
+
+		uint8_t *rec = malloc(bc->size);
+		if (!opened || (rec == NULL)) {
+			free(rec);
+			break;
+		}
+
+		uint64_t start = svc_get_monotime();
+		uint64_t next = start;
+		uint32_t seq;
+
+		for (seq = 0U; seq < bc->count; seq++) {
+			if (bc->interval > 0ULL) {
+				next += bc->interval;
+				while (svc_get_monotime() < next) {
+				}
+			}
+
+			publish(bc, &shm, &ring, rec, seq);
+		}
+
+		uint64_t elapsed = svc_get_monotime() - start;
+		*rate = (elapsed > 0U) ? ((double)bc->count * (double)TIME_S / (double)elapsed)
+				       : 0.0;
+
+		publish(bc, &shm, &ring, rec, SEQ_STOP);
+		free(rec);
+
+		if (read(results[0], res, sizeof(*res)) == sizeof(*res)) {
+			result = true;
+		}
+	} while (false);
+
+	close(ready[0]);
+	close(results[0]);
+	waitpid(pid, NULL, 0);
+	chan_remove(bc);
+
+	return result;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-p producer_cpu] [-c consumer_cpu] [-n count] [-i interval_ns]\n",
+		name);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_case_t bc = {CHAN_SHM, 0U, 100000U, 20ULL * TIME_US, 0, 1};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:c:n:i:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			bc.prod_cpu = atoi(optarg);
+			break;
+		case 'c':
+			bc.cons_cpu = atoi(optarg);
+			break;
+		case 'n':
+			bc.count = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			bc.interval = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (bc.count == 0U) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	uint64_t interval = bc.interval;
+
+	printf("producer cpu %i, consumer cpu %i, %u records, latency interval %llu ns\n\n",
+	       bc.prod_cpu, bc.cons_cpu, bc.count, (unsigned long long)interval);
+	printf("%-9s %6s | %8s %8s %8s %8s %8s %9s | %6s %7s | %10s %7s %8s\n", "channel", "size",
+	       "min", "p50", "p90", "p99", "p99.9", "max", "torn", "seen%", "writes/s", "seen%",
+	       "overflow");
+
+	size_t t;
+	size_t s;
+	for (t = 0U; t < CHAN_COUNT; t++) {
+		for (s = 0U; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+			bench_result_t lat_res;
+			bench_result_t tp_res;
+			double lat_rate = 0.0;
+			double tp_rate = 0.0;
+
+			bc.type = (chan_type_t)t;
+			bc.size = payload_sizes[s];
+
+			/* задержка: писатель публикует с заданным интервалом */
+			bc.interval = interval;
+			if (!run_case(&bc, &lat_res, &lat_rate)) {
+				fprintf(stderr, "%s/%zu: latency run failed\n", chan_names[t],
+					bc.size);
+				continue;
+			}
+
+			/* пропускная способность: писатель пишет без пауз */
+			bc.interval = 0ULL;
+			if (!run_case(&bc, &tp_res, &tp_rate)) {
+				fprintf(stderr, "%s/%zu: throughput run failed\n", chan_names[t],
+					bc.size);
+				continue;
+			}
+
+			printf("%-9s %6zu | %8llu %8llu %8llu %8llu %8llu %9llu | %6llu %6.1f%% | "
+			       "%10.0f %6.1f%% %8llu\n",
+			       chan_names[t], bc.size, (unsigned long long)lat_res.lat_min,
+			       (unsigned long long)lat_res.lat_p50,
+			       (unsigned long long)lat_res.lat_p90,
+			       (unsigned long long)lat_res.lat_p99,
+			       (unsigned long long)lat_res.lat_p999,
+			       (unsigned long long)lat_res.lat_max,
+			       (unsigned long long)(lat_res.torn + tp_res.torn),
+			       100.0 * (double)lat_res.samples / (double)bc.count, tp_rate,
+			       100.0 * (double)tp_res.samples / (double)bc.count,
+			       (unsigned long long)tp_res.overflow);
+		}
+	}
+
+	printf("\nlatency in ns (publish to observe); torn - records failing content check\n");
+
+	return 0;
+}
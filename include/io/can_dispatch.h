@@ -0,0 +1,50 @@
+/**
+ * @file can_dispatch.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Разбор входящих CAN пакетов по командам и источникам
+ */
+
+#pragma once
+
+#include <io/canbus.h>
+
+/*
+ * Таблица маршрутов (cmd, id) -> обработчик. Открытая адресация по
+ * 16-битному ключу, поиск - O(1). Та же таблица задает фильтры приема в
+ * ядре: пакеты без маршрута не копируются из ядра вовсе.
+ */
+#define CAN_ROUTES_MAX (256U)
+
+typedef void (*can_handler_t)(const struct can_packet_t *msg, void *arg);
+
+typedef struct {
+	can_handler_t handler; /* NULL - ячейка свободна */
+	void *arg;
+	uint8_t cmd;
+	uint8_t id;
+} can_route_t;
+
+typedef struct {
+	can_route_t route[CAN_ROUTES_MAX];
+	size_t count;
+} can_dispatch_t;
+
+void can_dispatch_init(can_dispatch_t *d);
+
+/**
+ * @brief маршрут для пакетов cmd от источника id
+ * @retval false - таблица заполнена
+ */
+bool can_dispatch_add(can_dispatch_t *d, uint8_t cmd, uint8_t id, can_handler_t handler,
+		      void *arg);
+
+/**
+ * @brief вызов обработчика пакета
+ * @retval false - маршрута нет
+ */
+bool can_dispatch(const can_dispatch_t *d, const struct can_packet_t *msg);
+
+/* фильтры приема шины в ядре по всем маршрутам таблицы */
+bool can_dispatch_filter(const can_dispatch_t *d, can_t *can, uint32_t bus);
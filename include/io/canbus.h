@@ -8,16 +8,130 @@
 
 #pragma once
 
+#include <netlink/netlink.h>
 #include <proto/vesc_proto.h>
+#include <svc/platform.h>
 
 struct can_packet_t {
 	can_hdr_t hdr;
 	uint8_t len;
+	uint8_t bus;   /* номер шины в can_t */
+	uint8_t flags; /* CAN_PKT_* */
 	uint8_t data[8];
+	uint64_t ts; /* время приема в шкале svc_get_monotime(), нс */
 };
 
-int can_init(void);
+/* отметки ядра у кадра нет, хотя шина их выдает; ts - момент чтения,
+ * по нему свежесть данных не оценивается */
+#define CAN_PKT_TS_READ (1U)
 
-int read_can_msg(struct can_packet_t *msg);
+/*
+ * Набор CAN шин сервиса: на каждую шину свой сокет, своя очередь передачи
+ * и свои счетчики ошибок, прием - одним epoll по всем сокетам. Трафик
+ * одной шины не задерживает передачу в другую.
+ */
+#define CAN_BUS_MAX NL_MAX_IFACES
+
+typedef struct can can_t;
+
+/**
+ * @brief открытие шин
+ * @param ifnames [in] имена интерфейсов, NULL - все CAN интерфейсы системы
+ * @param count [in] число имен
+ * @return NULL при ошибке
+ */
+can_t *can_open(const char *const ifnames[], uint32_t count);
+
+void can_close(can_t *can);
+
+uint32_t can_bus_count(const can_t *can);
+
+/* номер шины по имени интерфейса, -1 - шина не открыта */
+int32_t can_bus_find(const can_t *can, const char ifname[]);
+
+const char *can_bus_name(const can_t *can, uint32_t bus);
+
+/* дескриптор epoll по всем шинам, для ожидания во внешнем цикле */
+int can_fd(const can_t *can);
+
+/**
+ * @brief разовая передача без can_t
+ * @details сокет открывается только на передачу (прием отключен фильтром),
+ * без показателей, и закрывается до возврата; для аварийных команд из
+ * процесса, который шину не обслуживает
+ * @param ifname [in] интерфейс; если его нет - первый CAN интерфейс системы
+ * @return число отправленных пакетов
+ */
+size_t can_send_once(const char ifname[], const struct can_packet_t msgs[], size_t count);
+
+/* точное совпадение команды и источника пакета с расширенным идентификатором */
+typedef struct {
+	uint8_t cmd;
+	uint8_t id;
+} can_filter_t;
+
+/**
+ * @brief фильтры CAN_RAW_FILTER шины: ядро отдает только совпавшие кадры
+ * @param count [in] число фильтров, 0 - не принимать ничего, кроме кадров ошибок
+ */
+bool can_set_filters(can_t *can, uint32_t bus, const can_filter_t filters[], size_t count);
+
+/* кадров за один системный вызов в пакетных функциях */
+#define CAN_BATCH_MAX (64U)
+
+/**
+ * @brief пакетный прием через recvmmsg() со всех готовых шин
+ * @details кадры без расширенного идентификатора пропускаются, кадры
+ * ошибок только учитываются в счетчиках шины. Время приема берется из
+ * отметки SO_TIMESTAMPING (аппаратной, если она правдоподобна), без нее -
+ * момент чтения с флагом CAN_PKT_TS_READ. Если отметки на шине включить не
+ * удалось, момент чтения отдается без флага. Прием повторяется, пока сокеты
+ * отдают полные пакеты и есть место в msgs
+ * @param timeout [in] ожидание в мс, 0 - не ждать
+ * @return число принятых пакетов, count - на шинах могут остаться кадры
+ */
+size_t can_read_batch(can_t *can, struct can_packet_t msgs[], size_t count, int timeout);
+
+/**
+ * @brief пакетная передача в шину через sendmmsg()
+ * @return число отправленных пакетов, остальные учтены как ошибки
+ */
+size_t can_send_batch(can_t *can, uint32_t bus, const struct can_packet_t msgs[],
+		      size_t count);
+
+/*
+ * Планировщик передачи. У каждой шины по очереди на класс приоритета,
+ * can_flush() отправляет классы по порядку одним sendmmsg(). Бюджет
+ * загрузки шины - ведро токенов в битах: наполняется со скоростью
+ * bitrate * load / 100 и вмещает бюджет одного такта. Управление
+ * приводами отправляется всегда и может уйти в долг, младшие классы ждут
+ * следующего такта, пока в ведре не хватает бит на кадр.
+ */
+enum can_prio {
+	CAN_PRIO_DRIVE = 0, /**< @brief управление приводами, бюджетом не ограничивается */
+	CAN_PRIO_KEEPALIVE, /**< @brief поддержание связи */
+	CAN_PRIO_LIGHTS,    /**< @brief освещение */
+	CAN_PRIO_COUNT
+};
+
+/**
+ * @brief бюджет загрузки шины
+ * @param bitrate [in] скорость шины, бит/с; 0 - без ограничения
+ * @param tick [in] период отправки, нс
+ * @param load [in] допустимая загрузка, %
+ */
+void can_set_budget(can_t *can, uint32_t bus, uint32_t bitrate, uint64_t tick, uint32_t load);
+
+/* пакет в очередь передачи шины */
+void can_queue_msg(can_t *can, uint32_t bus, enum can_prio prio, const struct can_packet_t *msg);
+
+/**
+ * @brief пакет с заменой неотправленного пакета того же назначения
+ * @param key_len [in] число первых байт данных, которые вместе с
+ * заголовком определяют назначение (например, номер канала)
+ */
+void can_queue_latest(can_t *can, uint32_t bus, enum can_prio prio, const struct can_packet_t *msg,
+		      size_t key_len);
 
-int send_can_msg(struct can_packet_t *msg);
+/* отправка очередей всех шин в пределах бюджета; возвращает число отправленных */
+size_t can_flush(can_t *can);
@@ -23,6 +23,7 @@ enum log_level {
 
 struct log_record_t {
 	enum log_level level;
+	uint32_t seq; /* позиция записи + 1, пишется последней при публикации */
 	uint64_t date;
 	uint8_t msg_len;
 	uint8_t log_continue;
@@ -30,11 +31,24 @@ struct log_record_t {
 	char msg[LOG_ITEM_MAXMSG];
 };
 
+/* степень двойки: позиции head/tail растут непрерывно и берутся по маске */
 #define LOG_BUFFER_SIZE (1024U)
 
+#define LOG_CACHE_LINE (64U)
+
 typedef struct {
-	uint32_t head;
+	/* сторона писателей */
+	uint32_t head;	    /* следующая позиция для резервирования */
+	uint32_t dropped;   /* сообщения, не влезшие в буфер */
+	int32_t notify_fd;  /* eventfd читателя, наследуется сервисом при fork() */
+	uint8_t __pad0[LOG_CACHE_LINE - 12U];
+
+	/* сторона читателя */
 	uint32_t tail;
+	uint32_t dropped_reported;
+	uint32_t waiting; /* читатель спит и ждет уведомления через notify_fd */
+	uint8_t __pad1[LOG_CACHE_LINE - 12U];
+
 	struct log_record_t records[LOG_BUFFER_SIZE];
 } log_buffer_t;
 
@@ -42,6 +56,10 @@ log_buffer_t *log_create(const char name[]);
 
 void log_init(void);
 
+/* отложенное форматирование: в буфер пишутся формат и аргументы,
+ * текст собирается при чтении в log_print() */
+void log_set_deferred(bool deferred);
+
 void log_dbg(const char *format, ...);
 
 void log_inf(const char *format, ...);
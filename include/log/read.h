@@ -11,3 +11,25 @@
 #include <log/log.h>
 
 void log_print(const char name[], log_buffer_t *log);
+
+/* eventfd, через который писатели будят читателя */
+int log_notify_fd(const log_buffer_t *log);
+
+/**
+ * @brief подготовка читателя ко сну
+ * @details выставляет флаг ожидания, после чего первое дописанное сообщение
+ * разбудит читателя через log_notify_fd()
+ * @retval false - есть готовые сообщения, засыпать нельзя
+ */
+bool log_wait_prepare(log_buffer_t *log);
+
+/* сброс счетчика уведомлений после пробуждения */
+void log_notify_clear(const log_buffer_t *log);
+
+/**
+ * @brief сброс журнала после завершения всех писателей
+ * @details упавший сервис мог зарезервировать записи и не дописать их:
+ * читатель остановился бы на них навсегда
+ * @return число выброшенных записей
+ */
+uint32_t log_reset(log_buffer_t *log);
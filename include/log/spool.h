@@ -0,0 +1,74 @@
+/**
+ * @file spool.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Сохранение журналов в сегментные файлы
+ */
+
+#pragma once
+
+#include <log/log.h>
+
+/*
+ * Супервизор при чтении журналов сервисов (log_print()) копирует каждое
+ * сообщение в сегментный файл, отображенный в память. Сегменты
+ * переиспользуются по кругу, номер сегмента растет непрерывно. Запись на
+ * диск (fdatasync) выполняется отдельным потоком, цикл супервизора только
+ * копирует данные в отображение.
+ *
+ * Сообщения с отложенным форматированием сохраняются в двоичном виде:
+ * строка формата записывается в сегмент один раз, дальше сообщения
+ * ссылаются на нее по номеру.
+ */
+
+#define LOG_SPOOL_SEGMENT_SIZE (4U * 1024U * 1024U)
+#define LOG_SPOOL_SEGMENTS (8U)
+
+typedef struct log_spool log_spool_t;
+
+/**
+ * @brief открытие спулера, запись продолжается в новом сегменте
+ * @param dir [in] каталог сегментов
+ * @param segment_size [in] размер сегмента
+ * @param segments [in] число сегментов в ротации
+ */
+log_spool_t *log_spool_open(const char dir[], size_t segment_size, uint32_t segments);
+
+/* сброс данных на диск и закрытие */
+void log_spool_close(log_spool_t *spool);
+
+/**
+ * @brief освобождение копии спулера в процессе, порожденном fork()
+ * @details отображение и дескрипторы закрываются без записи на диск,
+ * поток синхронизации остался в родителе и не трогается
+ */
+void log_spool_forget(log_spool_t *spool);
+
+/* подключение спулера к log_print() */
+void log_spool_attach(log_spool_t *spool);
+
+/* вызывается из цикла супервизора, раз в период ставит сегмент в очередь на fdatasync */
+void log_spool_tick(log_spool_t *spool);
+
+/* разобранное сообщение из сегмента */
+typedef struct {
+	uint64_t date;
+	enum log_level level;
+	const char *name;
+	const char *text;
+} log_spool_msg_t;
+
+typedef void (*log_spool_cb_t)(const log_spool_msg_t *msg, void *arg);
+
+/**
+ * @brief номер сегмента в файле
+ * @retval false - файл не является сегментом
+ */
+bool log_spool_segment_seq(const char path[], uint64_t *seq);
+
+/**
+ * @brief разбор сегментного файла
+ * @return число сообщений, -1 при ошибке
+ */
+int32_t log_spool_decode(const char path[], log_spool_cb_t cb, void *arg);
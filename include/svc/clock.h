@@ -0,0 +1,28 @@
+/**
+ * @file clock.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Источник монотонного времени на счетчике процессора
+ */
+
+#pragma once
+
+#include <svc/platform.h>
+
+/*
+ * svc_get_monotime() после svc_clock_init() читает счетчик процессора
+ * напрямую: cntvct_el0 на aarch64, TSC на x86 (только инвариантный).
+ * Пересчет в наносекунды - умножение и сдвиг. Калибровка делается один
+ * раз в супервизоре, сервисы наследуют ее через fork(), поэтому отметки
+ * разных процессов сравнимы. Без счетчика используется clock_gettime().
+ */
+
+/**
+ * @brief выбор и калибровка счетчика
+ * @retval false - счетчика нет, время читается через clock_gettime()
+ */
+bool svc_clock_init(void);
+
+/* имя источника времени для журнала */
+const char *svc_clock_source(void);
@@ -0,0 +1,24 @@
+/**
+ * @file memory.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Размещение областей общей памяти
+ */
+
+#pragma once
+
+#include <svc/platform.h>
+
+#define SVC_MEM_POPULATE (1U << 0U) /**< @brief заполнять страницы сразу при mmap() */
+#define SVC_MEM_LOCK (1U << 1U)	    /**< @brief запрещать выгрузку страниц, mlock() */
+#define SVC_MEM_HUGE (1U << 2U)	    /**< @brief большие страницы для больших областей */
+
+/* политика действует на все последующие svc_mem_map() процесса и его потомков */
+void svc_mem_set_flags(uint32_t flags);
+
+uint32_t svc_mem_get_flags(void);
+
+void *svc_mem_map(int fd, size_t size);
+
+bool svc_mem_lock_all(void);
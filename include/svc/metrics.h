@@ -0,0 +1,70 @@
+/**
+ * @file metrics.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Счетчики и показатели сервиса
+ */
+
+#pragma once
+
+#include <svc/platform.h>
+
+/*
+ * Таблица показателей лежит в общем контексте сервиса, супервизор читает
+ * ее напрямую. Обновление - одна атомарная операция в памяти, без
+ * системных вызовов. Регистрировать показатели нужно из основного потока
+ * сервиса, до цикла; после перезапуска сервиса показатель с тем же именем
+ * продолжает счет.
+ */
+
+#define SVC_METRICS_MAX (32U)
+#define SVC_METRIC_NAME_LEN (48U)
+
+enum svc_metric_type {
+	SVC_METRIC_COUNTER = 0, /**< @brief только растет, имя оканчивается на _total */
+	SVC_METRIC_GAUGE	/**< @brief текущее значение */
+};
+
+typedef struct {
+	char name[SVC_METRIC_NAME_LEN];
+	uint32_t type;
+	uint32_t __pad;
+	uint64_t value;
+} svc_metric_t;
+
+typedef struct {
+	uint32_t count; /* публикуется после заполнения показателя */
+	uint32_t __pad;
+	svc_metric_t metric[SVC_METRICS_MAX];
+} svc_metrics_t;
+
+/**
+ * @brief регистрация показателя текущего сервиса
+ * @return показатель; при переполнении таблицы - общий неэкспортируемый
+ */
+svc_metric_t *svc_metric(const char name[], enum svc_metric_type type);
+
+static inline void
+svc_metric_add(svc_metric_t *m, uint64_t v)
+{
+	__atomic_add_fetch(&m->value, v, __ATOMIC_RELAXED);
+}
+
+static inline void
+svc_metric_inc(svc_metric_t *m)
+{
+	svc_metric_add(m, 1ULL);
+}
+
+static inline void
+svc_metric_set(svc_metric_t *m, uint64_t v)
+{
+	__atomic_store_n(&m->value, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+svc_metric_get(const svc_metric_t *m)
+{
+	return __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+}
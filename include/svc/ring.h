@@ -0,0 +1,35 @@
+/**
+ * @file ring.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Кольцевой буфер записей в общей памяти
+ */
+
+#pragma once
+
+#include <svc/platform.h>
+
+typedef struct {
+	uint64_t guard;
+	void *map;
+	size_t size;  /* размер записи */
+	size_t count; /* число записей, степень двойки */
+} ring_t;
+
+bool ring_init(const char name[], size_t size, size_t count);
+
+bool ring_open(const char name[], ring_t *ring);
+
+/* 1 - запись добавлена, 0 - буфер полон (запись учтена в overflow) */
+int32_t ring_push(ring_t *ring, const void *data, size_t size);
+
+/* 1 - запись прочитана, 0 - буфер пуст */
+int32_t ring_pop(ring_t *ring, void *data, size_t size);
+
+/* записи в data идут подряд с шагом ring->size, результат - число обработанных */
+size_t ring_push_batch(ring_t *ring, const void *data, size_t count);
+
+size_t ring_pop_batch(ring_t *ring, void *data, size_t count);
+
+uint64_t ring_overflow(ring_t *ring);
@@ -0,0 +1,29 @@
+/**
+ * @file sched.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Планирование и ограничения ресурсов сервиса
+ */
+
+#pragma once
+
+#include <sched.h>
+
+#include <svc/platform.h>
+
+typedef struct {
+	uint32_t cpus;	    /* маска ядер, 0 - без ограничений */
+	int policy;	    /* SCHED_OTHER, SCHED_FIFO или SCHED_RR */
+	int priority;	    /* приоритет реального времени для SCHED_FIFO/SCHED_RR */
+	int nice;	    /* уровень nice для SCHED_OTHER */
+	uint64_t mem_limit; /* ограничение памяти через cgroup, байт; 0 - нет */
+} svc_sched_t;
+
+/**
+ * @brief применение параметров к текущему процессу
+ * @details вызывается в сервисе сразу после fork(); ошибки не фатальны,
+ * сервис продолжает работу с тем, что удалось применить
+ * @retval false - применено не все
+ */
+bool svc_sched_apply(const char name[], const svc_sched_t *sched);
@@ -10,16 +10,51 @@
 
 #include <svc/platform.h>
 
+/* число копий данных в канале по умолчанию */
+#define SHM_COPIES (4U)
+#define SHM_COPIES_MAX (8U)
+
+/*
+ * Число копий - степень двойки: слот равен index & (copies - 1), и при
+ * переполнении 32-битного индекса последовательность слотов не рвется.
+ */
+#define SHM_COPIES_VALID(copies)                                                                   \
+	(((copies) >= 2U) && ((copies) <= SHM_COPIES_MAX) && (((copies) & ((copies) - 1U)) == 0U))
+
+/* индекс канала до первой публикации, каждая публикация увеличивает его на 1 */
+#define SHM_START_IDX (0xFFFFFFFEU)
+
 typedef struct {
 	uint64_t guard;
 	void *map;
 	size_t size;
+	uint32_t copies;
+
+	/* незавершенная запись shm_map_begin_write()/shm_map_begin_update() */
+	int32_t wr_slot;
+	uint32_t wr_index;
 } shm_t;
 
-bool shm_map_init(const char name[], size_t size);
+bool shm_map_init(const char name[], size_t size, uint32_t copies);
 
 bool shm_map_open(const char name[], shm_t *shm);
 
-int32_t shm_map_read(shm_t *shm, void **data);
+int32_t shm_map_read(shm_t *shm, void *data, size_t size);
+
+int32_t shm_map_write(shm_t *shm, const void *data, size_t size);
+
+/* запись на месте: заполнить следующий слот целиком и опубликовать shm_map_commit() */
+void *shm_map_begin_write(shm_t *shm);
+
+/* правка отдельных полей: следующий слот заполняется копией последней записи,
+ * публикуется shm_map_commit() */
+void *shm_map_begin_update(shm_t *shm);
+
+int32_t shm_map_commit(shm_t *shm);
+
+/* текущий опубликованный индекс, для последующего shm_map_wait() */
+uint32_t shm_map_index(shm_t *shm);
 
-int32_t shm_map_write(shm_t *shm, void *data, size_t size);
+/* ожидание публикации индекса, отличного от last_index;
+ * timeout в нс, 0 - без ограничения. 1 - есть новые данные, 0 - таймаут */
+int32_t shm_map_wait(shm_t *shm, uint32_t last_index, uint64_t timeout);
@@ -9,13 +9,38 @@
 #pragma once
 
 #include <log/log.h>
+#include <svc/metrics.h>
 #include <svc/platform.h>
 
+/* гистограммы по степеням двойки в микросекундах: [0, 1), [1, 2), [2, 4)... */
+#define SVC_HIST_BUCKETS (20U)
+
+/* статистика циклов, пишет сервис в svc_cycle(), читает супервизор */
+typedef struct {
+	uint64_t cycles;
+	uint64_t overruns; /* пропущенные периоды по счетчику timerfd */
+	uint64_t late_sum; /* опоздание пробуждения относительно начала периода, нс */
+	uint64_t late_max;
+	uint64_t work_sum; /* время работы между пробуждениями, нс */
+	uint64_t work_max;
+	uint64_t late_hist[SVC_HIST_BUCKETS];
+	uint64_t work_hist[SVC_HIST_BUCKETS];
+} svc_timing_t;
+
+/* срок пульса по умолчанию для периодического сервиса, в периодах */
+#define SVC_DEADLINE_PERIODS (3ULL)
+
 typedef struct {
 	uint64_t period;
-	uint64_t watchdog;
+	uint64_t watchdog;  /* отметка супервизора, проверяется сервисом */
+	uint64_t heartbeat; /* пульс сервиса, проверяется супервизором */
+	uint64_t deadline;  /* допустимый интервал между пульсами, 0 - не проверять */
 	int timerfd;
 	log_buffer_t *log_buffer;
+	uint64_t cycle_wake; /* последнее пробуждение цикла, 0 - цикл не начинался */
+	bool deadline_set;   /* сервис сам задал срок пульса */
+	svc_timing_t timing;   /* переживает перезапуски сервиса */
+	svc_metrics_t metrics; /* показатели для экспорта супервизором */
 } svc_context_t;
 
 const svc_context_t *get_svc_context(void);
@@ -24,8 +49,61 @@ svc_context_t *svc_create_context(const char svc_name[]);
 
 void svc_init_context(svc_context_t *ctx);
 
+/* переключение текущего контекста между задачами одного процесса */
+void svc_set_context(svc_context_t *ctx);
+
 bool svc_cycle(void);
 
+/**
+ * @brief итерация задачи в общем цикле: таймер задачи уже сработал
+ * @details то же, что svc_cycle() без ожидания: учет времени, пульс,
+ * проверка watchdog и вызов step()
+ * @retval false - таймер, watchdog или step() вернул ошибку
+ */
+bool svc_task_cycle(int (*step)(void));
+
+bool svc_check(void);
+
+/**
+ * @brief срок пульса текущего сервиса
+ * @details периодический сервис по умолчанию получает SVC_DEADLINE_PERIODS
+ * периодов при первом svc_cycle(); 0 отключает проверку
+ */
+void svc_set_deadline(uint64_t deadline);
+
+/* пульс для сервисов без svc_cycle(), svc_cycle() отмечает его сам */
+void svc_heartbeat(void);
+
 uint64_t svc_get_monotime(void);
 
+/**
+ * @brief время пробуждения текущего цикла
+ * @details отметка, снятая svc_cycle(): внутри итерации заменяет
+ * svc_get_monotime() без чтения часов
+ */
+static inline uint64_t
+svc_cycle_time(void)
+{
+	uint64_t wake = get_svc_context()->cycle_wake;
+
+	return (wake != 0ULL) ? wake : svc_get_monotime();
+}
+
 uint64_t svc_get_time(void);
+
+/* время от включения, включая сон системы */
+uint64_t svc_get_boottime(void);
+
+/**
+ * @brief отметка хронологии запуска
+ * @details пишется в журнал текущего сервиса со временем от включения;
+ * svc_cycle() отмечает первый цикл сам
+ */
+void svc_startup_mark(const char what[]);
+
+/**
+ * @brief верхняя граница корзины гистограммы, в которую попадает перцентиль
+ * @param pct [in] перцентиль, 0..100
+ * @return граница в наносекундах, 0 - гистограмма пуста
+ */
+uint64_t svc_hist_percentile(const uint64_t hist[SVC_HIST_BUCKETS], uint32_t pct);
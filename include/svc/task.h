@@ -0,0 +1,35 @@
+/**
+ * @file task.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Периодические сервисы как задачи общего цикла
+ */
+
+#pragma once
+
+#include <svc/svc.h>
+
+/*
+ * Периодический сервис делится на подготовку и одну итерацию цикла. Такой
+ * сервис работает либо в своем процессе (svc_task_main()), либо вместе с
+ * другими задачами в одном процессе (svc_tasks_run()): каждая задача
+ * сохраняет свой контекст, журнал и показатели, текущий контекст
+ * переключается перед каждым вызовом.
+ */
+typedef struct {
+	int (*start)(void); /* подготовка, NULL - не нужна */
+	int (*step)(void);  /* итерация цикла, не 0 - завершение сервиса */
+} svc_task_t;
+
+/* цикл задачи в отдельном процессе сервиса */
+int svc_task_main(const svc_task_t *task);
+
+/**
+ * @brief задачи в одном процессе, каждая по своему таймеру
+ * @param ctx [in] контексты задач, период задан
+ * @param task [in] задачи
+ * @param count [in] число задач
+ * @return код завершения процесса: возврат при ошибке любой задачи
+ */
+int svc_tasks_run(svc_context_t *const ctx[], const svc_task_t *const task[], size_t count);
@@ -13,3 +13,6 @@
 int timerfd_init(uint64_t start_nsec, uint64_t period_nsec);
 
 bool timerfd_wait(int fd);
+
+/* ожидание с числом истекших периодов: больше 1 - периоды пропущены */
+bool timerfd_read(int fd, uint64_t *expirations);
@@ -0,0 +1,79 @@
+/**
+ * @file wheel.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Иерархическое колесо таймеров сервиса
+ */
+
+#pragma once
+
+#include <svc/platform.h>
+
+/*
+ * Колесо из SVC_WHEEL_LEVELS уровней по SVC_WHEEL_SLOTS ячеек. Таймер
+ * попадает в ячейку уровня по оставшемуся до срока числу тиков, дальние
+ * уровни при обороте ближнего раскладываются заново. Взвод и отмена -
+ * O(1), сработавшие таймеры вызываются из svc_wheel_run() в потоке
+ * сервиса. Время - svc_get_monotime(), в наносекундах.
+ */
+#define SVC_WHEEL_BITS (6U)
+#define SVC_WHEEL_SLOTS (1U << SVC_WHEEL_BITS)
+#define SVC_WHEEL_LEVELS (4U)
+
+typedef struct svc_timer svc_timer_t;
+
+typedef void (*svc_timer_cb_t)(svc_timer_t *timer, void *arg);
+
+struct svc_timer {
+	svc_timer_t *next; /* NULL - таймер не взведен */
+	svc_timer_t *prev;
+	uint64_t expires; /* тик срабатывания */
+	svc_timer_cb_t cb;
+	void *arg;
+};
+
+typedef struct {
+	uint64_t resolution; /* длительность тика, нс */
+	uint64_t tick;	     /* следующий необработанный тик */
+	uint32_t count;	     /* взведенных таймеров */
+	svc_timer_t slot[SVC_WHEEL_LEVELS][SVC_WHEEL_SLOTS]; /* головы списков */
+} svc_wheel_t;
+
+/**
+ * @brief подготовка колеса
+ * @param resolution [in] длительность тика, нс: сроки округляются вверх
+ * @param now [in] текущее время
+ */
+void svc_wheel_init(svc_wheel_t *w, uint64_t resolution, uint64_t now);
+
+void svc_timer_init(svc_timer_t *timer, svc_timer_cb_t cb, void *arg);
+
+/* взвод на момент expires, взведенный таймер переносится */
+void svc_timer_arm(svc_wheel_t *w, svc_timer_t *timer, uint64_t expires);
+
+void svc_timer_cancel(svc_wheel_t *w, svc_timer_t *timer);
+
+static inline bool
+svc_timer_pending(const svc_timer_t *timer)
+{
+	return timer->next != NULL;
+}
+
+/**
+ * @brief вызов таймеров со сроком не позже now
+ * @details из обработчика можно взводить и отменять любые таймеры
+ * @return число сработавших таймеров
+ */
+uint32_t svc_wheel_run(svc_wheel_t *w, uint64_t now);
+
+/* ближайший срок, UINT64_MAX - таймеров нет */
+uint64_t svc_wheel_next(const svc_wheel_t *w);
+
+/**
+ * @brief сон до готовности fd или ближайшего срока, затем svc_wheel_run()
+ * @param fd [in] дескриптор для ожидания чтения, -1 - только таймеры
+ * @param max_wait [in] предел сна, нс: чтобы сервис успевал подать пульс
+ * @retval false - ошибка ожидания
+ */
+bool svc_wheel_wait(svc_wheel_t *w, int fd, uint64_t max_wait);
@@ -13,11 +13,11 @@
 #include <pulse/simple.h>
 #include <stdbool.h>
 
-#include <svc/sharedmem.h>
+#include <svc/metrics.h>
 #include <svc/svc.h>
 
 #include <private/audio.h>
-#include <private/power.h>
+#include <private/channels.h>
 
 #include <proto/audio_stream.h>
 
@@ -30,7 +30,10 @@
 
 #define UDP_PORT_AUDIO (5610)
 
-static shm_t connect_status_shm;
+/* максимальное время сна в ожидании подключения, меньше дедлайна watchdog */
+#define CONNECT_WAIT_TMO (500ULL * TIME_MS)
+
+static connect_status_chan_t connect_status_chan;
 /* локальная копия флага наличия подключения */
 static bool m_connected = false;
 static struct sockaddr_in si_other;
@@ -47,18 +50,18 @@ static void
 check_connect(void)
 {
 	/* читаем статус подключения */
-	connection_state_t *cstate;
-	void *p;
-	shm_map_read(&connect_status_shm, &p);
-	cstate = p;
+	connection_state_t cstate;
+	if (connect_status_snapshot(&connect_status_chan, &cstate) != 0) {
+		return;
+	}
 
-	if (cstate->connected != m_connected) {
+	if (cstate.connected != m_connected) {
 		/* изменилось состояние подключения */
-		m_connected = cstate->connected;
+		m_connected = cstate.connected;
 
 		if (m_connected) {
 			/* меняем адрес у UDP сокета */
-			memcpy(&si_other.sin_addr, &cstate->sin_addr, sizeof(si_other.sin_addr));
+			memcpy(&si_other.sin_addr, &cstate.sin_addr, sizeof(si_other.sin_addr));
 		}
 	}
 }
@@ -222,6 +225,9 @@ audio_start(void)
 
 	encoder_desc_t *encoder = init_encoder(rate, kbitrate, codec);
 
+	svc_metric_t *udp_tx = svc_metric("udp_tx_packets_total", SVC_METRIC_COUNTER);
+	svc_metric_t *udp_tx_err = svc_metric("udp_tx_errors_total", SVC_METRIC_COUNTER);
+
 	/* инициализируем UDP сокет */
 	int s, slen = sizeof(si_other);
 
@@ -271,9 +277,11 @@ audio_start(void)
 			/* UDP send */
 			if (sendto(s, packet.u8, packet.data.hdr.packet_len, 0,
 				   (struct sockaddr *)&si_other, (socklen_t)slen) == -1) {
+				svc_metric_inc(udp_tx_err);
 				fprintf(stderr, "cannot send to socket\n");
 				break;
 			}
+			svc_metric_inc(udp_tx);
 		}
 	}
 
@@ -302,11 +310,12 @@ audio_main(void)
 	int result = 0;
 
 	do {
-		if (!shm_map_open("connect_status", &connect_status_shm)) {
+		if (!connect_status_open(&connect_status_chan)) {
 			break;
 		}
 
-		while (svc_cycle()) {
+		while (svc_check()) {
+			uint32_t index = connect_status_index(&connect_status_chan);
 			check_connect();
 
 			if (m_connected) {
@@ -315,6 +324,13 @@ audio_main(void)
 				if (result != 0) {
 					break;
 				}
+				continue;
+			}
+
+			/* спим до изменения статуса подключения */
+			if (connect_status_wait(&connect_status_chan, index, CONNECT_WAIT_TMO) < 0) {
+				result = 1;
+				break;
 			}
 		}
 	} while (0);
@@ -0,0 +1,290 @@
+/**
+ * @file exporter.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Экспорт показателей сервисов в формате Prometheus
+ *
+ * Супервизор читает контексты сервисов и заголовки каналов общей памяти
+ * только в момент запроса, сервисы в этом не участвуют.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include <log/log.h>
+
+#include <private/channels.h>
+#include <private/exporter.h>
+
+#define EXPORTER_BUF_SIZE (128U * 1024U)
+#define EXPORTER_REQ_SIZE (1024U)
+
+static char body[EXPORTER_BUF_SIZE];
+static size_t body_len;
+
+/* каналы открываются при первом запросе: к этому времени их создали *_init() */
+#define CHANNEL_STATE(name, type, version, copies, type_size)                                      \
+	static name##_chan_t name##_exp;                                                           \
+	static bool name##_exp_open = false;
+
+SHM_CHANNEL_LIST(CHANNEL_STATE)
+
+static void
+out(const char format[], ...)
+{
+	if (body_len >= (sizeof(body) - 1U)) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	int r = vsnprintf(&body[body_len], sizeof(body) - body_len, format, args);
+	va_end(args);
+
+	if (r > 0) {
+		body_len += (size_t)r;
+		if (body_len >= sizeof(body)) {
+			body_len = sizeof(body) - 1U;
+		}
+	}
+}
+
+static void
+family(const char name[], const char type[], const char help[])
+{
+	out("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+histogram(const char name[], const char help[], const exporter_svc_t svc[], size_t count,
+	  size_t offset_hist, size_t offset_sum)
+{
+	size_t i;
+
+	family(name, "histogram", help);
+
+	for (i = 0U; i < count; i++) {
+		const svc_timing_t *t = &svc[i].ctx->timing;
+		const uint64_t *hist = (const uint64_t *)((const uint8_t *)t + offset_hist);
+		const uint64_t *sum = (const uint64_t *)((const uint8_t *)t + offset_sum);
+
+		if (t->cycles == 0ULL) {
+			continue;
+		}
+
+		/* корзина b - до 2^b мкс, последняя открыта */
+		uint64_t cumulative = 0ULL;
+		uint32_t b;
+		for (b = 0U; b < (SVC_HIST_BUCKETS - 1U); b++) {
+			cumulative += hist[b];
+			out("%s_bucket{svc=\"%s\",le=\"%.6f\"} %llu\n", name, svc[i].name,
+			    (double)(1ULL << b) * 1e-6, (unsigned long long)cumulative);
+		}
+		cumulative += hist[b];
+		out("%s_bucket{svc=\"%s\",le=\"+Inf\"} %llu\n", name, svc[i].name,
+		    (unsigned long long)cumulative);
+		out("%s_sum{svc=\"%s\"} %.9f\n", name, svc[i].name, (double)*sum / (double)TIME_S);
+		out("%s_count{svc=\"%s\"} %llu\n", name, svc[i].name,
+		    (unsigned long long)cumulative);
+	}
+}
+
+static void
+svc_metrics(const exporter_svc_t svc[], size_t count)
+{
+	size_t i;
+
+	family("rhex_svc_up", "gauge", "Service process is running");
+	for (i = 0U; i < count; i++) {
+		out("rhex_svc_up{svc=\"%s\"} %u\n", svc[i].name, svc[i].up ? 1U : 0U);
+	}
+
+	family("rhex_svc_restarts_total", "counter", "Service restarts by the supervisor");
+	for (i = 0U; i < count; i++) {
+		out("rhex_svc_restarts_total{svc=\"%s\"} %u\n", svc[i].name, svc[i].restarts);
+	}
+
+	family("rhex_svc_overruns_total", "counter", "Missed service cycle periods");
+	for (i = 0U; i < count; i++) {
+		if (svc[i].ctx->period > 0ULL) {
+			out("rhex_svc_overruns_total{svc=\"%s\"} %llu\n", svc[i].name,
+			    (unsigned long long)svc[i].ctx->timing.overruns);
+		}
+	}
+
+	histogram("rhex_svc_cycle_late_seconds", "Service cycle wake-up lateness", svc, count,
+		  offsetof(svc_timing_t, late_hist), offsetof(svc_timing_t, late_sum));
+	histogram("rhex_svc_cycle_work_seconds", "Service cycle work duration", svc, count,
+		  offsetof(svc_timing_t, work_hist), offsetof(svc_timing_t, work_sum));
+
+	family("rhex_log_dropped_total", "counter", "Log messages dropped on ring overflow");
+	for (i = 0U; i < count; i++) {
+		const log_buffer_t *log = svc[i].ctx->log_buffer;
+		if (log != NULL) {
+			out("rhex_log_dropped_total{svc=\"%s\"} %u\n", svc[i].name,
+			    __atomic_load_n(&log->dropped, __ATOMIC_RELAXED));
+		}
+	}
+}
+
+/* показатели, зарегистрированные сервисами: одно семейство на имя */
+static void
+user_metrics(const exporter_svc_t svc[], size_t count)
+{
+	size_t i;
+
+	for (i = 0U; i < count; i++) {
+		const svc_metrics_t *metrics = &svc[i].ctx->metrics;
+		uint32_t n = __atomic_load_n(&metrics->count, __ATOMIC_ACQUIRE);
+		uint32_t m;
+
+		for (m = 0U; m < n; m++) {
+			const svc_metric_t *metric = &metrics->metric[m];
+
+			/* семейство уже выведено вместе с первым сервисом, где оно встретилось */
+			bool seen = false;
+			size_t j;
+			for (j = 0U; (j < i) && !seen; j++) {
+				const svc_metrics_t *prev = &svc[j].ctx->metrics;
+				uint32_t pn = __atomic_load_n(&prev->count, __ATOMIC_ACQUIRE);
+				uint32_t k;
+				for (k = 0U; k < pn; k++) {
+					if (strcmp(prev->metric[k].name, metric->name) == 0) {
+						seen = true;
+						break;
+					}
+				}
+			}
+			if (seen) {
+				continue;
+			}
+
+			out("# TYPE rhex_%s %s\n", metric->name,
+			    (metric->type == SVC_METRIC_COUNTER) ? "counter" : "gauge");
+
+			for (j = i; j < count; j++) {
+				const svc_metrics_t *other = &svc[j].ctx->metrics;
+				uint32_t on = __atomic_load_n(&other->count, __ATOMIC_ACQUIRE);
+				uint32_t k;
+				for (k = 0U; k < on; k++) {
+					if (strcmp(other->metric[k].name, metric->name) == 0) {
+						out("rhex_%s{svc=\"%s\"} %llu\n", metric->name,
+						    svc[j].name,
+						    (unsigned long long)svc_metric_get(
+							&other->metric[k]));
+					}
+				}
+			}
+		}
+	}
+}
+
+static void
+channel_metrics(void)
+{
+	family("rhex_shm_publish_total", "counter", "Publications to a shared memory channel");
+
+#define CHANNEL_INDEX(name, type, version, copies, type_size)                                      \
+	if (!name##_exp_open) {                                                                    \
+		name##_exp_open = name##_open(&name##_exp);                                        \
+	}                                                                                          \
+	if (name##_exp_open) {                                                                     \
+		out("rhex_shm_publish_total{channel=\"%s\"} %u\n", #name,                          \
+		    name##_index(&name##_exp) - SHM_START_IDX);                                    \
+	}
+
+	SHM_CHANNEL_LIST(CHANNEL_INDEX)
+
+#undef CHANNEL_INDEX
+}
+
+int
+exporter_init(uint16_t port)
+{
+	int sock = -1;
+
+	do {
+		sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sock < 0) {
+			log_err("exporter: cannot create socket");
+			break;
+		}
+
+		int on = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		/* соединение будит супервизор только вместе с запросом */
+		int defer = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+		    (listen(sock, 4) != 0)) {
+			log_err("exporter: cannot listen on port %u", port);
+			close(sock);
+			sock = -1;
+			break;
+		}
+
+		log_inf("metrics on http://127.0.0.1:%u/metrics", port);
+	} while (false);
+
+	return sock;
+}
+
+void
+exporter_serve(int listen_fd, const exporter_svc_t svc[], size_t count)
+{
+	int fd;
+
+	/*
+	 * Обслуживание идет в цикле супервизора, поэтому без ожиданий: сокет
+	 * неблокирующий, запрос должен уже лежать в сокете, ответ уходит в
+	 * буфер передачи целиком или соединение закрывается. Медленный клиент
+	 * не задерживает разбор журналов и контроль дедлайнов.
+	 */
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		/* запрос не разбираем: любой путь отдает показатели */
+		char req[EXPORTER_REQ_SIZE];
+		if (recv(fd, req, sizeof(req), MSG_DONTWAIT) <= 0) {
+			close(fd);
+			continue;
+		}
+
+		body_len = 0U;
+		svc_metrics(svc, count);
+		user_metrics(svc, count);
+		channel_metrics();
+
+		char hdr[128];
+		int hlen = snprintf(hdr, sizeof(hdr),
+				    "HTTP/1.0 200 OK\r\n"
+				    "Content-Type: text/plain; version=0.0.4\r\n"
+				    "Content-Length: %zu\r\n\r\n",
+				    body_len);
+
+		if (send(fd, hdr, (size_t)hlen, MSG_NOSIGNAL | MSG_DONTWAIT) == hlen) {
+			size_t sent = 0U;
+			while (sent < body_len) {
+				ssize_t r = send(fd, &body[sent], body_len - sent,
+					     MSG_NOSIGNAL | MSG_DONTWAIT);
+				if (r <= 0) {
+					break;
+				}
+				sent += (size_t)r;
+			}
+		}
+
+		close(fd);
+	}
+}
@@ -11,9 +11,9 @@
 #include <termios.h>
 
 #include <log/log.h>
-#include <svc/sharedmem.h>
 #include <svc/svc.h>
 
+#include <private/channels.h>
 #include <private/gps.h>
 #include <private/minmea.h>
 
@@ -24,7 +24,7 @@ typedef struct {
 	unsigned int value;
 } speed_map;
 
-static shm_t gps_shm;
+static shm_gps_chan_t gps_chan;
 
 static const speed_map speeds[] = {
     {B0, 0},	     {B50, 50},	      {B75, 75},	 {B110, 110},	    {B134, 134},
@@ -228,7 +228,7 @@ parse_line(const char *line)
 			tmp_gps_status.speed = minmea_tofloat(&frame.speed) * 1.852f;
 			tmp_gps_status.course = minmea_tofloat(&frame.course);
 
-			shm_map_write(&gps_shm, &tmp_gps_status, sizeof(tmp_gps_status));
+			shm_gps_publish(&gps_chan, &tmp_gps_status);
 		} else {
 			log_warn("$xxRMC sentence is not parsed");
 		}
@@ -298,7 +298,7 @@ gps_main(void)
 		return 0;
 	}
 
-	shm_map_open("shm_gps", &gps_shm);
+	shm_gps_open(&gps_chan);
 
 	const unsigned char ubxRate10Hz[] = {0x06, 0x08, 0x06, 0x00, 100,
 					     0x00, 0x01, 0x00, 0x01, 0x00};
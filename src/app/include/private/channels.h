@@ -0,0 +1,113 @@
+/**
+ * @file channels.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Реестр каналов общей памяти между сервисами
+ */
+
+#pragma once
+
+#include <log/log.h>
+#include <svc/sharedmem.h>
+
+#include <private/gps.h>
+#include <private/motion.h>
+#include <private/network_status.h>
+#include <private/power.h>
+#include <private/sensors.h>
+#include <private/system_telemetry.h>
+
+/*
+ * Каждый канал описывается один раз:
+ * X(имя, тип данных, версия, число копий, ожидаемый размер типа)
+ *
+ * Версия входит в имя объекта общей памяти. При изменении структуры
+ * данных нужно обновить ожидаемый размер и поднять версию, иначе сборка
+ * упадет на проверке ниже.
+ */
+#define SHM_CHANNEL_LIST(X)                                                                        \
+	X(connect_status, connection_state_t, 1, SHM_COPIES, 8U)                                   \
+	X(shm_gps, gps_status_t, 1, SHM_COPIES, 28U)                                               \
+	X(shm_sensors, sensors_status_t, 1, SHM_COPIES, 48U)                                       \
+	X(sys_status, sys_telemetry_data_t, 1, SHM_COPIES, 7U)                                     \
+	X(modem_status, modem_status_t, 1, SHM_COPIES, 36U)                                        \
+	X(motion_status, motion_telemetry_t, 2, SHM_COPIES, 344U)
+
+#define SHM_CHANNEL_NAME(name, version) #name "_v" #version
+
+/*
+ * Для канала name генерируются:
+ * name_chan_t - описатель канала,
+ * name_create() - создание канала (в родительском процессе, из *_init()),
+ * name_open() - открытие с проверкой размера данных,
+ * name_publish() - публикация данных,
+ * name_snapshot() - согласованное чтение последних данных,
+ * name_begin_write()/name_commit() - запись на месте,
+ * name_begin_update()/name_commit() - правка копии последних данных,
+ * name_index()/name_wait() - ожидание новых данных.
+ */
+#define SHM_CHANNEL_DECLARE(name, type, version, copies, type_size)                                \
+	_Static_assert(sizeof(type) == (type_size), #name ": layout of " #type " changed");        \
+	_Static_assert(_Alignof(type) <= sizeof(uint64_t), #name ": " #type " is overaligned");    \
+	_Static_assert(SHM_COPIES_VALID(copies), #name ": copies must be a power of two <= max");  \
+                                                                                                   \
+	typedef struct {                                                                           \
+		shm_t shm;                                                                         \
+	} name##_chan_t;                                                                           \
+                                                                                                   \
+	static inline bool name##_create(void)                                                     \
+	{                                                                                          \
+		return shm_map_init(SHM_CHANNEL_NAME(name, version), sizeof(type), (copies));      \
+	}                                                                                          \
+                                                                                                   \
+	static inline bool name##_open(name##_chan_t *ch)                                          \
+	{                                                                                          \
+		if (!shm_map_open(SHM_CHANNEL_NAME(name, version), &ch->shm)) {                    \
+			return false;                                                              \
+		}                                                                                  \
+		if (ch->shm.size != sizeof(type)) {                                                \
+			log_err(#name ": size mismatch %zu != %zu", ch->shm.size, sizeof(type));   \
+			ch->shm.guard = 0ULL;                                                      \
+			return false;                                                              \
+		}                                                                                  \
+		return true;                                                                       \
+	}                                                                                          \
+                                                                                                   \
+	static inline int32_t name##_publish(name##_chan_t *ch, const type *data)                  \
+	{                                                                                          \
+		return shm_map_write(&ch->shm, data, sizeof(type));                                \
+	}                                                                                          \
+                                                                                                   \
+	static inline int32_t name##_snapshot(name##_chan_t *ch, type *data)                       \
+	{                                                                                          \
+		return shm_map_read(&ch->shm, data, sizeof(type));                                 \
+	}                                                                                          \
+                                                                                                   \
+	static inline type *name##_begin_write(name##_chan_t *ch)                                  \
+	{                                                                                          \
+		return shm_map_begin_write(&ch->shm);                                              \
+	}                                                                                          \
+                                                                                                   \
+	static inline type *name##_begin_update(name##_chan_t *ch)                                 \
+	{                                                                                          \
+		return shm_map_begin_update(&ch->shm);                                             \
+	}                                                                                          \
+                                                                                                   \
+	static inline int32_t name##_commit(name##_chan_t *ch)                                     \
+	{                                                                                          \
+		return shm_map_commit(&ch->shm);                                                   \
+	}                                                                                          \
+                                                                                                   \
+	static inline uint32_t name##_index(name##_chan_t *ch)                                     \
+	{                                                                                          \
+		return shm_map_index(&ch->shm);                                                    \
+	}                                                                                          \
+                                                                                                   \
+	static inline int32_t name##_wait(name##_chan_t *ch, uint32_t last_index,                  \
+					  uint64_t timeout)                                        \
+	{                                                                                          \
+		return shm_map_wait(&ch->shm, last_index, timeout);                                \
+	}
+
+SHM_CHANNEL_LIST(SHM_CHANNEL_DECLARE)
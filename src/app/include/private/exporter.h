@@ -0,0 +1,25 @@
+/**
+ * @file exporter.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Экспорт показателей сервисов в формате Prometheus
+ */
+
+#pragma once
+
+#include <svc/svc.h>
+
+/* состояние сервиса глазами супервизора */
+typedef struct {
+	const char *name;
+	const svc_context_t *ctx;
+	bool up;
+	uint32_t restarts;
+} exporter_svc_t;
+
+/* сокет на 127.0.0.1: port для epoll супервизора, -1 при ошибке */
+int exporter_init(uint16_t port);
+
+/* ответ на одно подключение, вызывается по готовности сокета */
+void exporter_serve(int listen_fd, const exporter_svc_t svc[], size_t count);
@@ -9,11 +9,20 @@
 #pragma once
 
 #include <svc/platform.h>
+#include <svc/task.h>
 
 #define DRIVES_COUNT (6U)
 
 #define DRIVE_ENABLED (1U)
 
+/* интерфейсы шин приводов и освещения; если шины нет, используется первая */
+#define CAN_BUS_DRIVES "can0"
+#define CAN_BUS_LIGHTS "can1"
+
+/* скорость шин и допустимая загрузка, % - бюджет передачи на цикл */
+#define CAN_BITRATE (500000U)
+#define CAN_LOAD_MAX (70U)
+
 typedef struct {
 	uint32_t flags;
 	int32_t rpm;
@@ -29,14 +38,31 @@ typedef struct {
 	int16_t pid_pos_now_X50;
 	int32_t tacho_value;
 	int16_t v_in_X10;
-	int16_t __pad[3U];
+	int16_t __pad;
+	uint32_t jitter_us;   /* сглаженный разброс интервалов между пакетами STATUS */
+	uint64_t last_update; /* время приема последнего STATUS, svc_get_monotime() */
 } drive_telemetry_t;
 
 typedef struct {
 	drive_telemetry_t dt[DRIVES_COUNT];
 	uint32_t mode;
+	uint32_t __pad;
 } motion_telemetry_t;
 
+/* обороты и токи привода без обновления дольше этого считаются устаревшими */
+#define DRIVE_STATUS_STALE (200ULL * TIME_MS)
+
+static inline bool
+drive_status_fresh(const drive_telemetry_t *dt, uint64_t now)
+{
+	return (dt->last_update != 0ULL) &&
+	       ((now < dt->last_update) || ((now - dt->last_update) <= DRIVE_STATUS_STALE));
+}
+
 int motion_init(void);
 
 int motion_main(void);
+
+extern const svc_task_t motion_task;
+
+void motion_stop(void);
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <svc/platform.h>
+#include <svc/task.h>
 
 #define OPNAMELEN (32U)
 
@@ -23,3 +24,5 @@ typedef struct {
 int network_status_init(void);
 
 int network_status_main(void);
+
+extern const svc_task_t network_status_task;
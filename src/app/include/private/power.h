@@ -11,6 +11,8 @@
 #include <arpa/inet.h>
 #include <stdbool.h>
 
+#include <svc/task.h>
+
 typedef struct {
 	struct in_addr sin_addr; /* IP адрес */
 	bool connected;
@@ -19,3 +21,5 @@ typedef struct {
 int power_init(void);
 
 int power_main(void);
+
+extern const svc_task_t power_task;
@@ -10,6 +10,8 @@
 
 #include <stdint.h>
 
+#include <svc/task.h>
+
 #define MAXTEMP (6U)
 
 typedef struct {
@@ -20,3 +22,5 @@ typedef struct {
 int system_telemetry_init(void);
 
 int system_telemetry_main(void);
+
+extern const svc_task_t system_telemetry_task;
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <svc/platform.h>
+#include <svc/task.h>
 
 #define RC_TELEMETRY_MAGIC (0x5243535441545553ULL)
 
@@ -81,3 +82,5 @@ typedef struct {
 int telemetry_init(void);
 
 int telemetry_main(void);
+
+extern const svc_task_t telemetry_task;
@@ -6,16 +6,28 @@
  * @brief Точка входа сервиса, основные функции
  */
 
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include <log/log.h>
 #include <log/read.h>
+#include <log/spool.h>
+#include <svc/clock.h>
+#include <svc/memory.h>
+#include <svc/sched.h>
 #include <svc/sharedmem.h>
 #include <svc/svc.h>
+#include <svc/task.h>
 #include <svc/timerfd.h>
 
 #include <private/audio.h>
+#include <private/exporter.h>
 #include <private/gps.h>
 #include <private/motion.h>
 #include <private/network_status.h>
@@ -27,40 +39,186 @@
 
 #define SERVICES_MAX (32U)
 
+/* период отметки watchdog, сервисы считают супервизор мертвым через TIME_DEADLINE */
+#define WATCHDOG_PERIOD (250ULL * TIME_MS)
+
+#define EVENTS_MAX (16U)
+
+/* зависший сервис, не подавший пульс за это время после срока, убивается */
+#define STALL_KILL_TIME (1ULL * TIME_S)
+
+#define STACK_LINE_LEN (256U)
+
+/* период отчета о времени циклов сервисов */
+#define TIMING_REPORT_PERIOD (60ULL * TIME_S)
+
+/* номер "сервиса" для собственного журнала супервизора */
+#define SVC_MAIN_INDEX (SERVICES_MAX)
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open (434)
+#endif
+
+/* сервис с циклом управления: вся память процесса закрепляется в ОЗУ */
+#define SVC_F_MLOCK (1U << 0U)
+/* без сервиса работа невозможна: исчерпав перезапуски, супервизор завершается */
+#define SVC_F_CRITICAL (1U << 1U)
+/* в своем процессе ждет событий без таймера, период нужен только задаче */
+#define SVC_F_EVENTS (1U << 2U)
+
+/* перезапуск с задержкой от 200 мс до 10 с, 5 попыток подряд */
+#define SVC_RESTART_DEFAULT {5U, 200ULL * TIME_MS, 10ULL * TIME_S, 60ULL * TIME_S}
+/* циклы управления поднимаются быстрее */
+#define SVC_RESTART_FAST {10U, 50ULL * TIME_MS, 2ULL * TIME_S, 60ULL * TIME_S}
+
+/*
+ * Раскладка по ядрам: последнее ядро отдано циклам управления в
+ * SCHED_FIFO, кодирование видео и остальные сервисы работают на
+ * остальных и не вытесняют их.
+ */
+#define SVC_CPUS_CONTROL (1U << 3U)
+#define SVC_CPUS_GENERAL ((1U << 0U) | (1U << 1U) | (1U << 2U))
+
+#define SVC_SCHED_CONTROL(prio) {SVC_CPUS_CONTROL, SCHED_FIFO, (prio), 0, 0ULL}
+#define SVC_SCHED_GENERAL(nice, mem) {SVC_CPUS_GENERAL, SCHED_OTHER, 0, (nice), (mem)}
+
+#define MIB (1024ULL * 1024ULL)
+
+/* политика перезапуска сервиса */
 typedef struct {
-	pid_t pid;
-	const char *name;
-	svc_context_t *ctx;
-} svc_t;
+	uint32_t max_restarts; /* перезапусков подряд, 0 - не перезапускать */
+	uint64_t backoff_min;  /* задержка первого перезапуска, дальше удваивается */
+	uint64_t backoff_max;
+	uint64_t stable_time; /* проработав столько, сервис снова считается здоровым */
+} svc_restart_t;
 
 typedef struct {
 	const char *name;
 	int (*init)(void);
 	int (*main)(void);
 	uint64_t period;
+	uint32_t flags;
+	svc_restart_t restart;
+	svc_sched_t sched;
+	void (*stall)(void); /* аварийное действие супервизора при пропуске пульса */
+	const svc_task_t *task; /* может работать задачей общего процесса */
 } svc_desc_t;
 
+typedef struct {
+	pid_t pid; /* 0 - сервис не запущен */
+	int pidfd;
+	const char *name;
+	svc_context_t *ctx;
+	const svc_desc_t *desc;
+	uint32_t host;	     /* чей процесс выполняет сервис: свой номер или процесс задач */
+	uint32_t restarts;   /* перезапусков подряд */
+	uint32_t restarts_total;
+	uint64_t started;    /* время последнего запуска */
+	uint64_t restart_at; /* запланированный перезапуск, 0 - нет */
+	uint64_t overruns_reported;
+	bool stalled; /* пульс просрочен */
+	bool killed;  /* зависший сервис уже убит */
+} svc_t;
+
+/* источники событий супервизора, тип в старших 32 битах epoll_data */
+enum svc_event {
+	EV_TIMER = 0, /**< @brief отметка watchdog, сброс спулера */
+	EV_LOG,	      /**< @brief в журнале сервиса есть сообщения */
+	EV_EXIT,      /**< @brief pidfd сервиса: процесс завершился */
+	EV_SIGCHLD,   /**< @brief SIGCHLD, если ядро не поддерживает pidfd */
+	EV_METRICS    /**< @brief подключение к экспорту показателей */
+};
+
 static svc_t svc_list[SERVICES_MAX];
 static size_t svc_count = 0U;
 static svc_context_t *svc_main;
+static log_spool_t *log_spool = NULL;
+static int epfd = -1;
+static int metrics_fd = -1;
+static int sigchld_fd = -1;
+static int watchdog_fd = -1;
+
+/* легкие периодические сервисы работают задачами одного процесса */
+static bool task_mode = false;
+static uint32_t tasks_index = SERVICES_MAX;
+
+static bool
+event_add(int fd, enum svc_event type, uint32_t index)
+{
+	struct epoll_event ev;
 
-static int
-start_svc(const svc_desc_t *svc_desc)
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)type << 32U) | index;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		log_err("cannot add fd %i to epoll", fd);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief отслеживание завершения сервиса
+ * @details pidfd появился в Linux 5.3; на старых ядрах завершение
+ * отслеживается общим signalfd на SIGCHLD
+ */
+static bool
+watch_exit(svc_t *svc, uint32_t index)
 {
-	if (svc_count == SERVICES_MAX) {
-		log_err("Service list overflow!");
-		return -1;
+	svc->pidfd = (int)syscall(SYS_pidfd_open, svc->pid, 0U);
+	if (svc->pidfd >= 0) {
+		return event_add(svc->pidfd, EV_EXIT, index);
 	}
 
-	log_inf("Starting svc \"%s\"...", svc_desc->name);
+	if (sigchld_fd < 0) {
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
 
-	svc_t *svc = &svc_list[svc_count];
+		sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (sigchld_fd < 0) {
+			log_err("cannot create signalfd");
+			return false;
+		}
 
-	svc->ctx = svc_create_context(svc_desc->name);
-	svc->ctx->log_buffer = log_create(svc_desc->name);
+		return event_add(sigchld_fd, EV_SIGCHLD, 0U);
+	}
+
+	return true;
+}
+
+static void
+close_fd(int *fd)
+{
+	if (*fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+}
 
+/**
+ * @brief запуск процесса сервиса
+ * @details контекст и журнал создаются один раз и переживают перезапуски
+ */
+static int
+spawn_svc(svc_t *svc, uint32_t index)
+{
+	const svc_desc_t *svc_desc = svc->desc;
 	pid_t pid;
 
+	uint32_t i;
+
+	/* срок от прошлого запуска не должен сработать до первого пульса */
+	for (i = 0U; i < svc_count; i++) {
+		svc_t *s = &svc_list[i];
+		if (s->host == index) {
+			__atomic_store_n(&s->ctx->deadline, 0ULL, __ATOMIC_RELAXED);
+			s->stalled = false;
+			s->killed = false;
+		}
+	}
+
 	pid = fork();
 	if (pid == -1) {
 		log_err("cannot fork");
@@ -69,13 +227,37 @@ start_svc(const svc_desc_t *svc_desc)
 
 	if (pid == 0) {
 		/* we are new service */
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		close(epfd);
+
+		/* при перезапуске fork() идет из работающего супервизора: его
+		 * дескрипторы и отображение спулера сервису не нужны */
+		log_spool_forget(log_spool);
+		log_spool = NULL;
+		close_fd(&metrics_fd);
+		close_fd(&sigchld_fd);
+		close_fd(&watchdog_fd);
+		for (i = 0U; i < svc_count; i++) {
+			close_fd(&svc_list[i].pidfd);
+		}
+
 		svc_init_context(svc->ctx);
 
 		prctl(PR_SET_NAME, (unsigned long)svc_desc->name, 0, 0, 0);
 		log_init();
+		svc_startup_mark("process started");
 
-		/* setup timer */
-		svc->ctx->period = svc_desc->period;
+		svc_sched_apply(svc_desc->name, &svc_desc->sched);
+
+		if ((svc_desc->flags & SVC_F_MLOCK) && (svc_mem_get_flags() & SVC_MEM_LOCK)) {
+			svc_mem_lock_all();
+		}
+
+		/* setup timer: без периода нет и учета циклов */
+		svc->ctx->period = (svc_desc->flags & SVC_F_EVENTS) ? 0ULL : svc_desc->period;
 		if (svc->ctx->period > 0ULL) {
 			svc->ctx->timerfd = timerfd_init(svc_desc->period, svc_desc->period);
 			if (svc->ctx->timerfd < 0) {
@@ -87,12 +269,122 @@ start_svc(const svc_desc_t *svc_desc)
 		exit(svc_desc->main());
 	}
 
-	svc->pid = pid;
+	for (i = 0U; i < svc_count; i++) {
+		if (svc_list[i].host == index) {
+			svc_list[i].pid = pid;
+		}
+	}
+
+	svc->started = svc_get_monotime();
+	svc->restart_at = 0ULL;
+
+	if (!watch_exit(svc, index)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief регистрация сервиса без запуска
+ * @return номер сервиса, -1 при ошибке
+ */
+static int
+add_svc(const svc_desc_t *svc_desc)
+{
+	if (svc_count == SERVICES_MAX) {
+		log_err("Service list overflow!");
+		return -1;
+	}
+
+	uint32_t index = (uint32_t)svc_count;
+	svc_t *svc = &svc_list[index];
+
 	svc->name = svc_desc->name;
+	svc->desc = svc_desc;
+	svc->host = index;
+	svc->pidfd = -1;
+	svc->ctx = svc_create_context(svc_desc->name);
+	svc->ctx->log_buffer = log_create(svc_desc->name);
 
 	svc_count++;
 
-	return 0;
+	int notify_fd = log_notify_fd(svc->ctx->log_buffer);
+	if (notify_fd >= 0) {
+		event_add(notify_fd, EV_LOG, index);
+	}
+
+	return (int)index;
+}
+
+static int
+start_svc(const svc_desc_t *svc_desc)
+{
+	log_inf("Starting svc \"%s\"...", svc_desc->name);
+
+	int index = add_svc(svc_desc);
+	if (index < 0) {
+		return -1;
+	}
+
+	return spawn_svc(&svc_list[index], (uint32_t)index);
+}
+
+/**
+ * @brief процесс задач: сервисы, зарегистрированные с host == tasks_index
+ * @details выполняется в дочернем процессе, контексты задач унаследованы
+ */
+static int
+tasks_main(void)
+{
+	static svc_context_t *ctx[SERVICES_MAX];
+	static const svc_task_t *task[SERVICES_MAX];
+	size_t count = 0U;
+	uint32_t i;
+
+	for (i = 0U; i < svc_count; i++) {
+		svc_t *svc = &svc_list[i];
+		if ((svc->host == tasks_index) && (i != tasks_index)) {
+			svc->ctx->period = svc->desc->period;
+			ctx[count] = svc->ctx;
+			task[count] = svc->desc->task;
+			count++;
+		}
+	}
+
+	return svc_tasks_run(ctx, task, count);
+}
+
+/*
+ * Общий процесс задач выполняет и циклы управления, поэтому получает их
+ * приоритет, ядро и закрепление памяти.
+ */
+static const svc_desc_t tasks_desc = {
+    "tasks", NULL, tasks_main, 0ULL, SVC_F_MLOCK | SVC_F_CRITICAL, SVC_RESTART_FAST,
+    SVC_SCHED_CONTROL(50)};
+
+/* запуск легких сервисов задачами одного процесса */
+static int
+start_tasks(const svc_desc_t *const desc[], size_t count)
+{
+	log_inf("Starting %zu svc as tasks...", count);
+
+	int host = add_svc(&tasks_desc);
+	if (host < 0) {
+		return -1;
+	}
+	tasks_index = (uint32_t)host;
+
+	size_t i;
+	for (i = 0U; i < count; i++) {
+		int index = add_svc(desc[i]);
+		if (index < 0) {
+			return -1;
+		}
+		svc_list[index].host = tasks_index;
+	}
+
+	return spawn_svc(&svc_list[tasks_index], tasks_index);
 }
 
 static int
@@ -103,47 +395,446 @@ start_microservices(void)
 		size_t count;
 	} svc_start_list = {
 	    {
-		{"power", power_init, power_main, 10ULL * TIME_MS},
-		{"gps", gps_init, gps_main, 0ULL},
-		{"motion", motion_init, motion_main, 50ULL * TIME_MS},
-		{"sys_stat", system_telemetry_init, system_telemetry_main, 1ULL * TIME_S},
-		{"telemetry", telemetry_init, telemetry_main, 100ULL * TIME_MS},
-		{"video", video_init, video_main, 10ULL * TIME_MS},
-		{"video_pip", video_init, video_pip_main, 10ULL * TIME_MS},
-		{"audio", audio_init, audio_main, 10ULL * TIME_MS},
-		{"voice", voice_init, voice_main, 0ULL},
-		{"netinfo", network_status_init, network_status_main, 1ULL * TIME_S},
+		{"power", power_init, power_main, 10ULL * TIME_MS,
+		 SVC_F_MLOCK | SVC_F_CRITICAL | SVC_F_EVENTS,
+		 SVC_RESTART_FAST, SVC_SCHED_CONTROL(50), NULL, &power_task},
+		{"gps", gps_init, gps_main, 0ULL, 0U, SVC_RESTART_DEFAULT,
+		 SVC_SCHED_GENERAL(0, 0ULL)},
+		{"motion", motion_init, motion_main, 50ULL * TIME_MS, SVC_F_MLOCK | SVC_F_CRITICAL,
+		 SVC_RESTART_FAST, SVC_SCHED_CONTROL(40), motion_stop, &motion_task},
+		{"sys_stat", system_telemetry_init, system_telemetry_main, 1ULL * TIME_S, 0U,
+		 SVC_RESTART_DEFAULT, SVC_SCHED_GENERAL(10, 0ULL), NULL, &system_telemetry_task},
+		{"telemetry", telemetry_init, telemetry_main, 100ULL * TIME_MS, 0U,
+		 SVC_RESTART_DEFAULT, SVC_SCHED_GENERAL(0, 0ULL), NULL, &telemetry_task},
+		{"video", video_init, video_main, 10ULL * TIME_MS, 0U, SVC_RESTART_DEFAULT,
+		 SVC_SCHED_GENERAL(0, 512ULL * MIB)},
+		{"video_pip", video_init, video_pip_main, 10ULL * TIME_MS, 0U, SVC_RESTART_DEFAULT,
+		 SVC_SCHED_GENERAL(0, 512ULL * MIB)},
+		{"audio", audio_init, audio_main, 10ULL * TIME_MS, 0U, SVC_RESTART_DEFAULT,
+		 SVC_SCHED_GENERAL(0, 128ULL * MIB)},
+		{"voice", voice_init, voice_main, 0ULL, 0U, SVC_RESTART_DEFAULT,
+		 SVC_SCHED_GENERAL(0, 128ULL * MIB)},
+		{"netinfo", network_status_init, network_status_main, 1ULL * TIME_S, 0U,
+		 SVC_RESTART_DEFAULT, SVC_SCHED_GENERAL(10, 0ULL), NULL, &network_status_task},
 	    },
 	    10U};
 
 	size_t i;
 
+	/*
+	 * init() только создает каналы общей памяти, которые должны
+	 * существовать до fork(); все тяжелое (GStreamer, устройства, D-Bus)
+	 * делается в процессе сервиса и идет параллельно
+	 */
 	for (i = 0U; i < svc_start_list.count; i++) {
 		svc_start_list.svc[i].init();
 	}
+	svc_startup_mark("channels created");
+
+	const svc_desc_t *tasks[SERVICES_MAX];
+	size_t task_count = 0U;
 
 	for (i = 0U; i < svc_start_list.count; i++) {
-		start_svc(&svc_start_list.svc[i]);
+		const svc_desc_t *desc = &svc_start_list.svc[i];
+		if (task_mode && (desc->task != NULL)) {
+			tasks[task_count++] = desc;
+		} else {
+			start_svc(desc);
+		}
+	}
+
+	if ((task_count > 0U) && (start_tasks(tasks, task_count) != 0)) {
+		return -1;
 	}
 
 	return 0;
 }
 
+static const char *
+log_name(uint32_t index)
+{
+	return (index == SVC_MAIN_INDEX) ? "main" : svc_list[index].name;
+}
+
+static log_buffer_t *
+log_buffer(uint32_t index)
+{
+	return (index == SVC_MAIN_INDEX) ? svc_main->log_buffer : svc_list[index].ctx->log_buffer;
+}
+
+static uint64_t
+restart_backoff(const svc_restart_t *restart, uint32_t attempt)
+{
+	uint64_t backoff = restart->backoff_min;
+
+	while ((attempt > 0U) && (backoff < restart->backoff_max)) {
+		backoff *= 2ULL;
+		attempt--;
+	}
+
+	return (backoff < restart->backoff_max) ? backoff : restart->backoff_max;
+}
+
+static void
+svc_exited(uint32_t index, int wstatus)
+{
+	svc_t *svc = &svc_list[index];
+	const svc_restart_t *restart = &svc->desc->restart;
+
+	if (svc->pidfd >= 0) {
+		/* копии pidfd есть у сервисов, запущенных позже: удаляем из epoll явно */
+		epoll_ctl(epfd, EPOLL_CTL_DEL, svc->pidfd, NULL);
+		close(svc->pidfd);
+		svc->pidfd = -1;
+	}
+
+	/* последние сообщения сервиса; недописанное упавшим писателем выбрасывается */
+	log_print(svc->name, svc->ctx->log_buffer);
+	uint32_t lost = log_reset(svc->ctx->log_buffer);
+
+	if (WIFSIGNALED(wstatus)) {
+		log_err("SVC '%s' PID %i killed by signal %i", svc->name, svc->pid,
+			WTERMSIG(wstatus));
+	} else {
+		log_err("SVC '%s' PID %i EXITED with code %i", svc->name, svc->pid,
+			WEXITSTATUS(wstatus));
+	}
+	if (lost > 0U) {
+		log_warn("SVC '%s': %u unfinished log records discarded", svc->name, lost);
+	}
+
+	uint32_t i;
+	for (i = 0U; i < svc_count; i++) {
+		svc_t *task = &svc_list[i];
+		if ((task->host != index) || (i == index)) {
+			continue;
+		}
+
+		/* задачи завершились вместе с процессом */
+		log_print(task->name, task->ctx->log_buffer);
+		log_reset(task->ctx->log_buffer);
+		task->pid = 0;
+	}
+
+	uint64_t now = svc_get_monotime();
+	if ((now - svc->started) >= restart->stable_time) {
+		svc->restarts = 0U;
+	}
+
+	svc->pid = 0;
+
+	if (svc->restarts < restart->max_restarts) {
+		uint64_t backoff = restart_backoff(restart, svc->restarts);
+		svc->restarts++;
+		svc->restarts_total++;
+		svc->restart_at = now + backoff;
+		log_warn("SVC '%s' restart %u/%u in %llu ms", svc->name, svc->restarts,
+			 restart->max_restarts, backoff / TIME_MS);
+	} else if (svc->desc->flags & SVC_F_CRITICAL) {
+		log_exc("critical SVC '%s' failed, exiting", svc->name);
+		log_print("main", svc_main->log_buffer);
+		log_spool_close(log_spool);
+		exit(1);
+	} else {
+		log_err("SVC '%s' disabled after %u restarts", svc->name, svc->restarts);
+	}
+
+	for (i = 0U; i < svc_count; i++) {
+		if ((svc_list[i].host == index) && (i != index)) {
+			svc_list[i].restarts_total = svc->restarts_total;
+		}
+	}
+}
+
+static void
+check_exit(uint32_t index)
+{
+	/* у задач общий процесс, его завершение обрабатывается один раз */
+	if ((svc_list[index].pid <= 0) || (svc_list[index].host != index)) {
+		return;
+	}
+
+	int wstatus;
+	pid_t result = waitpid(svc_list[index].pid, &wstatus, WNOHANG);
+	if (result > 0) {
+		svc_exited(index, wstatus);
+	}
+}
+
+/* снимок состояния зависшего процесса: где он стоит в ядре */
+static void
+stall_diagnostics(const svc_t *svc)
+{
+	char path[64];
+	char line[STACK_LINE_LEN];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%i/wchan", svc->pid);
+	f = fopen(path, "r");
+	if (f != NULL) {
+		if (fgets(line, sizeof(line), f) != NULL) {
+			log_err("SVC '%s' wchan: %s", svc->name, line);
+		}
+		fclose(f);
+	}
+
+	/* стек ядра доступен только root */
+	snprintf(path, sizeof(path), "/proc/%i/stack", svc->pid);
+	f = fopen(path, "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			log_err("SVC '%s' stack: %s", svc->name, line);
+		}
+		fclose(f);
+	}
+}
+
+/**
+ * @brief проверка пульса сервисов
+ * @details пропуск срока: диагностика и аварийное действие сервиса; если
+ * пульса нет еще STALL_KILL_TIME - SIGABRT (с core dump), дальше работает
+ * политика перезапуска
+ * @return время до следующей проверки для epoll_wait(), мс; -1 - нет
+ */
+static int
+deadline_cycle(void)
+{
+	uint64_t now = svc_get_monotime();
+	uint64_t next = UINT64_MAX;
+	uint32_t i;
+
+	for (i = 0U; i < svc_count; i++) {
+		svc_t *svc = &svc_list[i];
+		uint64_t deadline = __atomic_load_n(&svc->ctx->deadline, __ATOMIC_ACQUIRE);
+		if ((svc->pid <= 0) || (deadline == 0ULL)) {
+			continue;
+		}
+
+		uint64_t heartbeat = __atomic_load_n(&svc->ctx->heartbeat, __ATOMIC_RELAXED);
+		uint64_t due = heartbeat + deadline;
+
+		if (now < due) {
+			if (svc->stalled) {
+				log_warn("SVC '%s' recovered", svc->name);
+				svc->stalled = false;
+			}
+			if (due < next) {
+				next = due;
+			}
+			continue;
+		}
+
+		if (!svc->stalled) {
+			svc->stalled = true;
+			log_err("SVC '%s' PID %i missed heartbeat: %llu ms > %llu ms", svc->name,
+				svc->pid, (now - heartbeat) / TIME_MS, deadline / TIME_MS);
+			if (svc->desc->stall != NULL) {
+				svc->desc->stall();
+			}
+			stall_diagnostics(svc);
+		}
+
+		if ((now - due) >= STALL_KILL_TIME) {
+			if (!svc->killed) {
+				log_err("SVC '%s' PID %i stalled, killing", svc->name, svc->pid);
+				kill(svc->pid, SIGABRT);
+				svc->killed = true;
+			}
+		} else if ((due + STALL_KILL_TIME) < next) {
+			next = due + STALL_KILL_TIME;
+		}
+	}
+
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+
+	return (int)((next - now + TIME_MS - 1ULL) / TIME_MS);
+}
+
+/**
+ * @brief запуск сервисов, у которых истекла задержка перезапуска
+ * @return время до следующего перезапуска для epoll_wait(), мс; -1 - нет
+ */
+static int
+restart_cycle(void)
+{
+	uint64_t now = svc_get_monotime();
+	uint64_t next = UINT64_MAX;
+	uint32_t i;
+
+	for (i = 0U; i < svc_count; i++) {
+		svc_t *svc = &svc_list[i];
+		if (svc->restart_at == 0ULL) {
+			continue;
+		}
+
+		if (svc->restart_at <= now) {
+			log_inf("Restarting svc \"%s\"...", svc->name);
+			if ((spawn_svc(svc, i) != 0) && (svc->pid == 0)) {
+				/* fork не удался, пробуем позже */
+				svc->restart_at = now + svc->desc->restart.backoff_max;
+			}
+		}
+
+		if ((svc->restart_at != 0ULL) && (svc->restart_at < next)) {
+			next = svc->restart_at;
+		}
+	}
+
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+
+	return (int)((next - now + TIME_MS - 1ULL) / TIME_MS);
+}
+
+static void
+timing_report(svc_t *svc)
+{
+	const svc_timing_t *t = &svc->ctx->timing;
+	uint64_t cycles = t->cycles;
+	uint64_t overruns = t->overruns;
+
+	if ((svc->ctx->period == 0ULL) || (cycles == 0ULL)) {
+		return;
+	}
+
+	uint64_t new_overruns = overruns - svc->overruns_reported;
+	svc->overruns_reported = overruns;
+
+	/* сервис, пропускающий периоды, виден в журнале сразу уровнем выше */
+	void (*report)(const char *, ...) = (new_overruns > 0ULL) ? log_warn : log_inf;
+
+	report("timing %s: %llu cycles, %llu overruns (+%llu), late avg %llu max %llu p99 <%llu us, "
+	       "work avg %llu max %llu p99 <%llu us (period %llu us)",
+	       svc->name, cycles, overruns, new_overruns, t->late_sum / cycles / TIME_US,
+	       t->late_max / TIME_US, svc_hist_percentile(t->late_hist, 99U) / TIME_US,
+	       t->work_sum / cycles / TIME_US, t->work_max / TIME_US,
+	       svc_hist_percentile(t->work_hist, 99U) / TIME_US, svc->ctx->period / TIME_US);
+}
+
 static void
-main_cycle(void)
+watchdog_cycle(void)
 {
-	log_print("main", svc_main->log_buffer);
+	static uint64_t last_report = 0ULL;
+
+	uint64_t now = svc_get_monotime();
 	size_t i;
+
 	for (i = 0U; i < svc_count; i++) {
-		svc_list[i].ctx->watchdog = svc_get_monotime();
-		log_print(svc_list[i].name, svc_list[i].ctx->log_buffer);
+		svc_list[i].ctx->watchdog = now;
+	}
+
+	if ((now - last_report) >= TIMING_REPORT_PERIOD) {
+		if (last_report != 0ULL) {
+			for (i = 0U; i < svc_count; i++) {
+				timing_report(&svc_list[i]);
+			}
+		}
+		last_report = now;
+	}
+
+	log_spool_tick(log_spool);
+}
+
+/**
+ * @brief дочитывание журналов перед сном
+ * @details после log_wait_prepare() писатели разбудят супервизор через eventfd
+ */
+static void
+logs_prepare(void)
+{
+	uint32_t i;
+
+	for (i = 0U; i <= svc_count; i++) {
+		uint32_t index = (i == svc_count) ? SVC_MAIN_INDEX : i;
+		log_buffer_t *log = log_buffer(index);
+
+		while (!log_wait_prepare(log)) {
+			log_print(log_name(index), log);
+		}
+	}
+}
+
+static void
+handle_event(const struct epoll_event *ev, int timerfd)
+{
+	enum svc_event type = (enum svc_event)(ev->data.u64 >> 32U);
+	uint32_t index = (uint32_t)ev->data.u64;
+
+	switch (type) {
+	case EV_TIMER:
+		timerfd_wait(timerfd);
+		watchdog_cycle();
+		break;
+
+	case EV_LOG:
+		log_notify_clear(log_buffer(index));
+		log_print(log_name(index), log_buffer(index));
+		break;
+
+	case EV_EXIT:
+		check_exit(index);
+		break;
+
+	case EV_METRICS: {
+		static exporter_svc_t exp[SERVICES_MAX];
+		uint32_t i;
+		for (i = 0U; i < svc_count; i++) {
+			exp[i].name = svc_list[i].name;
+			exp[i].ctx = svc_list[i].ctx;
+			exp[i].up = svc_list[i].pid > 0;
+			exp[i].restarts = svc_list[i].restarts_total;
+		}
+		exporter_serve(metrics_fd, exp, svc_count);
+		break;
+	}
+
+	case EV_SIGCHLD: {
+		struct signalfd_siginfo si;
+		while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si)) {
+		}
+
+		uint32_t i;
+		for (i = 0U; i < svc_count; i++) {
+			check_exit(i);
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+static void
+main_loop(int timerfd)
+{
+	struct epoll_event events[EVENTS_MAX];
+
+	while (true) {
+		int timeout = restart_cycle();
+		int deadline = deadline_cycle();
+		if ((timeout < 0) || ((deadline >= 0) && (deadline < timeout))) {
+			timeout = deadline;
+		}
+
+		logs_prepare();
+
+		int n = epoll_wait(epfd, events, EVENTS_MAX, timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_err("epoll_wait error");
+			break;
+		}
 
-		int wstatus;
-		pid_t result = waitpid(svc_list[i].pid, &wstatus, WNOHANG);
-		if (result > 0) {
-			log_err("SVC '%s' PID %i EXITED", svc_list[i].name, svc_list[i].pid);
-			log_print("main", svc_main->log_buffer);
-			exit(1);
+		int i;
+		for (i = 0; i < n; i++) {
+			handle_event(&events[i], timerfd);
 		}
 	}
 }
@@ -151,26 +842,96 @@ main_cycle(void)
 int
 main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+	int opt;
+	const char *spool_dir = NULL;
+	int metrics_port = -1;
+
+	while ((opt = getopt(argc, argv, "dmp:s:t")) != -1) {
+		switch (opt) {
+		case 'd':
+			/* форматирование логов переносится из сервисов в супервизор */
+			log_set_deferred(true);
+			break;
+		case 'p':
+			/* показатели в формате Prometheus на 127.0.0.1:port */
+			metrics_port = atoi(optarg);
+			break;
+		case 's':
+			spool_dir = optarg;
+			break;
+		case 't':
+			/* для плат с малым ОЗУ: без отдельной копии процесса на каждый сервис */
+			task_mode = true;
+			break;
+		case 'm':
+			/* общая память без страничных промахов, циклы управления в mlockall() */
+			svc_mem_set_flags(SVC_MEM_POPULATE | SVC_MEM_LOCK | SVC_MEM_HUGE);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d] [-m] [-t] [-p metrics_port] [-s spool_dir]\n",
+				argv[0]);
+			return 1;
+		}
+	}
 
 	svc_main = svc_create_context("main");
 	svc_init_context(svc_main);
 	svc_main->log_buffer = log_create("main");
 	log_init();
+	svc_startup_mark("supervisor");
+
+	/* до fork(): сервисы наследуют калибровку, отметки времени сравнимы */
+	svc_clock_init();
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		log_err("cannot create epoll");
+		return 1;
+	}
+
+	watchdog_fd = timerfd_init(WATCHDOG_PERIOD, WATCHDOG_PERIOD);
+	if (watchdog_fd < 0) {
+		return 1;
+	}
 
-	int timerfd;
+	/* SIGCHLD читается через signalfd, если нет pidfd; сервисы его разблокируют */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
-	timerfd = timerfd_init(50ULL * TIME_MS, 50ULL * TIME_MS);
-	if (timerfd < 0) {
+	if (!event_add(watchdog_fd, EV_TIMER, 0U)) {
 		return 1;
 	}
 
+	int notify_fd = log_notify_fd(svc_main->log_buffer);
+	if (notify_fd >= 0) {
+		event_add(notify_fd, EV_LOG, SVC_MAIN_INDEX);
+	}
+
 	if (start_microservices()) {
 		return 1;
 	}
+	svc_startup_mark("services spawned");
+
+	if (spool_dir != NULL) {
+		/* журналы всех сервисов сохраняются на диск через log_print();
+		 * перезапущенный сервис получает копию спулера и закрывает ее сам */
+		log_spool = log_spool_open(spool_dir, LOG_SPOOL_SEGMENT_SIZE, LOG_SPOOL_SEGMENTS);
+		if (log_spool == NULL) {
+			return 1;
+		}
+		log_spool_attach(log_spool);
+	}
 
-	while (timerfd_wait(timerfd)) {
-		main_cycle();
+	if ((metrics_port > 0) && (metrics_port <= UINT16_MAX)) {
+		metrics_fd = exporter_init((uint16_t)metrics_port);
+		if (metrics_fd >= 0) {
+			event_add(metrics_fd, EV_METRICS, 0U);
+		}
 	}
+
+	main_loop(watchdog_fd);
+
+	return 1;
 }
@@ -12,11 +12,13 @@
 #include <math.h>
 #include <termios.h>
 
+#include <io/can_dispatch.h>
 #include <io/canbus.h>
 #include <log/log.h>
-#include <svc/sharedmem.h>
 #include <svc/svc.h>
+#include <svc/wheel.h>
 
+#include <private/channels.h>
 #include <private/motion.h>
 
 #define RC_PORT (5565)
@@ -55,8 +57,9 @@
 #define BTN_C1_LEFT (0x4U)   /* btn[1] */
 #define BTN_C1_CENTER (0x8U) /* btn[1] */
 
-static shm_t motion_telemetry_shm;
+static motion_status_chan_t motion_status_chan;
 
+/* телеметрия приводов, публикуется целиком раз в цикл */
 static motion_telemetry_t mt;
 
 /* текущий счетчик времени */
@@ -71,7 +74,29 @@ enum drive_mode_t {
 
 static enum drive_mode_t dmode = DRIVE_MODE_FREE;
 static enum drive_mode_t cached_dmode = DRIVE_MODE_FREE;
-static uint64_t last_drv_can_tx;
+
+/* пауза в передаче приводам, после которой нужен keepalive */
+#define DRV_KEEPALIVE_TMO (50ULL * TIME_MS)
+/* без команд пульта дольше этого машина останавливается */
+#define RC_LOSS_TMO (500ULL * TIME_MS)
+
+/* статусы шести VESC за цикл с запасом */
+#define CAN_RX_BATCH (128U)
+
+/* шины приводов и освещения, на шасси с одной шиной совпадают */
+static can_t *can = NULL;
+static uint32_t drv_bus = 0U;
+static uint32_t lights_bus = 0U;
+
+/* кадры, для которых в таблице разбора нет обработчика */
+static svc_metric_t *can_rx_unknown;
+
+/* пакеты статуса от приводов, остальное отсекается фильтром в ядре */
+static can_dispatch_t can_routes;
+
+static svc_wheel_t motion_wheel;
+static svc_timer_t drv_keepalive_timer;
+static svc_timer_t rc_loss_timer;
 
 /**
  * @brief ограничение значения в указанных пределах
@@ -197,144 +222,216 @@ vesc_write_i32(const int32_t data, uint8_t *dest)
 	memcpy(dest, v.u8, 4U);
 }
 
-/**
- * @brief разбор сообщений протокола
- * @param msg [in] данные сообщения
+/* интервал между пакетами STATUS и разброс интервалов по приводам, нс */
+static uint64_t drv_interval[DRIVES_COUNT];
+static uint64_t drv_jitter[DRIVES_COUNT];
+
+/*
+ * Время последнего статуса и сглаженный разброс интервалов между ними,
+ * как оценка джиттера в RFC 3550: J += (|D| - J) / 16.
  */
 static void
-parse_msg(const struct can_packet_t *msg)
+drv_status_time(uint8_t drive_id, uint64_t ts)
 {
-	uint8_t drive_id = msg->hdr.id;
-	if (drive_id >= DRIVES_COUNT) {
-		if (msg->hdr.cmd == (uint8_t)VESC_CAN_PACKET_PONG) {
-			/* do nothing */
-			return;
+	drive_telemetry_t *dt = &mt.dt[drive_id];
+
+	if ((dt->last_update != 0ULL) && (ts > dt->last_update)) {
+		uint64_t interval = ts - dt->last_update;
+
+		if (drv_interval[drive_id] != 0ULL) {
+			uint64_t d = (interval > drv_interval[drive_id])
+					 ? (interval - drv_interval[drive_id])
+					 : (drv_interval[drive_id] - interval);
+
+			if (d > drv_jitter[drive_id]) {
+				drv_jitter[drive_id] += (d - drv_jitter[drive_id]) / 16U;
+			} else {
+				drv_jitter[drive_id] -= (drv_jitter[drive_id] - d) / 16U;
+			}
+			dt->jitter_us = (uint32_t)(drv_jitter[drive_id] / TIME_US);
 		}
-		log_warn("unknown msg from drive ID %u", drive_id);
-		log_warn("cmd 0x%02x, len %u", msg->hdr.cmd, msg->len);
-		return;
+		drv_interval[drive_id] = interval;
 	}
 
-	switch (msg->hdr.cmd) {
-	case (uint8_t)VESC_CAN_PACKET_STATUS: {
-		union {
-			const struct {
-				uint32_t rpm;
-				uint16_t current_X10;
-				uint16_t duty_X10;
-			} * status;
-			const uint8_t *p8;
-		} u;
-
-		u.p8 = msg->data;
-
-		mt.dt[drive_id].rpm = vesc_read_i32(u.status->rpm);
-		mt.dt[drive_id].current_X10 = vesc_read_i16(u.status->current_X10);
-		mt.dt[drive_id].duty_X10 = vesc_read_i16(u.status->duty_X10);
-
-		/*log_inf("rpm: %i, current: %.1f, duty: %.3f", mt.dt[drive_id].rpm,
-			vesc_read_float2(u.status->current_X10, 10.0),
-			vesc_read_float2(u.status->duty_X10, 10.0));*/
-		break;
-	}
+	dt->last_update = ts;
+}
 
-	case (uint8_t)VESC_CAN_PACKET_STATUS_2: {
-		union {
-			const struct {
-				uint32_t ah_X10000;
-				uint32_t ahch_X10000;
-			} * status2;
-			const uint8_t *p8;
-		} u;
+/* статус привода: обороты, ток, заполнение */
+static void
+drv_status(const struct can_packet_t *msg, void *arg)
+{
+	uint8_t drive_id = (uint8_t)(uintptr_t)arg;
 
-		u.p8 = msg->data;
+	union {
+		const struct {
+			uint32_t rpm;
+			uint16_t current_X10;
+			uint16_t duty_X10;
+		} * status;
+		const uint8_t *p8;
+	} u;
 
-		mt.dt[drive_id].ah_X10000 = vesc_read_i32(u.status2->ah_X10000);
-		mt.dt[drive_id].ahch_X10000 = vesc_read_i32(u.status2->ahch_X10000);
+	u.p8 = msg->data;
 
-		/*log_inf("consumed: %.4f ah, charged: %.4f ah",
-			vesc_read_float4(u.status2->ah_X10000, 10000.0),
-			vesc_read_float4(u.status2->ahch_X10000, 10000.0));*/
-		break;
+	mt.dt[drive_id].rpm = vesc_read_i32(u.status->rpm);
+	mt.dt[drive_id].current_X10 = vesc_read_i16(u.status->current_X10);
+	mt.dt[drive_id].duty_X10 = vesc_read_i16(u.status->duty_X10);
+
+	/* без отметки ядра неизвестно, сколько кадр пролежал в сокете */
+	if ((msg->flags & CAN_PKT_TS_READ) == 0U) {
+		drv_status_time(drive_id, msg->ts);
 	}
 
-	case (uint8_t)VESC_CAN_PACKET_STATUS_3: {
-		union {
-			const struct {
-				uint32_t wh_X10000;
-				uint32_t whch_X10000;
-			} * status3;
-			const uint8_t *p8;
-		} u;
+	/*log_inf("rpm: %i, current: %.1f, duty: %.3f", mt.dt[drive_id].rpm,
+		vesc_read_float2(u.status->current_X10, 10.0),
+		vesc_read_float2(u.status->duty_X10, 10.0));*/
+}
 
-		u.p8 = msg->data;
+/* статус привода: потребленный и отданный заряд */
+static void
+drv_status_2(const struct can_packet_t *msg, void *arg)
+{
+	uint8_t drive_id = (uint8_t)(uintptr_t)arg;
 
-		mt.dt[drive_id].wh_X10000 = vesc_read_i32(u.status3->wh_X10000);
-		mt.dt[drive_id].whch_X10000 = vesc_read_i32(u.status3->whch_X10000);
+	union {
+		const struct {
+			uint32_t ah_X10000;
+			uint32_t ahch_X10000;
+		} * status2;
+		const uint8_t *p8;
+	} u;
 
-		/*log_inf("consumed: %.4f wh, charged: %.4f wh",
-			vesc_read_float4(u.status3->wh_X10000, 10000.0),
-			vesc_read_float4(u.status3->whch_X10000, 10000.0));*/
-		break;
-	}
+	u.p8 = msg->data;
 
-	case (uint8_t)VESC_CAN_PACKET_STATUS_4: {
-		union {
-			const struct {
-				uint16_t temp_fet_X10;
-				uint16_t temp_motor_X10;
-				uint16_t current_in_X10;
-				uint16_t pid_pos_now_X50;
-			} * status4;
-			const uint8_t *p8;
-		} u;
-
-		u.p8 = msg->data;
-
-		mt.dt[drive_id].temp_fet_X10 = vesc_read_i16(u.status4->temp_fet_X10);
-		mt.dt[drive_id].temp_motor_X10 = vesc_read_i16(u.status4->temp_motor_X10);
-		mt.dt[drive_id].current_in_X10 = vesc_read_i16(u.status4->current_in_X10);
-		mt.dt[drive_id].pid_pos_now_X50 = vesc_read_i16(u.status4->pid_pos_now_X50);
-
-		/*log_inf("temp_fet: %.1f, temp_motor: %.1f, current_in: %.1f, pid_pos: %.2f",
-			vesc_read_float2(u.status4->temp_fet_X10, 10.0),
-			vesc_read_float2(u.status4->temp_motor_X10, 10.0),
-			vesc_read_float2(u.status4->current_in_X10, 10.0),
-			vesc_read_float2(u.status4->pid_pos_now_X50, 50.0));*/
-		break;
-	}
+	mt.dt[drive_id].ah_X10000 = vesc_read_i32(u.status2->ah_X10000);
+	mt.dt[drive_id].ahch_X10000 = vesc_read_i32(u.status2->ahch_X10000);
 
-	case (uint8_t)VESC_CAN_PACKET_STATUS_5: {
-		union {
-			const struct {
-				uint32_t tacho_value;
-				uint16_t v_in_X10;
-				uint16_t reserved;
-			} * status5;
-			const uint8_t *p8;
-		} u;
-
-		u.p8 = msg->data;
-
-		uint16_t V =
-		    u.status5->v_in_X10 & 0xFF7FU; /* накладываем маску, а то лишний бит бывает */
-		mt.dt[drive_id].tacho_value = vesc_read_i32(u.status5->tacho_value);
-		mt.dt[drive_id].v_in_X10 = vesc_read_i16(V);
-
-		/*log_inf("tacho: %i, v_in: %.1f", mt.dt[drive_id].tacho_value,
-			vesc_read_float2(V, 10.0));*/
-		break;
-	}
+	/*log_inf("consumed: %.4f ah, charged: %.4f ah",
+		vesc_read_float4(u.status2->ah_X10000, 10000.0),
+		vesc_read_float4(u.status2->ahch_X10000, 10000.0));*/
+}
 
-	case (uint8_t)VESC_CAN_PACKET_PONG: {
-		/* do nothing */
-		break;
+/* статус привода: потребленная и отданная энергия */
+static void
+drv_status_3(const struct can_packet_t *msg, void *arg)
+{
+	uint8_t drive_id = (uint8_t)(uintptr_t)arg;
+
+	union {
+		const struct {
+			uint32_t wh_X10000;
+			uint32_t whch_X10000;
+		} * status3;
+		const uint8_t *p8;
+	} u;
+
+	u.p8 = msg->data;
+
+	mt.dt[drive_id].wh_X10000 = vesc_read_i32(u.status3->wh_X10000);
+	mt.dt[drive_id].whch_X10000 = vesc_read_i32(u.status3->whch_X10000);
+
+	/*log_inf("consumed: %.4f wh, charged: %.4f wh",
+		vesc_read_float4(u.status3->wh_X10000, 10000.0),
+		vesc_read_float4(u.status3->whch_X10000, 10000.0));*/
+}
+
+/* статус привода: температуры, входной ток, положение */
+static void
+drv_status_4(const struct can_packet_t *msg, void *arg)
+{
+	uint8_t drive_id = (uint8_t)(uintptr_t)arg;
+
+	union {
+		const struct {
+			uint16_t temp_fet_X10;
+			uint16_t temp_motor_X10;
+			uint16_t current_in_X10;
+			uint16_t pid_pos_now_X50;
+		} * status4;
+		const uint8_t *p8;
+	} u;
+
+	u.p8 = msg->data;
+
+	mt.dt[drive_id].temp_fet_X10 = vesc_read_i16(u.status4->temp_fet_X10);
+	mt.dt[drive_id].temp_motor_X10 = vesc_read_i16(u.status4->temp_motor_X10);
+	mt.dt[drive_id].current_in_X10 = vesc_read_i16(u.status4->current_in_X10);
+	mt.dt[drive_id].pid_pos_now_X50 = vesc_read_i16(u.status4->pid_pos_now_X50);
+
+	/*log_inf("temp_fet: %.1f, temp_motor: %.1f, current_in: %.1f, pid_pos: %.2f",
+		vesc_read_float2(u.status4->temp_fet_X10, 10.0),
+		vesc_read_float2(u.status4->temp_motor_X10, 10.0),
+		vesc_read_float2(u.status4->current_in_X10, 10.0),
+		vesc_read_float2(u.status4->pid_pos_now_X50, 50.0));*/
+}
+
+/* статус привода: тахометр, напряжение питания */
+static void
+drv_status_5(const struct can_packet_t *msg, void *arg)
+{
+	uint8_t drive_id = (uint8_t)(uintptr_t)arg;
+
+	union {
+		const struct {
+			uint32_t tacho_value;
+			uint16_t v_in_X10;
+			uint16_t reserved;
+		} * status5;
+		const uint8_t *p8;
+	} u;
+
+	u.p8 = msg->data;
+
+	uint16_t V =
+	    u.status5->v_in_X10 & 0xFF7FU; /* накладываем маску, а то лишний бит бывает */
+	mt.dt[drive_id].tacho_value = vesc_read_i32(u.status5->tacho_value);
+	mt.dt[drive_id].v_in_X10 = vesc_read_i16(V);
+
+	/*log_inf("tacho: %i, v_in: %.1f", mt.dt[drive_id].tacho_value,
+		vesc_read_float2(V, 10.0));*/
+}
+
+/**
+ * @brief маршруты пакетов статуса от приводов
+ * @retval false - таблица маршрутов заполнена
+ */
+static bool
+drv_routes_init(void)
+{
+	static const struct {
+		uint8_t cmd;
+		can_handler_t handler;
+	} status[] = {
+	    {(uint8_t)VESC_CAN_PACKET_STATUS, drv_status},
+	    {(uint8_t)VESC_CAN_PACKET_STATUS_2, drv_status_2},
+	    {(uint8_t)VESC_CAN_PACKET_STATUS_3, drv_status_3},
+	    {(uint8_t)VESC_CAN_PACKET_STATUS_4, drv_status_4},
+	    {(uint8_t)VESC_CAN_PACKET_STATUS_5, drv_status_5},
+	};
+
+	can_dispatch_init(&can_routes);
+
+	uint32_t d;
+	for (d = 0U; d < DRIVES_COUNT; d++) {
+		size_t i;
+		for (i = 0U; i < (sizeof(status) / sizeof(status[0])); i++) {
+			if (!can_dispatch_add(&can_routes, status[i].cmd, (uint8_t)d,
+					      status[i].handler, (void *)(uintptr_t)d)) {
+				return false;
+			}
+		}
 	}
 
-	default:
-		log_inf("recv: from=0x%02X, cmd=0x%02x, data_len=%u", msg->hdr.id, msg->hdr.cmd,
-			msg->len);
-		break;
+	return true;
+}
+
+/* после передачи приводам keepalive откладывается */
+static void
+drv_tx_done(void)
+{
+	/* до motion_start() колеса таймеров еще нет */
+	if (motion_wheel.resolution != 0ULL) {
+		svc_timer_arm(&motion_wheel, &drv_keepalive_timer, cur_mono + DRV_KEEPALIVE_TMO);
 	}
 }
 
@@ -353,27 +450,34 @@ set_drv_duty(uint8_t drv_id, float duty)
 	int32_t conv = (int32_t)(d * 100000.0f);
 	vesc_write_i32(conv, msg.data);
 	msg.len = sizeof(conv);
-	send_can_msg(&msg);
+	can_queue_msg(can, drv_bus, CAN_PRIO_DRIVE, &msg);
 
-	last_drv_can_tx = cur_mono;
+	drv_tx_done();
 }
 
+/* нулевой ток: привод отпущен и катится свободно */
 static void
-drv_free(uint8_t drv_id)
+drv_free_msg(uint8_t drv_id, struct can_packet_t *msg)
 {
-	struct can_packet_t msg = {
-	    0,
-	};
+	memset(msg, 0, sizeof(*msg));
 
-	msg.hdr.cmd = (uint8_t)VESC_CAN_PACKET_SET_CURRENT;
-	msg.hdr.id = drv_id;
+	msg->hdr.cmd = (uint8_t)VESC_CAN_PACKET_SET_CURRENT;
+	msg->hdr.id = drv_id;
 
 	int32_t conv = 0;
-	vesc_write_i32(conv, msg.data);
-	msg.len = sizeof(conv);
-	send_can_msg(&msg);
+	vesc_write_i32(conv, msg->data);
+	msg->len = sizeof(conv);
+}
 
-	last_drv_can_tx = cur_mono;
+static void
+drv_free(uint8_t drv_id)
+{
+	struct can_packet_t msg;
+
+	drv_free_msg(drv_id, &msg);
+	can_queue_msg(can, drv_bus, CAN_PRIO_DRIVE, &msg);
+
+	drv_tx_done();
 }
 
 static void
@@ -386,9 +490,9 @@ drv_keepalive(uint8_t drv_id)
 	msg.hdr.cmd = (uint8_t)VESC_CAN_PACKET_PING;
 	msg.hdr.id = drv_id;
 	msg.len = 0U;
-	send_can_msg(&msg);
+	can_queue_msg(can, drv_bus, CAN_PRIO_KEEPALIVE, &msg);
 
-	last_drv_can_tx = cur_mono;
+	drv_tx_done();
 }
 
 static void
@@ -400,17 +504,35 @@ do_freedrive(void)
 			drv_free(i);
 		}
 		cached_dmode = dmode;
-	} else {
-		if ((cur_mono - last_drv_can_tx) >= (50ULL * TIME_MS)) {
-			/* send keepalive */
-			uint8_t i;
-			for (i = 0U; i < DRIVES_COUNT; i++) {
-				drv_keepalive(i);
-			}
+	}
+}
+
+static void
+drv_keepalive_expired(svc_timer_t *timer, void *arg)
+{
+	(void)timer;
+	(void)arg;
+
+	/* в режиме езды команды идут каждый цикл, пауза бывает только в свободном */
+	if ((dmode == DRIVE_MODE_FREE) && (cached_dmode == DRIVE_MODE_FREE)) {
+		uint8_t i;
+		for (i = 0U; i < DRIVES_COUNT; i++) {
+			drv_keepalive(i);
 		}
 	}
 }
 
+/* модуль оборотов привода, -1 - статус устарел и для антипробуксовки не годится */
+static int
+drv_rpm(size_t idx)
+{
+	if (!drive_status_fresh(&mt.dt[idx], cur_mono)) {
+		return -1;
+	}
+
+	return abs(mt.dt[idx].rpm);
+}
+
 static void
 do_drive(float speed, float steering)
 {
@@ -492,28 +614,26 @@ do_drive(float speed, float steering)
 	static float sd[DRIVES_COUNT] = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
 	/* cast from function ... */
 	int rpm;
-	rpm = abs(mt.dt[0].rpm);
-	float lmin = (float)rpm;
-	rpm = abs(mt.dt[1].rpm);
-	float rmin = (float)rpm;
+	float lmin = HUGE_VALF;
+	float rmin = HUGE_VALF;
 
 	size_t i;
 	size_t idx;
-	for (i = 1U; i < 3U; i++) {
+	for (i = 0U; i < 3U; i++) {
 		/* left */
 		idx = i * 2U;
-		rpm = abs(mt.dt[idx].rpm);
-		if ((float)rpm < lmin) {
-			if (sd[idx] > 0.99f) {
+		rpm = drv_rpm(idx);
+		if ((rpm >= 0) && ((float)rpm < lmin)) {
+			if ((i == 0U) || (sd[idx] > 0.99f)) {
 				lmin = (float)rpm;
 			}
 		}
 
 		/* right */
 		idx = (i * 2U) + 1U;
-		rpm = abs(mt.dt[idx].rpm);
-		if ((float)rpm < rmin) {
-			if (sd[idx] > 0.99f) {
+		rpm = drv_rpm(idx);
+		if ((rpm >= 0) && ((float)rpm < rmin)) {
+			if ((i == 0U) || (sd[idx] > 0.99f)) {
 				rmin = (float)rpm;
 			}
 		}
@@ -522,8 +642,8 @@ do_drive(float speed, float steering)
 	for (i = 0U; i < 3U; i++) {
 		/* left */
 		idx = i * 2U;
-		if (abs(mt.dt[idx].rpm) >= 5) {
-			rpm = abs(mt.dt[idx].rpm);
+		rpm = drv_rpm(idx);
+		if (rpm >= 5) {
 			if (lmin / (float)rpm < 0.9f) {
 				sd[idx] -= 0.05f;
 			} else {
@@ -536,8 +656,8 @@ do_drive(float speed, float steering)
 
 		/* right */
 		idx = (i * 2U) + 1U;
-		if (abs(mt.dt[idx].rpm) >= 5) {
-			rpm = abs(mt.dt[idx].rpm);
+		rpm = drv_rpm(idx);
+		if (rpm >= 5) {
 			if (rmin / (float)rpm < 0.9f) {
 				sd[idx] -= 0.05f;
 			} else {
@@ -558,6 +678,19 @@ do_drive(float speed, float steering)
 	set_drv_duty(5U, rsp * sd[5]);
 }
 
+/*
+ * Команды освещения с низшим приоритетом. Неотправленная команда
+ * заменяется новой для того же канала (первый байт данных), а пакет
+ * синхронизации - новым значением счетчика.
+ */
+static void
+lights_queue(const struct can_packet_t *msg)
+{
+	size_t key_len = (msg->hdr.cmd == (uint8_t)LIGHT_CAN_PACKET_SYNC) ? 0U : 1U;
+
+	can_queue_latest(can, lights_bus, CAN_PRIO_LIGHTS, msg, key_len);
+}
+
 /**
  * @brief режимы работы задних фонарей
  */
@@ -589,7 +722,7 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_STATIC_COLOR;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* red */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -598,14 +731,14 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.data[1U] = 255U;
 			msg.data[2U] = 0U;
 			msg.data[3U] = 0U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* brightness */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_BRIGHTNESS;
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = 32U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 			break;
 
 		case TAIL_LIGHT_MODE_BRAKING:
@@ -614,7 +747,7 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_STATIC_COLOR;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* red */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -623,14 +756,14 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.data[1U] = 255U;
 			msg.data[2U] = 0U;
 			msg.data[3U] = 0U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* brightness */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_BRIGHTNESS;
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = 255U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 			break;
 
 		case TAIL_LIGHT_MODE_EXTRA_BRAKING:
@@ -639,7 +772,7 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_BLINKING;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* red */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -648,21 +781,21 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.data[1U] = 255U;
 			msg.data[2U] = 0U;
 			msg.data[3U] = 0U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* brightness */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_BRIGHTNESS;
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = 255U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* period */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_PERIOD;
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = 5U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 			break;
 
 		case TAIL_LIGHT_MODE_BACK:
@@ -671,7 +804,7 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_STATIC_COLOR;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* red */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -680,14 +813,14 @@ set_tail_light_mode(tail_light_mode_t mode)
 			msg.data[1U] = 255U;
 			msg.data[2U] = 255U;
 			msg.data[3U] = 255U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* brightness */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_BRIGHTNESS;
 			msg.len = 2U;
 			msg.data[0U] = 1U;
 			msg.data[1U] = 255U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 			break;
 		}
 	}
@@ -749,7 +882,7 @@ control_side_lights(bool connected)
 			msg.len = 2U;
 			msg.data[0U] = 0U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_RUNNING_SHAPE;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* green */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -758,13 +891,13 @@ control_side_lights(bool connected)
 			msg.data[1U] = 0U;
 			msg.data[2U] = 255U;
 			msg.data[3U] = 0U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 		} else {
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_MODE;
 			msg.len = 2U;
 			msg.data[0U] = 0U;
 			msg.data[1U] = (uint8_t)LEDS_MODE_FADING;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 
 			/* dark orange */
 			msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_COLOR;
@@ -773,7 +906,7 @@ control_side_lights(bool connected)
 			msg.data[1U] = 64U;
 			msg.data[2U] = 32U;
 			msg.data[3U] = 0U;
-			send_can_msg(&msg);
+			lights_queue(&msg);
 		}
 	}
 }
@@ -795,18 +928,18 @@ control_headlights(float brightness)
 		msg.len = 2U;
 		msg.data[0U] = 0U;
 		msg.data[1U] = (uint8_t)LEDS_MODE_STATIC_COLOR;
-		send_can_msg(&msg);
+		lights_queue(&msg);
 
 		msg.data[0U] = 1U;
-		send_can_msg(&msg);
+		lights_queue(&msg);
 
 		msg.hdr.cmd = (uint8_t)LIGHT_CAN_PACKET_SET_BRIGHTNESS;
 		msg.data[0U] = 0U;
 		msg.data[1U] = val;
-		send_can_msg(&msg);
+		lights_queue(&msg);
 
 		msg.data[0U] = 1U;
-		send_can_msg(&msg);
+		lights_queue(&msg);
 
 		br = val;
 	}
@@ -833,10 +966,10 @@ send_lights_sync(uint32_t counter)
 	msg.data[1U] = u.u8[1];
 	msg.data[2U] = u.u8[2];
 	msg.data[3U] = u.u8[3];
-	send_can_msg(&msg);
+	lights_queue(&msg);
 
 	msg.hdr.id = 101U;
-	send_can_msg(&msg);
+	lights_queue(&msg);
 }
 
 static int
@@ -947,32 +1080,120 @@ camera_control(struct rc_data_t *rc)
 int
 motion_init(void)
 {
-	shm_map_init("motion_status", sizeof(motion_telemetry_shm));
+	motion_status_create();
 
 	return 0;
 }
 
-int
-motion_main(void)
+/* открытие всех CAN шин и выбор шин приводов и освещения */
+static bool
+motion_can_open(void)
 {
-	int result = 0;
+	can = can_open(NULL, 0U);
+	if (can == NULL) {
+		return false;
+	}
+
+	int32_t bus = can_bus_find(can, CAN_BUS_DRIVES);
+	drv_bus = (bus < 0) ? 0U : (uint32_t)bus;
+
+	bus = can_bus_find(can, CAN_BUS_LIGHTS);
+	lights_bus = (bus < 0) ? drv_bus : (uint32_t)bus;
+
+	return true;
+}
+
+/*
+ * Аварийная остановка из супервизора, когда цикл управления завис:
+ * супервизор на время отправки открывает свой сокет только на передачу и
+ * отпускает все приводы. Открытые сокеты и показатели в супервизоре не
+ * остаются и не наследуются перезапущенными сервисами.
+ */
+void
+motion_stop(void)
+{
+	struct can_packet_t msg[DRIVES_COUNT];
+
+	uint8_t i;
+	for (i = 0U; i < DRIVES_COUNT; i++) {
+		drv_free_msg(i, &msg[i]);
+	}
+
+	(void)can_send_once(CAN_BUS_DRIVES, msg, DRIVES_COUNT);
+}
+
+static int rc_sock = -1;
+static struct sockaddr_in rc_sockaddr;
+
+static float rc_speed = 0.0f;
+static float rc_steering = 0.0f;
+static float rc_brightness = 0.0f;
+
+static bool rc_connected = false;
+static uint32_t l_counter = 0U;
+
+static void
+rc_loss_expired(svc_timer_t *timer, void *arg)
+{
+	(void)timer;
+	(void)arg;
+
+	log_warn("RC connection lost! Stop drone!");
+
+	rc_speed = 0;
+	rc_steering = 0;
+	rc_connected = false;
+}
+
+static int
+motion_start(void)
+{
+	int result = -1;
 
 	do {
-		if (can_init() < 0) {
-			result = -1;
+		if (!motion_can_open()) {
+			break;
+		}
+
+		if (!drv_routes_init() || !can_dispatch_filter(&can_routes, can, drv_bus)) {
+			break;
+		}
+
+		/* остальные шины только передают или не используются,
+		 * принимаются лишь кадры ошибок */
+		uint32_t bus;
+		for (bus = 0U; bus < can_bus_count(can); bus++) {
+			if ((bus != drv_bus) && !can_set_filters(can, bus, NULL, 0U)) {
+				break;
+			}
+		}
+		if (bus < can_bus_count(can)) {
 			break;
 		}
 
+		can_rx_unknown = svc_metric("can_rx_unknown_total", SVC_METRIC_COUNTER);
+
+		log_inf("drives on %s, lights on %s", can_bus_name(can, drv_bus),
+			can_bus_name(can, lights_bus));
+
+		for (bus = 0U; bus < can_bus_count(can); bus++) {
+			can_set_budget(can, bus, CAN_BITRATE, get_svc_context()->period, CAN_LOAD_MAX);
+		}
+
 		servo_fd = serial_open("/dev/ttyUSB0", B115200);
 		if (servo_fd < 0) {
-			return 1;
+			break;
 		}
 
-		shm_map_open("motion_status", &motion_telemetry_shm);
+		if (!motion_status_open(&motion_status_chan)) {
+			break;
+		}
+
+		/* после перезапуска сервиса продолжаем с последних опубликованных данных */
+		if (motion_status_snapshot(&motion_status_chan, &mt) != 0) {
+			memset(&mt, 0, sizeof(mt));
+		}
 
-		struct sockaddr_in rc_sockaddr;
-		int rc_sock;
-		socklen_t slen_rc = sizeof(rc_sockaddr);
 		rc_sockaddr.sin_family = AF_INET;
 		rc_sockaddr.sin_port = htons(RC_PORT);
 		rc_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -991,90 +1212,112 @@ motion_main(void)
 		int flags = fcntl(rc_sock, F_GETFL, 0);
 		fcntl(rc_sock, F_SETFL, flags | O_NONBLOCK);
 
-		float speed = 0.0f;
-		float steering = 0.0f;
-		float head_brightness = 0.0f;
-
-		uint64_t last_rc_rx = svc_get_monotime();
-		bool rc_connected = false;
-		uint32_t l_counter = 0U;
-
-		while (svc_cycle()) {
-			cur_mono = svc_get_monotime();
-			uint8_t rc_data[512];
-
-			do {
-				ssize_t data_len =
-				    recvfrom(rc_sock, rc_data, 512U, 0,
-					     (struct sockaddr *)&rc_sockaddr, &slen_rc);
-
-				if (data_len > 0) {
-					union {
-						struct rc_data_t *r;
-						uint8_t *u8;
-					} r;
-
-					r.u8 = rc_data;
-
-					camera_control(r.r);
-
-					speed = (float)(r.r->axis[1] - 1500) / 500.0f;
-					steering = (float)(r.r->axis[0] - 1500) / 500.0f;
-
-					if ((r.r->axis[0] != 1500) || (r.r->axis[1] != 1500)) {
-						dmode = DRIVE_MODE_DRIVE;
-					}
-
-					if (r.r->buttons[1] & BTN_D1) {
-						dmode = DRIVE_MODE_FREE;
-					}
-
-					head_brightness = (float)(r.r->axis[4] - 1500) / 500.0f;
-					if (head_brightness < 0.0f) {
-						head_brightness = 0.0f;
-					}
-
-					last_rc_rx = cur_mono;
-					rc_connected = true;
-				} else {
-					break;
-				}
-			} while (true);
-
-			if (rc_connected) {
-				/* проверка что связь с центром не потеряна */
-				if ((cur_mono - last_rc_rx) > (500ULL * TIME_MS)) {
-					log_warn("RC connection lost! Stop drone!");
-
-					speed = 0;
-					steering = 0;
-					rc_connected = false;
-				}
+		svc_wheel_init(&motion_wheel, TIME_MS, svc_get_monotime());
+		svc_timer_init(&drv_keepalive_timer, drv_keepalive_expired, NULL);
+		svc_timer_init(&rc_loss_timer, rc_loss_expired, NULL);
+
+		/* первый keepalive сразу, как только приводы в свободном режиме */
+		svc_timer_arm(&motion_wheel, &drv_keepalive_timer, svc_get_monotime());
+
+		/* зависший цикл должен быть пойман за два периода: супервизор отпустит приводы */
+		svc_set_deadline(2ULL * get_svc_context()->period);
+
+		result = 0;
+	} while (0);
+
+	return result;
+}
+
+static int
+motion_step(void)
+{
+	socklen_t slen_rc = sizeof(rc_sockaddr);
+
+	cur_mono = svc_cycle_time();
+	uint8_t rc_data[512];
+
+	do {
+		ssize_t data_len = recvfrom(rc_sock, rc_data, 512U, 0,
+					    (struct sockaddr *)&rc_sockaddr, &slen_rc);
+
+		if (data_len > 0) {
+			union {
+				struct rc_data_t *r;
+				uint8_t *u8;
+			} r;
+
+			r.u8 = rc_data;
+
+			camera_control(r.r);
+
+			rc_speed = (float)(r.r->axis[1] - 1500) / 500.0f;
+			rc_steering = (float)(r.r->axis[0] - 1500) / 500.0f;
+
+			if ((r.r->axis[0] != 1500) || (r.r->axis[1] != 1500)) {
+				dmode = DRIVE_MODE_DRIVE;
 			}
 
-			/* парсим входящие сообщения */
-			struct can_packet_t msg;
-			while (read_can_msg(&msg)) {
-				parse_msg(&msg);
+			if (r.r->buttons[1] & BTN_D1) {
+				dmode = DRIVE_MODE_FREE;
 			}
-			mt.mode = (uint32_t)dmode;
-			shm_map_write(&motion_telemetry_shm, &mt, sizeof(mt));
 
-			switch (dmode) {
-			case DRIVE_MODE_DRIVE:
-				do_drive(speed, steering);
-				break;
-			case DRIVE_MODE_FREE:
-			default:
-				do_freedrive();
+			rc_brightness = (float)(r.r->axis[4] - 1500) / 500.0f;
+			if (rc_brightness < 0.0f) {
+				rc_brightness = 0.0f;
 			}
 
-			control_side_lights(rc_connected);
-			control_tail_lights(speed);
-			control_headlights(head_brightness);
-			send_lights_sync(l_counter++);
+			svc_timer_arm(&motion_wheel, &rc_loss_timer, cur_mono + RC_LOSS_TMO);
+			rc_connected = true;
+		} else {
+			break;
 		}
-	} while (0);
+	} while (true);
 
-	return result;
+	/* потеря связи с пультом, keepalive приводам */
+	svc_wheel_run(&motion_wheel, cur_mono);
+
+	/* входящие сообщения разбираются в локальную копию телеметрии */
+	static struct can_packet_t rx[CAN_RX_BATCH];
+	size_t rx_count;
+	do {
+		rx_count = can_read_batch(can, rx, CAN_RX_BATCH, 0);
+
+		size_t i;
+		for (i = 0U; i < rx_count; i++) {
+			if (!can_dispatch(&can_routes, &rx[i])) {
+				svc_metric_inc(can_rx_unknown);
+			}
+		}
+	} while (rx_count == CAN_RX_BATCH);
+	mt.mode = (uint32_t)dmode;
+
+	/* одна публикация за цикл: новый слот, индекс растет, ожидающие просыпаются */
+	motion_status_publish(&motion_status_chan, &mt);
+
+	switch (dmode) {
+	case DRIVE_MODE_DRIVE:
+		do_drive(rc_speed, rc_steering);
+		break;
+	case DRIVE_MODE_FREE:
+	default:
+		do_freedrive();
+	}
+
+	control_side_lights(rc_connected);
+	control_tail_lights(rc_speed);
+	control_headlights(rc_brightness);
+	send_lights_sync(l_counter++);
+
+	/* команды цикла по приоритету одним sendmmsg() на шину, освещение - в остаток бюджета */
+	can_flush(can);
+
+	return 0;
+}
+
+const svc_task_t motion_task = {motion_start, motion_step};
+
+int
+motion_main(void)
+{
+	return svc_task_main(&motion_task);
 }
@@ -6,16 +6,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <private/channels.h>
 #include <private/network_status.h>
 
-#include <svc/sharedmem.h>
 #include <svc/svc.h>
 
 #define MM_DBUS_SERVICE "org.freedesktop.ModemManager1"
 #define MM_DBUS_PATH "/org/freedesktop/ModemManager1"
 #define MM_DBUS_GET_PROPERTIES "org.freedesktop.DBus.Properties.Get"
 
-static shm_t modem_status_shm;
+static modem_status_chan_t modem_status_chan;
 
 typedef enum {
 	MM_MODEM_MODE_NONE = 0,
@@ -184,7 +184,7 @@ modem_status(const char *path)
 			strncpy(ms.OpName, name, OPNAMELEN - 1U);
 		}
 
-		shm_map_write(&modem_status_shm, &ms, sizeof(modem_status_t));
+		modem_status_publish(&modem_status_chan, &ms);
 
 		g_object_unref(ifproxy);
 	} else {
@@ -244,9 +244,9 @@ network_status_init(void)
 	int result = 1;
 
 	do {
-		shm_map_init("modem_status", sizeof(modem_status_t));
+		modem_status_create();
 
-		if (!shm_map_open("modem_status", &modem_status_shm)) {
+		if (!modem_status_open(&modem_status_chan)) {
 			break;
 		}
 
@@ -261,16 +261,22 @@ network_status_init(void)
 	return result;
 }
 
-int
-network_status_main(void)
+static int
+network_status_step(void)
 {
-	while (svc_cycle()) {
-		while (g_main_context_pending(NULL)) {
-			g_main_context_iteration(NULL, TRUE);
-		}
-
-		list_modems();
+	while (g_main_context_pending(NULL)) {
+		g_main_context_iteration(NULL, TRUE);
 	}
 
+	list_modems();
+
 	return 0;
 }
+
+const svc_task_t network_status_task = {NULL, network_status_step};
+
+int
+network_status_main(void)
+{
+	return svc_task_main(&network_status_task);
+}
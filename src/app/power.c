@@ -11,9 +11,11 @@
 
 #include <log/log.h>
 #include <svc/crc.h>
-#include <svc/sharedmem.h>
+#include <svc/metrics.h>
 #include <svc/svc.h>
+#include <svc/wheel.h>
 
+#include <private/channels.h>
 #include <private/power.h>
 
 #define SERVER "192.168.50.100"
@@ -29,6 +31,10 @@
 #define CONNECT_TMO (1000000000ULL)
 #define DISCONNECT_TMO (2000000000ULL)
 
+/* в отдельном процессе сервис спит до пакета или срока таймера, но не дольше */
+#define POWER_IDLE_MAX (100ULL * TIME_MS)
+#define POWER_DEADLINE (3ULL * POWER_IDLE_MAX)
+
 typedef struct {
 	uint64_t magic;
 	uint64_t cmd;
@@ -39,10 +45,54 @@ typedef struct {
 
 static struct sockaddr_in si_other;
 static bool connected = false;
-static uint64_t connect_tm = 0ULL;
-static uint64_t last_keepalive = 0ULL;
+static int power_sock = -1;
+
+static svc_wheel_t power_wheel;
+static svc_timer_t connect_timer;   /* повтор запроса подключения */
+static svc_timer_t keepalive_timer; /* потеря связи без keepalive */
 
-static shm_t connect_status_shm;
+static connect_status_chan_t connect_status_chan;
+/* опубликованное состояние, публикуем только изменения */
+static bool cstate_published = false;
+static bool connected_published = false;
+
+static svc_metric_t *udp_tx_err;
+
+static void
+connect_expired(svc_timer_t *timer, void *arg)
+{
+	(void)arg;
+
+	/* send "connect" command */
+	union {
+		pwr_ctl_t pc;
+		uint8_t u8[sizeof(pwr_ctl_t)];
+	} r;
+
+	r.pc.magic = RC_POWER_MAGIC;
+	r.pc.cmd = RC_CONNECT_CMD;
+	r.pc.CRC = crc16(r.u8, offsetof(pwr_ctl_t, CRC), 0U);
+
+	if (sendto(power_sock, r.u8, sizeof(pwr_ctl_t), 0, (struct sockaddr *)&si_other,
+		   sizeof(si_other)) == -1) {
+		svc_metric_inc(udp_tx_err);
+		log_err("cannot send to socket");
+	}
+
+	svc_timer_arm(&power_wheel, timer, svc_cycle_time() + CONNECT_TMO);
+}
+
+static void
+keepalive_expired(svc_timer_t *timer, void *arg)
+{
+	(void)timer;
+	(void)arg;
+
+	log_warn("disconnected");
+	connected = false;
+
+	svc_timer_arm(&power_wheel, &connect_timer, svc_cycle_time());
+}
 
 static void
 power_cmd_read(int sock)
@@ -53,36 +103,9 @@ power_cmd_read(int sock)
 	pwr_sockaddr.sin_family = AF_INET;
 	pwr_sockaddr.sin_port = htons(PORT);
 	pwr_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	uint64_t mono = svc_get_monotime();
 
 	connection_state_t cstate;
 
-	if (!connected) {
-		if ((mono - connect_tm) >= CONNECT_TMO) {
-			/* send "connect" command */
-
-			union {
-				pwr_ctl_t pc;
-				uint8_t u8[sizeof(pwr_ctl_t)];
-			} r;
-
-			r.pc.magic = RC_POWER_MAGIC;
-			r.pc.cmd = RC_CONNECT_CMD;
-			r.pc.CRC = crc16(r.u8, offsetof(pwr_ctl_t, CRC), 0U);
-			connect_tm = mono;
-
-			if (sendto(sock, r.u8, sizeof(pwr_ctl_t), 0, (struct sockaddr *)&si_other,
-				   slen) == -1) {
-				log_err("cannot send to socket");
-			}
-		}
-	} else {
-		if ((mono - last_keepalive) >= DISCONNECT_TMO) {
-			log_warn("disconnected");
-			connected = false;
-		}
-	}
-
 	do {
 		uint8_t data[sizeof(pwr_ctl_t)];
 		ssize_t data_len = recvfrom(sock, data, sizeof(pwr_ctl_t), 0,
@@ -124,10 +147,13 @@ power_cmd_read(int sock)
 
 				case RC_KEEPALIVE_CMD:
 					/* reply keepalive */
-					last_keepalive = mono;
+					svc_timer_cancel(&power_wheel, &connect_timer);
+					svc_timer_arm(&power_wheel, &keepalive_timer,
+						      svc_cycle_time() + DISCONNECT_TMO);
 					connected = true;
 					if (sendto(sock, r.u8, sizeof(pwr_ctl_t), 0,
 						   (struct sockaddr *)&si_other, slen) == -1) {
+						svc_metric_inc(udp_tx_err);
 						log_err("cannot send to socket");
 					}
 					break;
@@ -141,9 +167,18 @@ power_cmd_read(int sock)
 		}
 	} while (true);
 
-	cstate.connected = connected;
-	memcpy(&cstate.sin_addr, &si_other.sin_addr, sizeof(si_other.sin_addr));
-	shm_map_write(&connect_status_shm, &cstate, sizeof(connection_state_t));
+	if (!cstate_published || (connected != connected_published)) {
+		/* читатели ждут изменения индекса в shm_map_wait() */
+		cstate.connected = connected;
+		memcpy(&cstate.sin_addr, &si_other.sin_addr, sizeof(si_other.sin_addr));
+		if (connect_status_publish(&connect_status_chan, &cstate) == 0) {
+			if (connected && !connected_published) {
+				svc_startup_mark("control station connected");
+			}
+			cstate_published = true;
+			connected_published = connected;
+		}
+	}
 }
 
 int
@@ -152,9 +187,9 @@ power_init(void)
 	int result = 1;
 
 	do {
-		shm_map_init("connect_status", sizeof(connection_state_t));
+		connect_status_create();
 
-		if (!shm_map_open("connect_status", &connect_status_shm)) {
+		if (!connect_status_open(&connect_status_chan)) {
 			break;
 		}
 
@@ -164,12 +199,14 @@ power_init(void)
 	return result;
 }
 
-int
-power_main(void)
+static int
+power_start(void)
 {
 	int result = 1;
 
 	do {
+		udp_tx_err = svc_metric("udp_tx_errors_total", SVC_METRIC_COUNTER);
+
 		/* UDP init */
 		int s;
 
@@ -201,10 +238,51 @@ power_main(void)
 		int flags = fcntl(s, F_GETFL, 0);
 		fcntl(s, F_SETFL, flags | O_NONBLOCK);
 
-		while (svc_cycle()) {
-			power_cmd_read(s);
-		}
+		power_sock = s;
+
+		svc_wheel_init(&power_wheel, TIME_MS, svc_get_monotime());
+		svc_timer_init(&connect_timer, connect_expired, NULL);
+		svc_timer_init(&keepalive_timer, keepalive_expired, NULL);
+		svc_timer_arm(&power_wheel, &connect_timer, svc_get_monotime());
+
+		result = 0;
 	} while (0);
 
 	return result;
 }
+
+static int
+power_step(void)
+{
+	svc_wheel_run(&power_wheel, svc_cycle_time());
+	power_cmd_read(power_sock);
+
+	return 0;
+}
+
+const svc_task_t power_task = {power_start, power_step};
+
+int
+power_main(void)
+{
+	/*
+	 * В отдельном процессе цикл не нужен: сервис спит до пакета от
+	 * станции или до срока таймера подключения.
+	 */
+	if (power_start() == 0) {
+		svc_set_deadline(POWER_DEADLINE);
+
+		while (svc_check()) {
+			svc_heartbeat();
+
+			if (!svc_wheel_wait(&power_wheel, power_sock, POWER_IDLE_MAX)) {
+				break;
+			}
+
+			power_cmd_read(power_sock);
+		}
+	}
+
+	/* выход из цикла - всегда ошибка */
+	return 1;
+}
@@ -9,12 +9,12 @@
 #include <stdio.h>
 #include <string.h>
 
-#include <svc/sharedmem.h>
 #include <svc/svc.h>
 
+#include <private/channels.h>
 #include <private/system_telemetry.h>
 
-static shm_t sys_status_shm;
+static sys_status_chan_t sys_status_chan;
 
 static int8_t
 get_tzone_temp(size_t tzone)
@@ -64,16 +64,19 @@ get_cpuload(void)
 static void
 read_status(void)
 {
-	sys_telemetry_data_t td;
+	sys_telemetry_data_t *td = sys_status_begin_write(&sys_status_chan);
+	if (td == NULL) {
+		return;
+	}
 
-	td.cpuload = get_cpuload();
+	td->cpuload = get_cpuload();
 	size_t i;
 
 	for (i = 0U; i < MAXTEMP; i++) {
-		td.temp[i] = get_tzone_temp(i);
+		td->temp[i] = get_tzone_temp(i);
 	}
 
-	shm_map_write(&sys_status_shm, &td, sizeof(sys_telemetry_data_t));
+	sys_status_commit(&sys_status_chan);
 }
 
 int
@@ -82,9 +85,9 @@ system_telemetry_init(void)
 	int result = 1;
 
 	do {
-		shm_map_init("sys_status", sizeof(sys_telemetry_data_t));
+		sys_status_create();
 
-		if (!shm_map_open("sys_status", &sys_status_shm)) {
+		if (!sys_status_open(&sys_status_chan)) {
 			break;
 		}
 
@@ -94,14 +97,18 @@ system_telemetry_init(void)
 	return result;
 }
 
-int
-system_telemetry_main(void)
+static int
+system_telemetry_step(void)
 {
-	int result = 0;
+	read_status();
 
-	while (svc_cycle()) {
-		read_status();
-	}
+	return 0;
+}
 
-	return result;
+const svc_task_t system_telemetry_task = {NULL, system_telemetry_step};
+
+int
+system_telemetry_main(void)
+{
+	return svc_task_main(&system_telemetry_task);
 }
@@ -12,27 +12,25 @@
 
 #include <log/log.h>
 #include <svc/crc.h>
-#include <svc/sharedmem.h>
+#include <svc/metrics.h>
 #include <svc/svc.h>
 
-#include <private/gps.h>
-#include <private/motion.h>
-#include <private/network_status.h>
-#include <private/power.h>
-#include <private/sensors.h>
-#include <private/system_telemetry.h>
+#include <private/channels.h>
 #include <private/telemetry.h>
 
-static shm_t gps_shm;
-static shm_t sensors_shm;
-static shm_t sys_status_shm;
-static shm_t modem_status_shm;
-static shm_t motion_status_shm;
-static shm_t connect_status_shm;
+static shm_gps_chan_t gps_chan;
+static shm_sensors_chan_t sensors_chan;
+static sys_status_chan_t sys_status_chan;
+static modem_status_chan_t modem_status_chan;
+static motion_status_chan_t motion_status_chan;
+static connect_status_chan_t connect_status_chan;
 
 /* локальная копия флага наличия подключения */
 static bool m_connected = false;
 
+static svc_metric_t *udp_tx;
+static svc_metric_t *udp_tx_err;
+
 #define PORT 5011
 
 #define X1E7 (10000000)
@@ -40,80 +38,78 @@ static bool m_connected = false;
 static void
 read_gps_status(RC_td_t *td)
 {
-	gps_status_t *gps_status;
-	void *p;
+	gps_status_t gps_status;
 
-	shm_map_read(&gps_shm, &p);
-	gps_status = p;
+	if (shm_gps_snapshot(&gps_chan, &gps_status) != 0) {
+		return;
+	}
 
 	float conv;
-	conv = gps_status->latitude;
+	conv = gps_status.latitude;
 	td->gps.LatitudeX1E7 = (int32_t)(conv * X1E7);
 
-	conv = gps_status->longitude;
+	conv = gps_status.longitude;
 	td->gps.LongitudeX1E7 = (int32_t)(conv * X1E7);
 
-	conv = gps_status->speed;
+	conv = gps_status.speed;
 	td->gps.SpeedKPHX10 = (uint16_t)(conv * 10.0f);
 
-	conv = gps_status->course;
+	conv = gps_status.course;
 	td->gps.CourseDegrees = (uint16_t)conv;
 
-	conv = gps_status->altitude;
+	conv = gps_status.altitude;
 	td->gps.GPSAltitudecm = (int32_t)(conv * 100.0f);
 
-	conv = gps_status->hdop;
+	conv = gps_status.hdop;
 	td->gps.HDOPx10 = (uint8_t)(conv * 10.0f);
 
-	td->gps.FixType = gps_status->fix_type;
-	td->gps.SatsInUse = gps_status->sats_use;
-	td->gps.SatsInView = gps_status->sats_view;
+	td->gps.FixType = gps_status.fix_type;
+	td->gps.SatsInUse = gps_status.sats_use;
+	td->gps.SatsInView = gps_status.sats_view;
 }
 
 static void
 read_sensors_status(RC_td_t *td)
 {
-	union {
-		sensors_status_t *s;
-		void *p;
-	} p;
+	sensors_status_t st;
 
-	shm_map_read(&sensors_shm, &p.p);
+	if (shm_sensors_snapshot(&sensors_chan, &st) != 0) {
+		return;
+	}
 
 	double conv;
-	conv = p.s->angle_x;
+	conv = st.angle_x;
 	td->orientation.PitchDegrees = (int16_t)(conv * 10.0);
-	conv = p.s->angle_y;
+	conv = st.angle_y;
 	td->orientation.RollDegrees = (int16_t)(conv * 10.0);
-	conv = p.s->angle_z;
+	conv = st.angle_z;
 	td->orientation.YawDegrees = (int16_t)(conv * 10.0);
 
-	conv = p.s->vbat;
+	conv = st.vbat;
 	td->power.PackVoltageX100 = (uint16_t)(conv * 100.0);
 
-	conv = p.s->curr;
+	conv = st.curr;
 	td->power.PackCurrentX10 = (int16_t)(conv * 10.0);
 
-	conv = p.s->pwr;
+	conv = st.pwr;
 	td->power.mAHConsumed = (uint16_t)conv;
 }
 
 static void
 read_drives_status(RC_td_t *td)
 {
-	union {
-		motion_telemetry_t *s;
-		void *p;
-	} p;
+	motion_telemetry_t st;
 
-	shm_map_read(&motion_status_shm, &p.p);
+	if (motion_status_snapshot(&motion_status_chan, &st) != 0) {
+		return;
+	}
 
 	double conv = 0.0;
 	size_t i;
 	size_t cnt = 0;
 	for (i = 0U; i < DRIVES_COUNT; i++) {
-		conv += (double)p.s->dt[i].v_in_X10;
-		if (p.s->dt[i].v_in_X10 != 0) {
+		conv += (double)st.dt[i].v_in_X10;
+		if (st.dt[i].v_in_X10 != 0) {
 			cnt++;
 		}
 	}
@@ -121,38 +117,53 @@ read_drives_status(RC_td_t *td)
 	conv /= 10.0;
 	td->power.PackVoltageX100 = (uint16_t)(conv * 100.0);
 
+	/* устаревшие обороты и токи не передаются: привод мог пропасть с шины */
+	uint64_t now = svc_cycle_time();
+	bool fresh[DRIVES_COUNT];
+
 	conv = 0.0;
 	for (i = 0U; i < DRIVES_COUNT; i++) {
-		conv += (double)p.s->dt[i].current_X10;
+		fresh[i] = drive_status_fresh(&st.dt[i], now);
+		if (fresh[i]) {
+			conv += (double)st.dt[i].current_X10;
+		}
 	}
 	td->power.PackCurrentX10 = (int16_t)conv;
 
 	for (i = 0U; i < DRIVES_COUNT; i++) {
-		td->drives[i].rpm = p.s->dt[i].rpm;
-		td->drives[i].current_X10 = p.s->dt[i].current_X10;
-		td->drives[i].duty_X10 = p.s->dt[i].duty_X10;
-		td->drives[i].temp_fet_X10 = p.s->dt[i].temp_fet_X10;
-		td->drives[i].temp_motor_X10 = p.s->dt[i].temp_motor_X10;
-		conv = p.s->dt[i].v_in_X10;
-		conv *= p.s->dt[i].current_in_X10;
+		td->drives[i].temp_fet_X10 = st.dt[i].temp_fet_X10;
+		td->drives[i].temp_motor_X10 = st.dt[i].temp_motor_X10;
+
+		if (!fresh[i]) {
+			td->drives[i].rpm = 0;
+			td->drives[i].current_X10 = 0;
+			td->drives[i].duty_X10 = 0;
+			td->drives[i].epower_X10 = 0;
+			continue;
+		}
+
+		td->drives[i].rpm = st.dt[i].rpm;
+		td->drives[i].current_X10 = st.dt[i].current_X10;
+		td->drives[i].duty_X10 = st.dt[i].duty_X10;
+		conv = st.dt[i].v_in_X10;
+		conv *= st.dt[i].current_in_X10;
 		conv /= 100.0;
 		td->drives[i].epower_X10 = (int16_t)(conv * 10.0);
 	}
 
-	td->mode = p.s->mode;
+	td->mode = st.mode;
 }
 
 static void
 read_system_status(RC_td_t *td)
 {
-	union {
-		sys_telemetry_data_t *s;
-		void *p;
-	} p;
+	sys_telemetry_data_t st;
 
-	shm_map_read(&sys_status_shm, &p.p);
+	if (sys_status_snapshot(&sys_status_chan, &st) != 0) {
+		return;
+	}
 
-	td->system.CPUload = p.s->cpuload;
+	td->system.CPUload = st.cpuload;
 	/* 0 - AO temp
 	 * 1 - CPU temp
 	 * 2 - GPU temp
@@ -160,70 +171,73 @@ read_system_status(RC_td_t *td)
 	 * 4 - PMIC temp
 	 * 5 - FAN
 	 */
-	td->system.CPUtemp = p.s->temp[1];
+	td->system.CPUtemp = st.temp[1];
 }
 
 static void
 read_modem_status(RC_td_t *td)
 {
-	union {
-		modem_status_t *s;
-		void *p;
-	} p;
+	modem_status_t st;
 
-	shm_map_read(&modem_status_shm, &p.p);
+	if (modem_status_snapshot(&modem_status_chan, &st) != 0) {
+		return;
+	}
 
-	td->link.Status = p.s->Status;
-	td->link.Mode = p.s->Mode;
-	td->link.Signal = p.s->Signal;
-	strncpy(td->link.OpName, p.s->OpName, OPNAMELEN);
+	td->link.Status = st.Status;
+	td->link.Mode = st.Mode;
+	td->link.Signal = st.Signal;
+	strncpy(td->link.OpName, st.OpName, OPNAMELEN);
 }
 
 int
 telemetry_init(void)
 {
-	shm_map_init("shm_gps", sizeof(gps_status_t));
-	shm_map_init("shm_sensors", sizeof(sensors_status_t));
+	shm_gps_create();
+	shm_sensors_create();
 
 	return 0;
 }
 
-int
-telemetry_main(void)
+static int tm_sock = -1;
+static struct sockaddr_in si_other;
+static RC_td_t rc_td;
+
+static int
+telemetry_start(void)
 {
 	int result = 1;
 
 	do {
 		/* открытие shm */
-		if (!shm_map_open("shm_gps", &gps_shm)) {
+		if (!shm_gps_open(&gps_chan)) {
 			break;
 		}
 
-		if (!shm_map_open("shm_sensors", &sensors_shm)) {
+		if (!shm_sensors_open(&sensors_chan)) {
 			break;
 		}
 
-		if (!shm_map_open("sys_status", &sys_status_shm)) {
+		if (!sys_status_open(&sys_status_chan)) {
 			break;
 		}
 
-		if (!shm_map_open("modem_status", &modem_status_shm)) {
+		if (!modem_status_open(&modem_status_chan)) {
 			break;
 		}
 
-		if (!shm_map_open("motion_status", &motion_status_shm)) {
+		if (!motion_status_open(&motion_status_chan)) {
 			break;
 		}
 
-		if (!shm_map_open("connect_status", &connect_status_shm)) {
+		if (!connect_status_open(&connect_status_chan)) {
 			break;
 		}
 
-		/* инициализируем UDP сокет */
-		struct sockaddr_in si_other;
-		int s, slen = sizeof(si_other);
+		udp_tx = svc_metric("udp_tx_packets_total", SVC_METRIC_COUNTER);
+		udp_tx_err = svc_metric("udp_tx_errors_total", SVC_METRIC_COUNTER);
 
-		if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+		/* инициализируем UDP сокет */
+		if ((tm_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 			log_err("cannot create socket");
 			break;
 		}
@@ -240,50 +254,64 @@ telemetry_main(void)
 
 		m_connected = false;
 
-		RC_td_t rc_td;
 		memset((uint8_t *)&rc_td, 0, sizeof(rc_td));
 		rc_td.magic = RC_TELEMETRY_MAGIC;
 
 		result = 0;
-
-		while (svc_cycle()) {
-			/* читаем статус подключения */
-			connection_state_t *cstate;
-			void *p;
-			shm_map_read(&connect_status_shm, &p);
-			cstate = p;
-
-			if (cstate->connected != m_connected) {
-				/* изменилось состояние подключения */
-				m_connected = cstate->connected;
-
-				if (m_connected) {
-					/* меняем адрес у UDP сокета */
-					memcpy(&si_other.sin_addr, &cstate->sin_addr,
-					       sizeof(si_other.sin_addr));
-				}
-			}
-
-			/* отправляем телеметрию только если есть активное соединение */
-			if (m_connected) {
-				read_gps_status(&rc_td);
-				read_sensors_status(&rc_td);
-				read_system_status(&rc_td);
-				read_modem_status(&rc_td);
-				read_drives_status(&rc_td);
-
-				rc_td.CRC = crc16((uint8_t *)&rc_td, offsetof(RC_td_t, CRC), 0U);
-
-				/* UDP send */
-				if (sendto(s, (uint8_t *)&rc_td, sizeof(rc_td), 0,
-					   (struct sockaddr *)&si_other, (socklen_t)slen) == -1) {
-					log_err("cannot send to socket");
-					result = 1;
-					break;
-				}
-			}
-		}
 	} while (0);
 
 	return result;
 }
+
+static int
+telemetry_step(void)
+{
+	/* читаем статус подключения */
+	connection_state_t cstate;
+	if (connect_status_snapshot(&connect_status_chan, &cstate) != 0) {
+		return 0;
+	}
+
+	if (cstate.connected != m_connected) {
+		/* изменилось состояние подключения */
+		m_connected = cstate.connected;
+
+		if (m_connected) {
+			/* меняем адрес у UDP сокета */
+			memcpy(&si_other.sin_addr, &cstate.sin_addr, sizeof(si_other.sin_addr));
+		}
+	}
+
+	/* отправляем телеметрию только если есть активное соединение */
+	if (m_connected) {
+		read_gps_status(&rc_td);
+		read_sensors_status(&rc_td);
+		read_system_status(&rc_td);
+		read_modem_status(&rc_td);
+		read_drives_status(&rc_td);
+
+		rc_td.CRC = crc16((uint8_t *)&rc_td, offsetof(RC_td_t, CRC), 0U);
+
+		/* UDP send */
+		if (sendto(tm_sock, (uint8_t *)&rc_td, sizeof(rc_td), 0,
+			   (struct sockaddr *)&si_other, (socklen_t)sizeof(si_other)) == -1) {
+			svc_metric_inc(udp_tx_err);
+			log_err("cannot send to socket");
+			return 1;
+		}
+		if (svc_metric_get(udp_tx) == 0ULL) {
+			svc_startup_mark("first telemetry packet");
+		}
+		svc_metric_inc(udp_tx);
+	}
+
+	return 0;
+}
+
+const svc_task_t telemetry_task = {telemetry_start, telemetry_step};
+
+int
+telemetry_main(void)
+{
+	return svc_task_main(&telemetry_task);
+}
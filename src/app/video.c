@@ -44,11 +44,12 @@
 
 #include <gst/gst.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
-#include <svc/sharedmem.h>
+#include <svc/metrics.h>
 #include <svc/svc.h>
 
-#include <private/power.h>
+#include <private/channels.h>
 #include <private/video.h>
 
 #define VIDEO_W (1280)
@@ -66,7 +67,13 @@
 #define UDP_PORT_VIDEO (5600)
 #define UDP_PORT_VIDEO_PIP (5601)
 
-static shm_t connect_status_shm;
+/* максимальное время сна в ожидании подключения, меньше дедлайна watchdog */
+#define CONNECT_WAIT_TMO (500ULL * TIME_MS)
+
+/* кэш реестра плагинов вне домашнего каталога, который может быть в tmpfs */
+#define GST_REGISTRY_CACHE "/var/cache/rhex/gstreamer-registry.bin"
+
+static connect_status_chan_t connect_status_chan;
 /* локальная копия флага наличия подключения */
 static bool m_connected = false;
 static struct in_addr sin_addr; /* IP адрес */
@@ -78,18 +85,18 @@ static void
 check_connect(void)
 {
 	/* читаем статус подключения */
-	connection_state_t *cstate;
-	void *p;
-	shm_map_read(&connect_status_shm, &p);
-	cstate = p;
+	connection_state_t cstate;
+	if (connect_status_snapshot(&connect_status_chan, &cstate) != 0) {
+		return;
+	}
 
-	if (cstate->connected != m_connected) {
+	if (cstate.connected != m_connected) {
 		/* изменилось состояние подключения */
-		m_connected = cstate->connected;
+		m_connected = cstate.connected;
 
 		if (m_connected) {
 			/* меняем адрес у UDP сокета */
-			memcpy(&sin_addr, &cstate->sin_addr, sizeof(sin_addr));
+			memcpy(&sin_addr, &cstate.sin_addr, sizeof(sin_addr));
 		}
 	}
 }
@@ -658,6 +665,7 @@ make_encoder(struct encoder_data_t *edata, enum encoder_type_t etype, uint32_t b
 
 	g_object_set(edata->encoder, "bitrate", bitrate, "iframeinterval", 60, "preset-level", 3,
 		     "control-rate", 0, "maxperf-enable", true, "profile", 2, NULL);
+	svc_metric_set(svc_metric("video_encoder_bitrate_bps", SVC_METRIC_GAUGE), bitrate);
 
 	g_object_set(edata->rtppay, "config-interval", 1, "mtu", 1420, "pt", 96, NULL);
 
@@ -679,6 +687,23 @@ struct udpsink_data_t {
 	GstElement *udpsink;
 };
 
+/* подсчет отправленного потока, вызывается в потоке GStreamer */
+static GstPadProbeReturn
+udp_bytes_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	(void)pad;
+	svc_metric_t *bytes = (svc_metric_t *)user_data;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+		svc_metric_add(bytes, gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+	} else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		svc_metric_add(bytes,
+			       gst_buffer_list_calculate_size(GST_PAD_PROBE_INFO_BUFFER_LIST(info)));
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
 /*
  * udpsink host=%s port=%u sync=false async=false
  */
@@ -700,6 +725,14 @@ make_udp_sink(struct udpsink_data_t *udata, uint32_t udp_port)
 	g_object_set(udata->udpsink, "sync", false, NULL);
 	g_object_set(udata->udpsink, "async", false, NULL);
 
+	GstPad *pad = gst_element_get_static_pad(udata->udpsink, "sink");
+	if (pad != NULL) {
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+				  udp_bytes_probe,
+				  svc_metric("video_udp_bytes_total", SVC_METRIC_COUNTER), NULL);
+		gst_object_unref(pad);
+	}
+
 	return 0;
 }
 
@@ -838,6 +871,7 @@ video_start(void)
 	}
 
 	/* start pipeline */
+	svc_startup_mark("video pipeline playing");
 	bus = gst_element_get_bus(pipeline);
 	gst_bus_add_watch(bus, (GstBusFunc)gst_handle_message, NULL);
 
@@ -988,6 +1022,7 @@ video_pip_start(void)
 	}
 
 	/* start pipeline */
+	svc_startup_mark("video pipeline playing");
 	bus = gst_element_get_bus(pipeline);
 	gst_bus_add_watch(bus, (GstBusFunc)gst_handle_message, NULL);
 
@@ -1013,23 +1048,36 @@ video_pip_start(void)
 int
 video_init(void)
 {
-	/* Initialize GStreamer */
-	gst_init(NULL, NULL);
-
+	/* GStreamer инициализируется в процессе сервиса: остальные сервисы
+	 * не наследуют реестр плагинов, и разбор идет параллельно их запуску */
 	return 0;
 }
 
+static void
+video_gst_init(void)
+{
+	/* с сохраненным реестром плагины не сканируются заново, только
+	 * проверяется время изменения файлов */
+	setenv("GST_REGISTRY", GST_REGISTRY_CACHE, 0);
+
+	gst_init(NULL, NULL);
+	svc_startup_mark("gstreamer ready");
+}
+
 int
 video_main(void)
 {
 	int result = 0;
 
+	video_gst_init();
+
 	do {
-		if (!shm_map_open("connect_status", &connect_status_shm)) {
+		if (!connect_status_open(&connect_status_chan)) {
 			break;
 		}
 
-		while (svc_cycle()) {
+		while (svc_check()) {
+			uint32_t index = connect_status_index(&connect_status_chan);
 			check_connect();
 
 			if (m_connected) {
@@ -1037,6 +1085,13 @@ video_main(void)
 				if (result != 0) {
 					break;
 				}
+				continue;
+			}
+
+			/* спим до изменения статуса подключения */
+			if (connect_status_wait(&connect_status_chan, index, CONNECT_WAIT_TMO) < 0) {
+				result = 1;
+				break;
 			}
 		}
 	} while (0);
@@ -1049,12 +1104,15 @@ video_pip_main(void)
 {
 	int result = 0;
 
+	video_gst_init();
+
 	do {
-		if (!shm_map_open("connect_status", &connect_status_shm)) {
+		if (!connect_status_open(&connect_status_chan)) {
 			break;
 		}
 
-		while (svc_cycle()) {
+		while (svc_check()) {
+			uint32_t index = connect_status_index(&connect_status_chan);
 			check_connect();
 
 			if (m_connected) {
@@ -1062,6 +1120,13 @@ video_pip_main(void)
 				if (result != 0) {
 					break;
 				}
+				continue;
+			}
+
+			/* спим до изменения статуса подключения */
+			if (connect_status_wait(&connect_status_chan, index, CONNECT_WAIT_TMO) < 0) {
+				result = 1;
+				break;
 			}
 		}
 	} while (0);
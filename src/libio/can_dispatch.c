@@ -0,0 +1,101 @@
+/**
+ * @file can_dispatch.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Разбор входящих CAN пакетов по командам и источникам
+ */
+
+#include <io/can_dispatch.h>
+#include <log/log.h>
+
+#define ROUTE_MASK (CAN_ROUTES_MAX - 1U)
+
+static inline uint32_t
+route_hash(uint8_t cmd, uint8_t id)
+{
+	/* источников мало и они подряд: id в младших битах разводит их по ячейкам */
+	return ((uint32_t)id ^ ((uint32_t)cmd * 37U)) & ROUTE_MASK;
+}
+
+void
+can_dispatch_init(can_dispatch_t *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+bool
+can_dispatch_add(can_dispatch_t *d, uint8_t cmd, uint8_t id, can_handler_t handler, void *arg)
+{
+	uint32_t h = route_hash(cmd, id);
+	uint32_t i;
+
+	for (i = 0U; i < CAN_ROUTES_MAX; i++) {
+		can_route_t *r = &d->route[(h + i) & ROUTE_MASK];
+
+		if (r->handler == NULL) {
+			if (d->count == (CAN_ROUTES_MAX - 1U)) {
+				/* одна ячейка всегда свободна: поиск промаха конечен */
+				break;
+			}
+			r->cmd = cmd;
+			r->id = id;
+			r->handler = handler;
+			r->arg = arg;
+			d->count++;
+			return true;
+		}
+
+		if ((r->cmd == cmd) && (r->id == id)) {
+			r->handler = handler;
+			r->arg = arg;
+			return true;
+		}
+	}
+
+	log_err("CAN route table overflow");
+
+	return false;
+}
+
+bool
+can_dispatch(const can_dispatch_t *d, const struct can_packet_t *msg)
+{
+	uint32_t h = route_hash(msg->hdr.cmd, msg->hdr.id);
+	uint32_t i;
+
+	for (i = 0U; i < CAN_ROUTES_MAX; i++) {
+		const can_route_t *r = &d->route[(h + i) & ROUTE_MASK];
+
+		if (r->handler == NULL) {
+			break;
+		}
+
+		if ((r->cmd == msg->hdr.cmd) && (r->id == msg->hdr.id)) {
+			r->handler(msg, r->arg);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+can_dispatch_filter(const can_dispatch_t *d, can_t *can, uint32_t bus)
+{
+	static can_filter_t filters[CAN_ROUTES_MAX];
+	size_t count = 0U;
+	uint32_t i;
+
+	for (i = 0U; i < CAN_ROUTES_MAX; i++) {
+		const can_route_t *r = &d->route[i];
+
+		if (r->handler != NULL) {
+			filters[count].cmd = r->cmd;
+			filters[count].id = r->id;
+			count++;
+		}
+	}
+
+	return can_set_filters(can, bus, filters, count);
+}
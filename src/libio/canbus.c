@@ -7,28 +7,225 @@
  */
 
 #include <fcntl.h>
+#include <linux/can/error.h>
 #include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #include <net/if.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #include <io/canbus.h>
 #include <log/log.h>
 #include <netlink/netlink.h>
 #include <proto/vesc_proto.h>
+#include <svc/metrics.h>
 #include <svc/platform.h>
+#include <svc/svc.h>
+
+/* ошибки контроллера, которые ядро передает кадрами с CAN_ERR_FLAG */
+#define CAN_ERR_WATCH                                                                      \
+	(CAN_ERR_TX_TIMEOUT | CAN_ERR_CRTL | CAN_ERR_PROT | CAN_ERR_TRX | CAN_ERR_ACK |     \
+	 CAN_ERR_BUSOFF | CAN_ERR_BUSERROR | CAN_ERR_RESTARTED)
+
+/* место под SCM_TIMESTAMPING в управляющих данных одного кадра */
+#define CAN_CTRL_LEN CMSG_SPACE(sizeof(struct scm_timestamping))
+
+/* аппаратная отметка старше этого относительно момента чтения считается ошибочной */
+#define CAN_TS_MAX_AGE (TIME_S)
+
+/* пакет без замены по назначению */
+#define CAN_KEY_NONE (0xFFU)
+
+typedef struct {
+	struct can_packet_t msg[CAN_BATCH_MAX];
+	uint8_t key_len[CAN_BATCH_MAX];
+	size_t count;
+} can_txq_t;
+
+typedef struct {
+	int sock;
+	char ifname[IFNAM_SIZE];
+	bool stamped; /* SO_TIMESTAMPING включен, иначе время кадров - момент чтения */
+
+	svc_metric_t *rx;
+	svc_metric_t *tx;
+	svc_metric_t *tx_err;
+	svc_metric_t *errors;
+	svc_metric_t *bus_off;
+	svc_metric_t *tx_deferred;
+	svc_metric_t *tx_coalesced;
+	svc_metric_t *tx_dropped;
+
+	/* очереди передачи по классам, отправляются can_flush() */
+	can_txq_t txq[CAN_PRIO_COUNT];
+
+	/* бюджет загрузки: бит/с с учетом допустимой загрузки, емкость ведра, бит */
+	uint64_t budget_rate;
+	int64_t budget_cap;
+	int64_t budget;
+	uint64_t budget_time;
+} can_bus_t;
+
+struct can {
+	int epoll_fd;
+	uint32_t count;
+	can_bus_t bus[CAN_BUS_MAX];
+};
+
+static void
+packet_to_frame(const struct can_packet_t *msg, struct can_frame *frame)
+{
+	union {
+		canid_t *can_id;
+		can_hdr_t *id;
+	} id;
+
+	memset(frame, 0, sizeof(*frame));
+	id.can_id = &frame->can_id;
+	memcpy(id.id, &msg->hdr, sizeof(can_hdr_t));
+	frame->can_id |= CAN_EFF_FLAG;
+
+	frame->can_dlc = msg->len;
+	memcpy(frame->data, msg->data, msg->len);
+}
 
-static int can_sock = -1;
+static void
+frame_to_packet(const struct can_frame *frame, uint32_t bus, uint64_t ts, struct can_packet_t *msg)
+{
+	union {
+		const canid_t *can_id;
+		const can_hdr_t *id;
+	} id;
+
+	id.can_id = &frame->can_id;
+	memcpy(&msg->hdr, id.id, sizeof(can_hdr_t));
+	msg->len = frame->can_dlc;
+	msg->bus = (uint8_t)bus;
+	msg->flags = 0U;
+	msg->ts = ts;
+	memcpy(msg->data, frame->data, msg->len);
+}
 
-int
-can_init(void)
+static svc_metric_t *
+bus_metric(const can_bus_t *b, const char suffix[])
+{
+	char name[SVC_METRIC_NAME_LEN];
+
+	snprintf(name, sizeof(name), "%s_%s", b->ifname, suffix);
+
+	return svc_metric(name, SVC_METRIC_COUNTER);
+}
+
+/* включение аппаратных отметок времени приема в драйвере, нужен CAP_NET_ADMIN */
+static bool
+bus_hw_timestamps(int sock, const char ifname[])
 {
+	struct hwtstamp_config cfg;
+	struct ifreq ifr;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.tx_type = HWTSTAMP_TX_OFF;
+	cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	ifr.ifr_data = (void *)&cfg;
+
+	return (ioctl(sock, SIOCSHWTSTAMP, &ifr) == 0) && (cfg.rx_filter != HWTSTAMP_FILTER_NONE);
+}
+
+static bool
+bus_open(can_t *can, const if_desc_t *iface)
+{
+	bool result = false;
+	can_bus_t *b = &can->bus[can->count];
 	int sock = -1;
 
-	struct sockaddr_can addr;
+	do {
+		struct sockaddr_can addr;
+
+		if ((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+			log_err("%s: cannot create can socket", iface->ifname);
+			break;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = iface->ifi_index;
+
+		if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			log_err("%s: bind", iface->ifname);
+			break;
+		}
+
+		can_err_mask_t err_mask = CAN_ERR_WATCH;
+		if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask,
+			       sizeof(err_mask)) != 0) {
+			log_warn("%s: cannot enable error frames", iface->ifname);
+		}
+
+		/* отметка времени приема: аппаратная, если драйвер умеет, иначе ядра */
+		uint32_t ts_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		if (bus_hw_timestamps(sock, iface->ifname)) {
+			ts_flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+			log_inf("%s: hardware rx timestamps", iface->ifname);
+		}
+		b->stamped = (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags,
+					 sizeof(ts_flags)) == 0);
+		if (!b->stamped) {
+			log_warn("%s: no rx timestamps, using read time", iface->ifname);
+		}
+
+		/* Change the socket into non-blocking state */
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+
+		struct epoll_event ev = {
+		    .events = EPOLLIN,
+		    .data.u32 = can->count,
+		};
+		if (epoll_ctl(can->epoll_fd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+			log_err("%s: epoll_ctl", iface->ifname);
+			break;
+		}
+
+		b->sock = sock;
+		snprintf(b->ifname, sizeof(b->ifname), "%s", iface->ifname);
+		memset(b->txq, 0, sizeof(b->txq));
+		b->budget_rate = 0ULL;
+
+		b->rx = bus_metric(b, "rx_frames_total");
+		b->tx = bus_metric(b, "tx_frames_total");
+		b->tx_err = bus_metric(b, "tx_errors_total");
+		b->errors = bus_metric(b, "error_frames_total");
+		b->bus_off = bus_metric(b, "bus_off_total");
+		b->tx_deferred = bus_metric(b, "tx_deferred_total");
+		b->tx_coalesced = bus_metric(b, "tx_coalesced_total");
+		b->tx_dropped = bus_metric(b, "tx_dropped_total");
+
+		can->count++;
+		result = true;
+	} while (false);
+
+	if (!result && (sock >= 0)) {
+		close(sock);
+	}
+
+	return result;
+}
+
+can_t *
+can_open(const char *const ifnames[], uint32_t count)
+{
+	can_t *can = NULL;
 
 	do {
-		if_desc_t can_list[4U];
+		if_desc_t can_list[NL_MAX_IFACES];
 		int can_count;
 
 		can_count = nl_get_can_list(can_list);
@@ -42,65 +239,392 @@ can_init(void)
 			break;
 		}
 
-		if ((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		can = calloc(1U, sizeof(can_t));
+		if (can == NULL) {
+			log_err("can: out of memory");
+			break;
+		}
+
+		can->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (can->epoll_fd < 0) {
+			log_err("can: epoll_create1");
+			free(can);
+			can = NULL;
+			break;
+		}
+
+		bool ok = true;
+		if (ifnames == NULL) {
+			int i;
+			for (i = 0; ok && (i < can_count); i++) {
+				ok = bus_open(can, &can_list[i]);
+			}
+		} else {
+			uint32_t n;
+			for (n = 0U; ok && (n < count); n++) {
+				int i;
+				for (i = 0; i < can_count; i++) {
+					if (strcmp(can_list[i].ifname, ifnames[n]) == 0) {
+						break;
+					}
+				}
+
+				if (i == can_count) {
+					log_err("cannot find can interface %s", ifnames[n]);
+					ok = false;
+				} else if (can->count == CAN_BUS_MAX) {
+					log_err("too many can interfaces");
+					ok = false;
+				} else {
+					ok = bus_open(can, &can_list[i]);
+				}
+			}
+		}
+
+		if (!ok || (can->count == 0U)) {
+			can_close(can);
+			can = NULL;
+			break;
+		}
+	} while (false);
+
+	return can;
+}
+
+void
+can_close(can_t *can)
+{
+	if (can == NULL) {
+		return;
+	}
+
+	uint32_t i;
+	for (i = 0U; i < can->count; i++) {
+		close(can->bus[i].sock);
+	}
+
+	close(can->epoll_fd);
+	free(can);
+}
+
+size_t
+can_send_once(const char ifname[], const struct can_packet_t msgs[], size_t count)
+{
+	struct can_frame frames[CAN_BATCH_MAX];
+	struct iovec iov[CAN_BATCH_MAX];
+	struct mmsghdr mmsg[CAN_BATCH_MAX];
+
+	size_t result = 0U;
+	int sock = -1;
+
+	do {
+		if (count > CAN_BATCH_MAX) {
+			count = CAN_BATCH_MAX;
+		}
+
+		int ifindex = (int)if_nametoindex(ifname);
+		if (ifindex == 0) {
+			if_desc_t can_list[NL_MAX_IFACES];
+
+			if (nl_get_can_list(can_list) <= 0) {
+				log_err("cannot find can interfaces");
+				break;
+			}
+			ifindex = can_list[0U].ifi_index;
+		}
+
+		sock = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+		if (sock < 0) {
 			log_err("cannot create can socket");
 			break;
 		}
 
+		/* пустой список фильтров: входящие кадры в сокет не попадают */
+		(void)setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+
+		struct sockaddr_can addr;
+		memset(&addr, 0, sizeof(addr));
 		addr.can_family = AF_CAN;
-		addr.can_ifindex = can_list[0U].ifi_index;
+		addr.can_ifindex = ifindex;
 
 		if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 			log_err("bind");
-			close(sock);
-			sock = -1;
 			break;
 		}
 
-		/* Change the socket into non-blocking state */
-		fcntl(sock, F_SETFL, O_NONBLOCK);
+		size_t i;
+		for (i = 0U; i < count; i++) {
+			packet_to_frame(&msgs[i], &frames[i]);
+			iov[i].iov_base = &frames[i];
+			iov[i].iov_len = sizeof(struct can_frame);
+			memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1U;
+		}
+
+		int n = sendmmsg(sock, mmsg, (unsigned int)count, MSG_DONTWAIT);
+		if (n > 0) {
+			result = (size_t)n;
+		}
 
-		can_sock = sock;
-	} while (0);
+		if (result < count) {
+			log_err("Cannot write %zu CAN frames", count - result);
+		}
+	} while (false);
 
-	return sock;
+	if (sock >= 0) {
+		close(sock);
+	}
+
+	return result;
+}
+
+uint32_t
+can_bus_count(const can_t *can)
+{
+	return can->count;
+}
+
+int32_t
+can_bus_find(const can_t *can, const char ifname[])
+{
+	uint32_t i;
+	for (i = 0U; i < can->count; i++) {
+		if (strcmp(can->bus[i].ifname, ifname) == 0) {
+			return (int32_t)i;
+		}
+	}
+
+	return -1;
+}
+
+const char *
+can_bus_name(const can_t *can, uint32_t bus)
+{
+	return (bus < can->count) ? can->bus[bus].ifname : "?";
 }
 
 int
-read_can_msg(struct can_packet_t *msg)
+can_fd(const can_t *can)
 {
-	int result = 0;
+	return can->epoll_fd;
+}
 
-	if (can_sock == -1) {
-		log_err("Canbus not initialized!");
-	} else {
-		struct can_frame frame;
+bool
+can_set_filters(can_t *can, uint32_t bus, const can_filter_t filters[], size_t count)
+{
+	bool result = false;
+	struct can_filter *rfilter = NULL;
 
-		int r = read(can_sock, &frame, sizeof(struct can_frame));
+	do {
+		if (bus >= can->count) {
+			log_err("invalid can bus %u", bus);
+			break;
+		}
 
-		while (r > 0) {
-			if ((size_t)r < sizeof(struct can_frame)) {
-				log_err("read: incomplete CAN frame");
+		if (count > 0U) {
+			rfilter = calloc(count, sizeof(struct can_filter));
+			if (rfilter == NULL) {
+				log_err("cannot allocate CAN filters");
 				break;
 			}
+		}
+
+		/* идентификатор совпадает с can_hdr_t: id в младшем байте, cmd - в следующем */
+		size_t i;
+		for (i = 0U; i < count; i++) {
+			struct can_packet_t pkt;
+			struct can_frame frame;
+
+			memset(&pkt, 0, sizeof(pkt));
+			pkt.hdr.cmd = filters[i].cmd;
+			pkt.hdr.id = filters[i].id;
+			packet_to_frame(&pkt, &frame);
+
+			rfilter[i].can_id = frame.can_id;
+			rfilter[i].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_EFF_MASK;
+		}
+
+		if (setsockopt(can->bus[bus].sock, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter,
+			       (socklen_t)(count * sizeof(struct can_filter))) != 0) {
+			log_err("%s: cannot set CAN filters", can->bus[bus].ifname);
+			break;
+		}
+
+		result = true;
+	} while (false);
+
+	free(rfilter);
+
+	return result;
+}
+
+/* кадр ошибки контроллера: только счетчики и журнал */
+static void
+bus_error(can_bus_t *b, const struct can_frame *frame)
+{
+	svc_metric_inc(b->errors);
+
+	if ((frame->can_id & CAN_ERR_BUSOFF) != 0U) {
+		svc_metric_inc(b->bus_off);
+		log_err("%s: bus-off", b->ifname);
+	}
+
+	if ((frame->can_id & CAN_ERR_RESTARTED) != 0U) {
+		log_warn("%s: controller restarted", b->ifname);
+	}
+}
+
+static inline uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return ((uint64_t)ts->tv_sec * TIME_S) + (uint64_t)ts->tv_nsec;
+}
+
+/* перевод времени шкалы CLOCK_REALTIME во время svc_get_monotime() момента чтения */
+static inline uint64_t
+rt_to_mono(uint64_t t, uint64_t rt_now, uint64_t mono_now)
+{
+	uint64_t age = rt_now - t;
+
+	return (age < mono_now) ? (mono_now - age) : 1ULL;
+}
+
+/*
+ * Аппаратная отметка: CAN драйверы приводят счетчик контроллера к шкале
+ * CLOCK_REALTIME, но ошибка синхронизации возможна, поэтому отметка из
+ * будущего или слишком старая отбрасывается.
+ */
+static bool
+hw_ts_to_mono(const struct timespec *ts, uint64_t rt_now, uint64_t mono_now, uint64_t *mono)
+{
+	uint64_t t = timespec_ns(ts);
+
+	if ((t == 0ULL) || (t > rt_now) || ((rt_now - t) > CAN_TS_MAX_AGE)) {
+		return false;
+	}
+
+	*mono = rt_to_mono(t, rt_now, mono_now);
+
+	return true;
+}
+
+/*
+ * Программная отметка ядра уже в шкале CLOCK_REALTIME и сохраняется при
+ * любом возрасте: кадр, долго пролежавший в буфере сокета, должен
+ * выглядеть старым. Отметка из будущего (шаг часов назад) - момент чтения.
+ */
+static bool
+sw_ts_to_mono(const struct timespec *ts, uint64_t rt_now, uint64_t mono_now, uint64_t *mono)
+{
+	uint64_t t = timespec_ns(ts);
+
+	if (t == 0ULL) {
+		return false;
+	}
+
+	*mono = (t < rt_now) ? rt_to_mono(t, rt_now, mono_now) : mono_now;
+
+	return true;
+}
+
+/* время приема кадра, false - отметки ядра нет, в ts момент чтения */
+static bool
+rx_time(struct msghdr *hdr, uint64_t rt_now, uint64_t mono_now, uint64_t *ts)
+{
+	struct cmsghdr *cmsg;
+
+	*ts = mono_now;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SO_TIMESTAMPING)) {
+			continue;
+		}
+
+		struct scm_timestamping tss;
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+
+		/* ts[2] - аппаратная отметка, ts[0] - программная */
+		return hw_ts_to_mono(&tss.ts[2], rt_now, mono_now, ts) ||
+		       sw_ts_to_mono(&tss.ts[0], rt_now, mono_now, ts);
+	}
+
+	return false;
+}
+
+static size_t
+bus_read(can_bus_t *b, uint32_t bus, struct can_packet_t msgs[], size_t count)
+{
+	static struct can_frame frames[CAN_BATCH_MAX];
+	static struct iovec iov[CAN_BATCH_MAX];
+	static struct mmsghdr mmsg[CAN_BATCH_MAX];
+	static union {
+		struct cmsghdr align;
+		uint8_t buf[CAN_CTRL_LEN];
+	} ctrl[CAN_BATCH_MAX];
+
+	size_t result = 0U;
+
+	while (result < count) {
+		size_t want = count - result;
+		if (want > CAN_BATCH_MAX) {
+			want = CAN_BATCH_MAX;
+		}
+
+		size_t i;
+		for (i = 0U; i < want; i++) {
+			iov[i].iov_base = &frames[i];
+			iov[i].iov_len = sizeof(struct can_frame);
+			memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1U;
+			mmsg[i].msg_hdr.msg_control = ctrl[i].buf;
+			mmsg[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+		}
+
+		int n = recvmmsg(b->sock, mmsg, (unsigned int)want, MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				log_err("%s: recvmmsg: CAN read error", b->ifname);
+			}
+			break;
+		}
+
+		/* одна пара часов на пакет: сдвиг шкал за время разбора пренебрежимо мал */
+		struct timespec rt;
+		clock_gettime(CLOCK_REALTIME, &rt);
+		uint64_t rt_now = timespec_ns(&rt);
+		uint64_t mono_now = svc_get_monotime();
+
+		for (i = 0U; i < (size_t)n; i++) {
+			if (mmsg[i].msg_len < sizeof(struct can_frame)) {
+				log_err("read: incomplete CAN frame");
+				continue;
+			}
 
-			if (!(frame.can_id & CAN_EFF_FLAG)) {
+			if ((frames[i].can_id & CAN_ERR_FLAG) != 0U) {
+				bus_error(b, &frames[i]);
+				continue;
+			}
+
+			if (!(frames[i].can_id & CAN_EFF_FLAG)) {
 				/* skip non-ext frame */
-				break;
+				continue;
 			}
 
-			union {
-				canid_t *can_id;
-				can_hdr_t *id;
-			} id;
-			id.can_id = &frame.can_id;
+			uint64_t ts;
+			bool stamped = rx_time(&mmsg[i].msg_hdr, rt_now, mono_now, &ts);
 
-			memcpy(&msg->hdr, id.id, sizeof(can_hdr_t));
-			msg->len = frame.can_dlc;
-			memcpy(msg->data, frame.data, msg->len);
+			frame_to_packet(&frames[i], bus, ts, &msgs[result]);
+			/* на шине без отметок момент чтения - единственное время кадра */
+			msgs[result].flags = (stamped || !b->stamped) ? 0U : CAN_PKT_TS_READ;
+			result++;
+		}
 
-			result = 1;
+		svc_metric_add(b->rx, (uint64_t)n);
 
+		if ((size_t)n < want) {
+			/* сокет пуст */
 			break;
 		}
 	}
@@ -108,35 +632,314 @@ read_can_msg(struct can_packet_t *msg)
 	return result;
 }
 
-int
-send_can_msg(struct can_packet_t *msg)
+size_t
+can_read_batch(can_t *can, struct can_packet_t msgs[], size_t count, int timeout)
+{
+	struct epoll_event events[CAN_BUS_MAX];
+	size_t result = 0U;
+
+	int n = epoll_wait(can->epoll_fd, events, (int)CAN_BUS_MAX, timeout);
+	if (n < 0) {
+		if (errno != EINTR) {
+			log_err("can: epoll_wait");
+		}
+		return 0U;
+	}
+
+	int i;
+	for (i = 0; (i < n) && (result < count); i++) {
+		uint32_t bus = events[i].data.u32;
+		result += bus_read(&can->bus[bus], bus, &msgs[result], count - result);
+	}
+
+	return result;
+}
+
+/*
+ * Отправка без учета ошибок: при неудаче errno остается от sendmmsg(),
+ * решение о неотправленных кадрах принимает вызывающий.
+ */
+static size_t
+bus_send(can_bus_t *b, const struct can_packet_t msgs[], size_t count)
+{
+	static struct can_frame frames[CAN_BATCH_MAX];
+	static struct iovec iov[CAN_BATCH_MAX];
+	static struct mmsghdr mmsg[CAN_BATCH_MAX];
+
+	size_t result = 0U;
+
+	while (result < count) {
+		size_t want = count - result;
+		if (want > CAN_BATCH_MAX) {
+			want = CAN_BATCH_MAX;
+		}
+
+		size_t i;
+		for (i = 0U; i < want; i++) {
+			packet_to_frame(&msgs[result + i], &frames[i]);
+			iov[i].iov_base = &frames[i];
+			iov[i].iov_len = sizeof(struct can_frame);
+			memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1U;
+		}
+
+		int n = sendmmsg(b->sock, mmsg, (unsigned int)want, MSG_DONTWAIT);
+		if (n <= 0) {
+			break;
+		}
+
+		result += (size_t)n;
+		if ((size_t)n < want) {
+			/* очередь передатчика заполнена */
+			errno = ENOBUFS;
+			break;
+		}
+	}
+
+	svc_metric_add(b->tx, result);
+
+	return result;
+}
+
+size_t
+can_send_batch(can_t *can, uint32_t bus, const struct can_packet_t msgs[], size_t count)
+{
+	if (bus >= can->count) {
+		log_err("invalid can bus %u", bus);
+		return 0U;
+	}
+
+	can_bus_t *b = &can->bus[bus];
+
+	size_t result = bus_send(b, msgs, count);
+	if (result < count) {
+		svc_metric_add(b->tx_err, count - result);
+		log_err("%s: cannot write %zu CAN frames", b->ifname, count - result);
+	}
+
+	return result;
+}
+
+/*
+ * Длина кадра с расширенным идентификатором на шине, включая
+ * межкадровый интервал, с худшим случаем бит-стаффинга.
+ */
+static inline int64_t
+frame_bits(uint8_t len)
 {
-	int result = 0;
+	int64_t data = 8 * (int64_t)len;
+
+	return 67 + data + ((54 + data - 1) / 4);
+}
+
+void
+can_set_budget(can_t *can, uint32_t bus, uint32_t bitrate, uint64_t tick, uint32_t load)
+{
+	if (bus >= can->count) {
+		log_err("invalid can bus %u", bus);
+		return;
+	}
+
+	can_bus_t *b = &can->bus[bus];
+
+	b->budget_rate = ((uint64_t)bitrate * load) / 100U;
+	b->budget_cap = (int64_t)((b->budget_rate * tick) / TIME_S);
+	b->budget = b->budget_cap;
+	b->budget_time = svc_get_monotime();
+}
+
+/* пополнение ведра за время с прошлой отправки */
+static void
+budget_refill(can_bus_t *b)
+{
+	uint64_t now = svc_get_monotime();
+
+	if (now > b->budget_time) {
+		uint64_t add = (b->budget_rate * (now - b->budget_time)) / TIME_S;
+
+		if (add > (uint64_t)b->budget_cap) {
+			add = (uint64_t)b->budget_cap;
+		}
+		b->budget += (int64_t)add;
+		if (b->budget > b->budget_cap) {
+			b->budget = b->budget_cap;
+		}
+		b->budget_time = now;
+	}
+}
+
+static size_t
+bus_flush(can_t *can, uint32_t bus)
+{
+	static struct can_packet_t out[CAN_PRIO_COUNT * CAN_BATCH_MAX];
+	static uint8_t out_prio[CAN_PRIO_COUNT * CAN_BATCH_MAX];
+	static uint8_t out_key[CAN_PRIO_COUNT * CAN_BATCH_MAX];
+
+	can_bus_t *b = &can->bus[bus];
+	bool limited = (b->budget_rate != 0ULL);
+	bool blocked = false;
+	size_t count = 0U;
+
+	if (limited) {
+		budget_refill(b);
+	}
+
+	uint32_t p;
+	for (p = 0U; p < (uint32_t)CAN_PRIO_COUNT; p++) {
+		can_txq_t *q = &b->txq[p];
+		size_t n;
+
+		for (n = 0U; n < q->count; n++) {
+			if (limited) {
+				int64_t bits = frame_bits(q->msg[n].len);
+
+				/* младший класс не обгоняет отложенный старший короткими кадрами */
+				if ((p != (uint32_t)CAN_PRIO_DRIVE) && (blocked || (b->budget < bits))) {
+					break;
+				}
+				b->budget -= bits;
+			}
+			out_prio[count] = (uint8_t)p;
+			out_key[count] = q->key_len[n];
+			out[count++] = q->msg[n];
+		}
 
-	if (can_sock == -1) {
-		log_err("Canbus not initialized!");
-	} else {
-		struct can_frame frame;
+		if (n < q->count) {
+			blocked = true;
 
-		union {
-			canid_t *can_id;
-			can_hdr_t *id;
-		} id;
+			/* остаток класса ждет следующего такта, порядок сохраняется */
+			svc_metric_add(b->tx_deferred, q->count - n);
+			memmove(q->msg, &q->msg[n], (q->count - n) * sizeof(q->msg[0]));
+			memmove(q->key_len, &q->key_len[n], (q->count - n) * sizeof(q->key_len[0]));
+		}
+		q->count -= n;
+	}
+
+	if (count == 0U) {
+		return 0U;
+	}
+
+	size_t sent = bus_send(b, out, count);
+	if (sent == count) {
+		return sent;
+	}
+
+	if ((errno != ENOBUFS) && (errno != EAGAIN)) {
+		svc_metric_add(b->tx_err, count - sent);
+		log_err("%s: cannot write %zu CAN frames", b->ifname, count - sent);
+		return sent;
+	}
+
+	/*
+	 * Очередь передатчика заполнена: неотправленный хвост возвращается в
+	 * начало своих классов, с конца - порядок внутри класса сохраняется.
+	 * Место есть: из каждого класса взято не меньше, чем возвращается.
+	 */
+	svc_metric_add(b->tx_deferred, count - sent);
+
+	size_t i = count;
+	while (i > sent) {
+		i--;
+		can_txq_t *q = &b->txq[out_prio[i]];
+
+		memmove(&q->msg[1], q->msg, q->count * sizeof(q->msg[0]));
+		memmove(&q->key_len[1], q->key_len, q->count * sizeof(q->key_len[0]));
+		q->msg[0] = out[i];
+		q->key_len[0] = out_key[i];
+		q->count++;
+
+		if (limited) {
+			b->budget += frame_bits(out[i].len);
+		}
+	}
 
-		id.can_id = &frame.can_id;
-		memcpy(id.id, &msg->hdr, sizeof(can_hdr_t));
-		frame.can_id |= CAN_EFF_FLAG;
+	return sent;
+}
 
-		frame.can_dlc = msg->len;
+static void
+bus_queue(can_t *can, uint32_t bus, enum can_prio prio, const struct can_packet_t *msg,
+	  uint8_t key_len)
+{
+	if ((bus >= can->count) || ((uint32_t)prio >= (uint32_t)CAN_PRIO_COUNT)) {
+		log_err("invalid can bus %u or class %u", bus, (uint32_t)prio);
+		return;
+	}
 
-		memcpy(frame.data, msg->data, msg->len);
+	can_bus_t *b = &can->bus[bus];
+	can_txq_t *q = &b->txq[prio];
+
+	if (key_len != CAN_KEY_NONE) {
+		size_t i;
+		for (i = 0U; i < q->count; i++) {
+			if ((q->key_len[i] == key_len) &&
+			    (memcmp(&q->msg[i].hdr, &msg->hdr, sizeof(can_hdr_t)) == 0) &&
+			    (memcmp(q->msg[i].data, msg->data, key_len) == 0)) {
+				q->msg[i] = *msg;
+				svc_metric_inc(b->tx_coalesced);
+				return;
+			}
+		}
+	}
 
-		if (write(can_sock, &frame, sizeof(struct can_frame)) == sizeof(frame)) {
-			result = 1;
+	if (q->count == CAN_BATCH_MAX) {
+		/*
+		 * Переполнение посреди цикла: сначала вытесняется самый старый
+		 * заменяемый пакет (его состояние все равно устарело), и только
+		 * если таких нет - досрочная отправка одной этой шины.
+		 */
+		size_t i;
+		for (i = 0U; i < q->count; i++) {
+			if (q->key_len[i] != CAN_KEY_NONE) {
+				break;
+			}
+		}
+
+		if (i < q->count) {
+			memmove(&q->msg[i], &q->msg[i + 1U], (q->count - i - 1U) * sizeof(q->msg[0]));
+			memmove(&q->key_len[i], &q->key_len[i + 1U],
+				(q->count - i - 1U) * sizeof(q->key_len[0]));
+			q->count--;
+			svc_metric_inc(b->tx_dropped);
 		} else {
-			log_err("Cannot write CAN frame");
+			bus_flush(can, bus);
 		}
 	}
 
+	if (q->count == CAN_BATCH_MAX) {
+		/* класс не уходит в бюджет уже целую очередь */
+		svc_metric_inc(b->tx_dropped);
+		log_err("%s: CAN tx queue overflow", b->ifname);
+		return;
+	}
+
+	q->msg[q->count] = *msg;
+	q->key_len[q->count] = key_len;
+	q->count++;
+}
+
+void
+can_queue_msg(can_t *can, uint32_t bus, enum can_prio prio, const struct can_packet_t *msg)
+{
+	bus_queue(can, bus, prio, msg, CAN_KEY_NONE);
+}
+
+void
+can_queue_latest(can_t *can, uint32_t bus, enum can_prio prio, const struct can_packet_t *msg,
+		 size_t key_len)
+{
+	bus_queue(can, bus, prio, msg, (uint8_t)((key_len < msg->len) ? key_len : msg->len));
+}
+
+size_t
+can_flush(can_t *can)
+{
+	size_t result = 0U;
+
+	uint32_t i;
+	for (i = 0U; i < can->count; i++) {
+		result += bus_flush(can, i);
+	}
+
 	return result;
 }
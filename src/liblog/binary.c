@@ -0,0 +1,628 @@
+/**
+ * @file binary.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Двоичные записи лога с отложенным форматированием
+ */
+
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <private/binary.h>
+
+#define SPEC_MAXLEN (32U)
+
+#define WORD_SIZE (sizeof(uint64_t))
+
+/* предел поиска конца строки формата и число областей образа без записи */
+#define FORMAT_MAXLEN (1024U)
+#define RO_RANGES_MAX (64U)
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+} ro_range_t;
+
+static ro_range_t ro_ranges[RO_RANGES_MAX];
+static uint32_t ro_count = 0U;
+static bool ro_ready = false;
+
+typedef enum {
+	ARG_NONE,   /* %% */
+	ARG_INT,    /* знаковое целое */
+	ARG_UINT,   /* беззнаковое целое */
+	ARG_DOUBLE, /* число с плавающей точкой */
+	ARG_CHAR,   /* %c */
+	ARG_PTR,    /* %p */
+	ARG_STR,    /* %s */
+	ARG_INVALID /* %n и неизвестные спецификаторы */
+} arg_type_t;
+
+typedef enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_LD } arg_len_t;
+
+typedef struct {
+	size_t len;	  /* длина спецификатора в строке формата */
+	arg_type_t type;
+	arg_len_t arg_len;
+	bool width_arg;	  /* ширина передана аргументом (*) */
+	bool prec_arg;	  /* точность передана аргументом (.*) */
+	bool has_prec;
+	int prec;
+	char conv;
+} spec_t;
+
+/**
+ * @brief разбор одного спецификатора формата
+ * @param p [in] указатель на символ после '%'
+ * @param spec [out] результат разбора
+ */
+static void
+parse_spec(const char *p, spec_t *spec)
+{
+	const char *s = p;
+
+	memset(spec, 0, sizeof(*spec));
+
+	while ((*s != '\0') && (strchr("-+ #0'", *s) != NULL)) {
+		s++;
+	}
+
+	if (*s == '*') {
+		spec->width_arg = true;
+		s++;
+	} else {
+		while ((*s >= '0') && (*s <= '9')) {
+			s++;
+		}
+	}
+
+	if (*s == '.') {
+		spec->has_prec = true;
+		s++;
+		if (*s == '*') {
+			spec->prec_arg = true;
+			s++;
+		} else {
+			while ((*s >= '0') && (*s <= '9')) {
+				spec->prec = (spec->prec * 10) + (*s - '0');
+				s++;
+			}
+		}
+	}
+
+	switch (*s) {
+	case 'h':
+		s++;
+		spec->arg_len = LEN_H;
+		if (*s == 'h') {
+			s++;
+			spec->arg_len = LEN_HH;
+		}
+		break;
+	case 'l':
+		s++;
+		spec->arg_len = LEN_L;
+		if (*s == 'l') {
+			s++;
+			spec->arg_len = LEN_LL;
+		}
+		break;
+	case 'z':
+		s++;
+		spec->arg_len = LEN_Z;
+		break;
+	case 'j':
+		s++;
+		spec->arg_len = LEN_J;
+		break;
+	case 't':
+		s++;
+		spec->arg_len = LEN_T;
+		break;
+	case 'L':
+		s++;
+		spec->arg_len = LEN_LD;
+		break;
+	default:
+		break;
+	}
+
+	spec->conv = *s;
+
+	switch (*s) {
+	case '%':
+		spec->type = ARG_NONE;
+		break;
+	case 'd':
+	case 'i':
+		spec->type = ARG_INT;
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		spec->type = ARG_UINT;
+		break;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		spec->type = ARG_DOUBLE;
+		break;
+	case 'c':
+		spec->type = ARG_CHAR;
+		break;
+	case 'p':
+		spec->type = ARG_PTR;
+		break;
+	case 's':
+		spec->type = ARG_STR;
+		break;
+	default:
+		spec->type = ARG_INVALID;
+		break;
+	}
+
+	if (*s != '\0') {
+		s++;
+	}
+
+	spec->len = (size_t)(s - p);
+}
+
+static inline bool
+put_word(uint8_t buf[], size_t size, uint32_t *pos, uint64_t word)
+{
+	if ((*pos + WORD_SIZE) > size) {
+		return false;
+	}
+
+	memcpy(&buf[*pos], &word, WORD_SIZE);
+	*pos += (uint32_t)WORD_SIZE;
+
+	return true;
+}
+
+static inline bool
+get_word(const uint8_t buf[], size_t len, size_t *pos, uint64_t *word)
+{
+	if ((*pos + WORD_SIZE) > len) {
+		return false;
+	}
+
+	memcpy(word, &buf[*pos], WORD_SIZE);
+	*pos += WORD_SIZE;
+
+	return true;
+}
+
+static uint64_t
+read_int(const spec_t *spec, va_list *args)
+{
+	int64_t v;
+
+	switch (spec->arg_len) {
+	case LEN_HH:
+		v = (signed char)va_arg(*args, int);
+		break;
+	case LEN_H:
+		v = (short)va_arg(*args, int);
+		break;
+	case LEN_L:
+		v = va_arg(*args, long);
+		break;
+	case LEN_LL:
+		v = va_arg(*args, long long);
+		break;
+	case LEN_Z:
+		v = va_arg(*args, ssize_t);
+		break;
+	case LEN_J:
+		v = va_arg(*args, intmax_t);
+		break;
+	case LEN_T:
+		v = va_arg(*args, ptrdiff_t);
+		break;
+	case LEN_NONE:
+	case LEN_LD:
+	default:
+		v = va_arg(*args, int);
+		break;
+	}
+
+	return (uint64_t)v;
+}
+
+static uint64_t
+read_uint(const spec_t *spec, va_list *args)
+{
+	uint64_t v;
+
+	switch (spec->arg_len) {
+	case LEN_HH:
+		v = (unsigned char)va_arg(*args, unsigned int);
+		break;
+	case LEN_H:
+		v = (unsigned short)va_arg(*args, unsigned int);
+		break;
+	case LEN_L:
+		v = va_arg(*args, unsigned long);
+		break;
+	case LEN_LL:
+		v = va_arg(*args, unsigned long long);
+		break;
+	case LEN_Z:
+		v = va_arg(*args, size_t);
+		break;
+	case LEN_J:
+		v = va_arg(*args, uintmax_t);
+		break;
+	case LEN_T:
+		v = (uint64_t)va_arg(*args, ptrdiff_t);
+		break;
+	case LEN_NONE:
+	case LEN_LD:
+	default:
+		v = va_arg(*args, unsigned int);
+		break;
+	}
+
+	return v;
+}
+
+uint32_t
+log_bin_encode(uint8_t buf[], size_t size, const char format[], va_list args)
+{
+	uint32_t pos = 0U;
+	va_list ap;
+
+	va_copy(ap, args);
+
+	do {
+		if (!put_word(buf, size, &pos, (uint64_t)(uintptr_t)format)) {
+			break;
+		}
+
+		const char *p = format;
+		bool ok = true;
+
+		while (ok && ((p = strchr(p, '%')) != NULL)) {
+			spec_t spec;
+			parse_spec(&p[1], &spec);
+			p += spec.len + 1U;
+
+			if (spec.width_arg) {
+				ok = put_word(buf, size, &pos, (uint64_t)(int64_t)va_arg(ap, int));
+			}
+
+			int prec = spec.prec;
+			if (ok && spec.prec_arg) {
+				prec = va_arg(ap, int);
+				ok = put_word(buf, size, &pos, (uint64_t)(int64_t)prec);
+			}
+
+			if (!ok) {
+				break;
+			}
+
+			switch (spec.type) {
+			case ARG_INT:
+				ok = put_word(buf, size, &pos, read_int(&spec, &ap));
+				break;
+
+			case ARG_UINT:
+				ok = put_word(buf, size, &pos, read_uint(&spec, &ap));
+				break;
+
+			case ARG_DOUBLE: {
+				union {
+					double d;
+					uint64_t u;
+				} u;
+				if (spec.arg_len == LEN_LD) {
+					u.d = (double)va_arg(ap, long double);
+				} else {
+					u.d = va_arg(ap, double);
+				}
+				ok = put_word(buf, size, &pos, u.u);
+				break;
+			}
+
+			case ARG_CHAR:
+				ok = put_word(buf, size, &pos, (uint64_t)va_arg(ap, int));
+				break;
+
+			case ARG_PTR:
+				ok = put_word(buf, size, &pos, (uint64_t)(uintptr_t)va_arg(ap, void *));
+				break;
+
+			case ARG_STR: {
+				const char *str = va_arg(ap, const char *);
+				if (str == NULL) {
+					str = "(null)";
+				}
+
+				size_t slen;
+				if (spec.has_prec && (prec >= 0)) {
+					slen = strnlen(str, (size_t)prec);
+				} else {
+					slen = strlen(str);
+				}
+
+				/* строка не влезает целиком - обрезаем по размеру буфера */
+				if ((pos + (2U * WORD_SIZE)) > size) {
+					ok = false;
+					break;
+				}
+				size_t room = size - pos - WORD_SIZE - 1U;
+				if (slen > room) {
+					slen = room;
+				}
+
+				put_word(buf, size, &pos, (uint64_t)slen);
+				memcpy(&buf[pos], str, slen);
+				buf[pos + slen] = '\0';
+				pos += (uint32_t)((slen + WORD_SIZE) & ~(WORD_SIZE - 1U));
+				if (pos > size) {
+					pos = (uint32_t)size;
+				}
+				break;
+			}
+
+			case ARG_NONE:
+				break;
+
+			case ARG_INVALID:
+			default:
+				/* дальше аргументы не разобрать */
+				ok = false;
+				break;
+			}
+		}
+	} while (false);
+
+	va_end(ap);
+
+	return pos;
+}
+
+/**
+ * @brief вывод одного спецификатора с уже извлеченным значением
+ * @param spec_str [in] спецификатор без модификатора длины
+ */
+static size_t
+format_one(char out[], size_t size, const char spec_str[], const spec_t *spec, uint64_t word,
+	   const char *str)
+{
+	int r = 0;
+
+	switch (spec->type) {
+	case ARG_INT:
+		r = snprintf(out, size, spec_str, (long long)(int64_t)word);
+		break;
+	case ARG_UINT:
+		r = snprintf(out, size, spec_str, (unsigned long long)word);
+		break;
+	case ARG_DOUBLE: {
+		union {
+			double d;
+			uint64_t u;
+		} u;
+		u.u = word;
+		r = snprintf(out, size, spec_str, u.d);
+		break;
+	}
+	case ARG_CHAR:
+		r = snprintf(out, size, spec_str, (int)word);
+		break;
+	case ARG_PTR:
+		r = snprintf(out, size, spec_str, (void *)(uintptr_t)word);
+		break;
+	case ARG_STR:
+		r = snprintf(out, size, spec_str, str);
+		break;
+	case ARG_NONE:
+	case ARG_INVALID:
+	default:
+		break;
+	}
+
+	if (r < 0) {
+		r = 0;
+	}
+
+	return ((size_t)r < size) ? (size_t)r : (size - 1U);
+}
+
+/* сегменты PT_LOAD без права записи: .text и .rodata программы и библиотек */
+static int
+ro_range_add(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	(void)size;
+	(void)arg;
+
+	ElfW(Half) i;
+	for (i = 0U; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+		if ((ph->p_type != PT_LOAD) || ((ph->p_flags & PF_W) != 0U)) {
+			continue;
+		}
+
+		if (ro_count == RO_RANGES_MAX) {
+			return 1;
+		}
+
+		ro_ranges[ro_count].start = (uintptr_t)(info->dlpi_addr + ph->p_vaddr);
+		ro_ranges[ro_count].end = ro_ranges[ro_count].start + (uintptr_t)ph->p_memsz;
+		ro_count++;
+	}
+
+	return 0;
+}
+
+const char *
+log_bin_format_ptr(const uint8_t buf[], size_t len)
+{
+	size_t pos = 0U;
+	uint64_t word;
+
+	if (!get_word(buf, len, &pos, &word)) {
+		return NULL;
+	}
+
+	if (!ro_ready) {
+		/* образ после fork() общий с сервисами, таблица строится один раз */
+		dl_iterate_phdr(ro_range_add, NULL);
+		ro_ready = true;
+	}
+
+	uintptr_t addr = (uintptr_t)word;
+	uint32_t i;
+	for (i = 0U; i < ro_count; i++) {
+		if ((addr >= ro_ranges[i].start) && (addr < ro_ranges[i].end)) {
+			size_t max = ro_ranges[i].end - addr;
+			if (max > FORMAT_MAXLEN) {
+				max = FORMAT_MAXLEN;
+			}
+
+			/* строка должна закончиться внутри сегмента */
+			const char *format = (const char *)addr;
+			return (memchr(format, '\0', max) != NULL) ? format : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+size_t
+log_bin_format(char out[], size_t size, const uint8_t buf[], size_t len)
+{
+	if (size == 0U) {
+		return 0U;
+	}
+	out[0] = '\0';
+
+	if (len < WORD_SIZE) {
+		return 0U;
+	}
+
+	/* указатель пришел из общей памяти сервиса и может быть испорчен */
+	const char *format = log_bin_format_ptr(buf, len);
+	if (format == NULL) {
+		int r = snprintf(out, size, "<bad fmt>");
+		return (r < 0) ? 0U : (((size_t)r < size) ? (size_t)r : (size - 1U));
+	}
+
+	return log_bin_format_with(out, size, format, buf, len);
+}
+
+size_t
+log_bin_format_with(char out[], size_t size, const char format[], const uint8_t buf[],
+		    size_t len)
+{
+	size_t o = 0U;
+	size_t pos = WORD_SIZE;
+	uint64_t word = 0U;
+	const char *p = format;
+
+	if (size == 0U) {
+		return 0U;
+	}
+	out[0] = '\0';
+
+	if (len < WORD_SIZE) {
+		return 0U;
+	}
+
+	while ((*p != '\0') && (o < (size - 1U))) {
+		if (*p != '%') {
+			out[o++] = *p++;
+			continue;
+		}
+
+		spec_t spec;
+		parse_spec(&p[1], &spec);
+
+		if (spec.type == ARG_NONE) {
+			out[o++] = '%';
+			p += spec.len + 1U;
+			continue;
+		}
+
+		if (spec.type == ARG_INVALID) {
+			break;
+		}
+
+		/* собираем спецификатор: '*' заменяются значениями, длина - "ll" или пусто */
+		char spec_str[SPEC_MAXLEN];
+		size_t s = 0U;
+		const char *c = p;
+		const char *end = &p[spec.len + 1U];
+		bool ok = true;
+
+		spec_str[s++] = *c++;
+		while (ok && (c < end)) {
+			if (*c == '*') {
+				ok = get_word(buf, len, &pos, &word);
+				int n = snprintf(&spec_str[s], SPEC_MAXLEN - s, "%lld",
+						 (long long)(int64_t)word);
+				s += (n > 0) ? (size_t)n : 0U;
+			} else if (strchr("hlzjtL", *c) != NULL) {
+				/* модификатор длины отбрасываем */
+			} else {
+				if (c == &end[-1]) {
+					if ((spec.type == ARG_INT) || (spec.type == ARG_UINT)) {
+						spec_str[s++] = 'l';
+						spec_str[s++] = 'l';
+					}
+				}
+				spec_str[s++] = *c;
+			}
+			c++;
+
+			if (s >= (SPEC_MAXLEN - 4U)) {
+				ok = false;
+			}
+		}
+		spec_str[s] = '\0';
+
+		const char *str = NULL;
+		if (ok) {
+			ok = get_word(buf, len, &pos, &word);
+		}
+		if (ok && (spec.type == ARG_STR)) {
+			/* длина из записи не доверенная: строка с нулем целиком внутри буфера */
+			if ((word >= (uint64_t)(len - pos)) || (buf[pos + word] != '\0')) {
+				ok = false;
+			} else {
+				str = (const char *)&buf[pos];
+				pos += (size_t)((word + WORD_SIZE) & ~(WORD_SIZE - 1U));
+			}
+		}
+
+		if (!ok) {
+			/* сообщение обрезано при записи */
+			int r = snprintf(&out[o], size - o, "<...>");
+			if (r > 0) {
+				o += ((size_t)r < (size - o)) ? (size_t)r : (size - o - 1U);
+			}
+			break;
+		}
+
+		o += format_one(&out[o], size - o, spec_str, &spec, word, str);
+		p = end;
+	}
+
+	out[o] = '\0';
+
+	return o;
+}
@@ -8,9 +8,11 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 
 #include <log/log.h>
+#include <svc/memory.h>
 
 log_buffer_t *
 log_create(const char name[])
@@ -32,8 +34,7 @@ log_create(const char name[])
 			break;
 		}
 
-		void *map =
-		    mmap(NULL, sizeof(log_buffer_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		void *map = svc_mem_map(fd, sizeof(log_buffer_t));
 		close(fd);
 		if (map == MAP_FAILED) {
 			break;
@@ -41,8 +42,14 @@ log_create(const char name[])
 
 		log = (log_buffer_t *)map;
 
-		log->head = LOG_BUFFER_SIZE - 2U;
-		log->tail = LOG_BUFFER_SIZE - 2U;
+		/* объект мог остаться от прошлого запуска */
+		memset(log, 0, sizeof(log_buffer_t));
+
+		log->notify_fd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (log->notify_fd < 0) {
+			/* читатель обойдется периодическим опросом */
+			log_warn("cannot create log eventfd for \"%s\"", name);
+		}
 	} while (false);
 
 	return log;
@@ -0,0 +1,32 @@
+/**
+ * @file binary.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Двоичные записи лога с отложенным форматированием
+ */
+
+#pragma once
+
+#include <log/log.h>
+
+/*
+ * Двоичное сообщение: указатель на строку формата и аргументы словами по
+ * 8 байт. Строки (%s) копируются в сообщение: длина словом, затем байты
+ * с завершающим нулем, выровненные на 8. Строка формата читается по
+ * указателю, поэтому разбирать сообщение может только процесс с тем же
+ * образом в памяти - супервизор, от которого порождены сервисы.
+ * Указатель проверяется: он должен попасть в сегмент образа без права
+ * записи, иначе вместо текста выводится "<bad fmt>".
+ */
+
+uint32_t log_bin_encode(uint8_t buf[], size_t size, const char format[], va_list args);
+
+size_t log_bin_format(char out[], size_t size, const uint8_t buf[], size_t len);
+
+/* строка формата из первого слова, если она в образе без записи, иначе NULL */
+const char *log_bin_format_ptr(const uint8_t buf[], size_t len);
+
+/* форматирование с уже проверенной строкой формата, первое слово пропускается */
+size_t log_bin_format_with(char out[], size_t size, const char format[], const uint8_t buf[],
+			   size_t len);
@@ -8,3 +8,4 @@
 
 #define LOG_ITEM_END (0U)
 #define LOG_ITEM_CONTINUE (1U)
+#define LOG_ITEM_BINARY (2U) /* сообщение с отложенным форматированием */
@@ -0,0 +1,62 @@
+/**
+ * @file spool.h
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Формат сегментных файлов журнала
+ */
+
+#pragma once
+
+#include <log/spool.h>
+
+#define SPOOL_MAGIC "RHEXSPL1"
+#define SPOOL_VERSION (1U)
+
+/* записи в сегменте выравниваются на 8 байт */
+#define SPOOL_ALIGN (8U)
+
+/* число сервисов и строк формата в одном сегменте */
+#define SPOOL_NAMES_MAX (64U)
+#define SPOOL_FORMATS_MAX (1024U)
+
+#define SPOOL_NAME_UNKNOWN (0xFFFFU)
+
+/* заголовок сегмента */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t hdr_size;
+	uint64_t seq;  /* номер сегмента, растет непрерывно */
+	uint64_t size; /* размер файла */
+	uint64_t used; /* занятый объем, обновляется после каждой группы записей */
+} spool_segment_t;
+
+enum spool_entry_type {
+	SPOOL_ENTRY_NAME = 1, /**< @brief имя сервиса, id - номер сервиса */
+	SPOOL_ENTRY_FORMAT,   /**< @brief строка формата с нулем, id - номер формата */
+	SPOOL_ENTRY_TEXT,     /**< @brief готовый текст, id - номер сервиса */
+	SPOOL_ENTRY_BINARY    /**< @brief двоичное сообщение, id - номер сервиса */
+};
+
+/*
+ * Двоичное сообщение хранится в формате log_bin_encode(), только первое
+ * слово вместо указателя на строку формата содержит ее номер.
+ */
+typedef struct {
+	uint8_t type;
+	uint8_t level;
+	uint16_t id;
+	uint32_t len; /* длина данных без выравнивания */
+	uint64_t date;
+} spool_entry_t;
+
+static inline size_t
+spool_entry_size(size_t len)
+{
+	return sizeof(spool_entry_t) + ((len + SPOOL_ALIGN - 1U) & ~(size_t)(SPOOL_ALIGN - 1U));
+}
+
+/* копирование сообщения в спулер, вызывается из log_print() */
+void spool_put(const char name[], enum log_level level, uint64_t date, bool binary,
+	       const uint8_t msg[], size_t len);
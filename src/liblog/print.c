@@ -9,8 +9,10 @@
 #include <stdio.h>
 
 #include <log/read.h>
+#include <private/binary.h>
 #include <private/format.h>
 #include <private/print.h>
+#include <private/spool.h>
 
 #define PR_RED "\x1B[31m"
 #define PR_GRN "\x1B[32m"
@@ -21,6 +23,12 @@
 #define PR_WHT "\x1B[37m"
 #define PR_RES "\x1B[0m"
 
+/* максимальный размер сообщения и текста двоичного сообщения после форматирования */
+#define BIN_MSG_LEN (512U)
+#define BIN_TEXT_LEN (1024U)
+
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE - 1U)
+
 static const struct {
 	const char *color;
 	const char *msg;
@@ -57,6 +65,76 @@ msg_print(enum log_level level, const char format[], va_list args)
 	msg_end();
 }
 
+/**
+ * @brief число записей в готовом к чтению сообщении
+ * @retval 0 - сообщение еще не дописано
+ */
+static uint32_t
+message_records(log_buffer_t *log, uint32_t tail, uint32_t head)
+{
+	uint32_t count = 0U;
+	uint32_t pos = tail;
+
+	while (pos != head) {
+		struct log_record_t *record = &log->records[pos & LOG_BUFFER_MASK];
+		if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != (pos + 1U)) {
+			break;
+		}
+
+		pos++;
+		if ((record->log_continue & LOG_ITEM_CONTINUE) == 0U) {
+			count = pos - tail;
+			break;
+		}
+	}
+
+	return count;
+}
+
+static void
+print_message(const char name[], log_buffer_t *log, uint32_t tail, uint32_t count)
+{
+	static uint8_t msg[BIN_MSG_LEN];
+	size_t msg_len = 0U;
+
+	struct log_record_t *record = &log->records[tail & LOG_BUFFER_MASK];
+	bool binary = (record->log_continue & LOG_ITEM_BINARY) != 0U;
+	enum log_level level = record->level;
+	uint64_t date = record->date;
+
+	/* собираем сообщение целиком */
+	uint32_t i;
+	for (i = 0U; i < count; i++) {
+		record = &log->records[(tail + i) & LOG_BUFFER_MASK];
+
+		/* длина пишется сервисом: запись длиннее буфера испорчена, сообщение
+		 * пропускаем целиком */
+		if (record->msg_len > sizeof(record->msg)) {
+			return;
+		}
+
+		if ((msg_len + record->msg_len) <= BIN_MSG_LEN) {
+			memcpy(&msg[msg_len], record->msg, record->msg_len);
+			msg_len += record->msg_len;
+		}
+	}
+
+	fprintf(stderr, "[%10s ] ", name);
+	msg_begin(level);
+
+	if (binary) {
+		static char text[BIN_TEXT_LEN];
+		size_t len = log_bin_format(text, sizeof(text), msg, msg_len);
+		fwrite(text, len, 1U, stderr);
+	} else {
+		fwrite(msg, msg_len, 1U, stderr);
+	}
+
+	msg_end();
+
+	spool_put(name, level, date, binary, msg, msg_len);
+}
+
 void
 log_print(const char name[], log_buffer_t *log)
 {
@@ -65,25 +143,94 @@ log_print(const char name[], log_buffer_t *log)
 			break;
 		}
 
-		if (log->head == log->tail) {
-			break;
+		uint32_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+		if (dropped != log->dropped_reported) {
+			fprintf(stderr, "[%10s ] ", name);
+			msg_begin(LOG_WARN);
+			fprintf(stderr, "log overrun: %u messages dropped",
+				dropped - log->dropped_reported);
+			msg_end();
+			log->dropped_reported = dropped;
 		}
 
-		struct log_record_t *record = &log->records[log->tail];
-		fprintf(stderr, "[%10s ] ", name);
-		msg_begin(record->level);
+		uint32_t tail = log->tail;
+		uint32_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
 
-		do {
-			fwrite(record->msg, record->msg_len, 1U, stderr);
-			if (record->log_continue == LOG_ITEM_END) {
+		while (tail != head) {
+			uint32_t count = message_records(log, tail, head);
+			if (count == 0U) {
+				/* писатель еще заполняет сообщение, дочитаем в следующий раз */
 				break;
 			}
-			log->tail = (log->tail + 1U) % LOG_BUFFER_SIZE;
-			record = &log->records[log->tail];
-		} while (log->head != log->tail);
 
-		log->tail = (log->tail + 1U) % LOG_BUFFER_SIZE;
+			print_message(name, log, tail, count);
+
+			tail += count;
+			/* освобождаем записи для писателей */
+			__atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+		}
+	} while (false);
+}
+
+int
+log_notify_fd(const log_buffer_t *log)
+{
+	return (log != NULL) ? log->notify_fd : -1;
+}
+
+bool
+log_wait_prepare(log_buffer_t *log)
+{
+	bool result = true;
+
+	do {
+		if (log == NULL) {
+			break;
+		}
+
+		__atomic_store_n(&log->waiting, 1U, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		uint32_t tail = log->tail;
+		uint32_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+		/* недописанное сообщение не мешает спать: писатель разбудит по завершении */
+		if ((tail != head) && (message_records(log, tail, head) != 0U)) {
+			result = false;
+			break;
+		}
+
+		if (__atomic_load_n(&log->dropped, __ATOMIC_RELAXED) != log->dropped_reported) {
+			result = false;
+		}
+	} while (false);
+
+	return result;
+}
+
+void
+log_notify_clear(const log_buffer_t *log)
+{
+	if ((log != NULL) && (log->notify_fd >= 0)) {
+		uint64_t count;
+		if (read(log->notify_fd, &count, sizeof(count)) < 0) {
+			/* уведомлений не было */
+		}
+	}
+}
+
+uint32_t
+log_reset(log_buffer_t *log)
+{
+	uint32_t lost = 0U;
+
+	if (log != NULL) {
+		uint32_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+		lost = head - log->tail;
+
+		/* старые seq не совпадут с новыми позициями: позиции растут непрерывно */
+		__atomic_store_n(&log->tail, head, __ATOMIC_RELEASE);
+	}
 
-		msg_end();
-	} while (log->head != log->tail);
+	return lost;
 }
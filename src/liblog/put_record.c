@@ -13,45 +13,129 @@
 #include <log/log.h>
 #include <svc/svc.h>
 
+#include <private/binary.h>
 #include <private/format.h>
 #include <private/print.h>
 #include <private/record.h>
 
 #define MSG_BUFF_LEN (512U)
 
-static char tmp_msg_buff[MSG_BUFF_LEN];
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE - 1U)
+
+static bool log_deferred = false;
+
+void
+log_set_deferred(bool deferred)
+{
+	log_deferred = deferred;
+}
+
+/**
+ * @brief резервирование записей под сообщение целиком
+ * @param log [in] буфер журнала
+ * @param count [in] число записей
+ * @param pos [out] позиция первой записи
+ * @retval false - места нет, сообщение отброшено
+ */
+static bool
+reserve_records(log_buffer_t *log, uint32_t count, uint32_t *pos)
+{
+	uint32_t head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+
+	do {
+		uint32_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+		if ((head - tail + count) > LOG_BUFFER_SIZE) {
+			/* читатель не успевает - теряем новое сообщение, а не читаемые */
+			__atomic_add_fetch(&log->dropped, 1U, __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&log->head, &head, head + count, true,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*pos = head;
+
+	return true;
+}
+
+/**
+ * @brief пробуждение читателя, если он спит
+ * @details пара к log_wait_prepare(): публикация сообщения, затем проверка
+ * флага; у читателя - флаг, затем проверка сообщений. Системный вызов
+ * делает только первый писатель после засыпания читателя.
+ */
+static void
+notify_reader(log_buffer_t *log)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if ((__atomic_load_n(&log->waiting, __ATOMIC_RELAXED) != 0U) &&
+	    (__atomic_exchange_n(&log->waiting, 0U, __ATOMIC_RELAXED) != 0U) &&
+	    (log->notify_fd >= 0)) {
+		uint64_t one = 1ULL;
+		if (write(log->notify_fd, &one, sizeof(one)) < 0) {
+			/* счетчик eventfd переполнен - читатель и так разбужен */
+		}
+	}
+}
 
 void
 log_put_record(enum log_level level, const char format[], va_list args)
 {
 	log_buffer_t *log = get_log_buffer();
 	if (log) {
+		union {
+			char c[MSG_BUFF_LEN];
+			uint8_t u8[MSG_BUFF_LEN];
+		} msg_buff;
+
 		uint64_t tm = svc_get_time();
 		uint32_t len;
-		uint32_t offset = 0;
+		uint8_t flags = 0U;
 
-		len = (uint32_t)vsnprintf(tmp_msg_buff, MSG_BUFF_LEN, format, args);
+		if (log_deferred) {
+			len = log_bin_encode(msg_buff.u8, MSG_BUFF_LEN, format, args);
+			flags = LOG_ITEM_BINARY;
+		} else {
+			int r = vsnprintf(msg_buff.c, MSG_BUFF_LEN, format, args);
+			len = (r < 0) ? 0U : (uint32_t)r;
+			if (len >= MSG_BUFF_LEN) {
+				/* сообщение обрезано vsnprintf() */
+				len = MSG_BUFF_LEN - 1U;
+			}
+		}
 
-		struct log_record_t *record;
+		uint32_t count = (len + LOG_ITEM_MAXMSG - 1U) / LOG_ITEM_MAXMSG;
+		if (count == 0U) {
+			count = 1U;
+		}
+
+		uint32_t pos;
+		if (!reserve_records(log, count, &pos)) {
+			return;
+		}
+
+		uint32_t offset = 0U;
+		uint32_t i;
+		for (i = 0U; i < count; i++) {
+			struct log_record_t *record = &log->records[(pos + i) & LOG_BUFFER_MASK];
+			uint32_t chunk = len - offset;
+			if (chunk > LOG_ITEM_MAXMSG) {
+				chunk = LOG_ITEM_MAXMSG;
+			}
 
-		while ((len - offset) > LOG_ITEM_MAXMSG) {
-			record = &log->records[log->head];
 			record->level = level;
 			record->date = tm;
-			record->msg_len = LOG_ITEM_MAXMSG;
-			record->log_continue = LOG_ITEM_CONTINUE;
-			memcpy(record->msg, &tmp_msg_buff[offset], LOG_ITEM_MAXMSG);
-			offset += LOG_ITEM_MAXMSG;
-			log->head = (log->head + 1U) % LOG_BUFFER_SIZE;
+			record->msg_len = (uint8_t)chunk;
+			record->log_continue =
+			    (uint8_t)(((i + 1U) < count ? LOG_ITEM_CONTINUE : LOG_ITEM_END) | flags);
+			memcpy(record->msg, &msg_buff.u8[offset], chunk);
+			offset += chunk;
+
+			/* запись готова к чтению */
+			__atomic_store_n(&record->seq, pos + i + 1U, __ATOMIC_RELEASE);
 		}
 
-		record = &log->records[log->head];
-		record->level = level;
-		record->date = tm;
-		record->msg_len = len - offset;
-		record->log_continue = LOG_ITEM_END;
-		memcpy(record->msg, &tmp_msg_buff[offset], len - offset);
-		log->head = (log->head + 1U) % LOG_BUFFER_SIZE;
+		notify_reader(log);
 	} else {
 		msg_print(level, format, args);
 	}
@@ -0,0 +1,494 @@
+/**
+ * @file spool.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Запись журналов в сегментные файлы
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <svc/svc.h>
+
+#include <private/binary.h>
+#include <private/spool.h>
+
+/* период сброса данных на диск */
+#define SPOOL_SYNC_PERIOD (1ULL * TIME_S)
+
+/* очередь дескрипторов для потока синхронизации */
+#define SPOOL_SYNC_QUEUE (8U)
+
+#define SPOOL_NAME_LEN (32U)
+#define SPOOL_PATH_LEN (256U)
+#define SPOOL_FILE_LEN (SPOOL_PATH_LEN + 32U)
+
+#define SPOOL_FORMATS_MASK (SPOOL_FORMATS_MAX - 1U)
+
+/* размер текста при форматировании, когда таблица форматов переполнена */
+#define SPOOL_TEXT_LEN (1024U)
+
+struct log_spool {
+	char dir[SPOOL_PATH_LEN];
+	size_t segment_size;
+	uint32_t segments;
+
+	/* текущий сегмент */
+	uint64_t seq;
+	int fd;
+	uint8_t *map;
+	size_t used;
+	bool dirty;
+	uint64_t last_sync;
+
+	/* имена сервисов, номер сохраняется между сегментами */
+	char names[SPOOL_NAMES_MAX][SPOOL_NAME_LEN];
+	uint32_t names_count;
+	uint64_t names_written; /* маска имен, записанных в текущий сегмент */
+
+	/* строки формата текущего сегмента: открытая адресация по указателю */
+	struct {
+		const char *format;
+		uint16_t id;
+	} formats[SPOOL_FORMATS_MAX];
+	uint32_t formats_count;
+
+	/* поток синхронизации */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queue[SPOOL_SYNC_QUEUE];
+	uint32_t queue_len;
+	bool stop;
+};
+
+static log_spool_t *spool_attached = NULL;
+
+static void *
+sync_thread(void *arg)
+{
+	log_spool_t *spool = (log_spool_t *)arg;
+
+	pthread_mutex_lock(&spool->lock);
+
+	while (true) {
+		while ((spool->queue_len == 0U) && !spool->stop) {
+			pthread_cond_wait(&spool->cond, &spool->lock);
+		}
+
+		if (spool->queue_len == 0U) {
+			break;
+		}
+
+		int fds[SPOOL_SYNC_QUEUE];
+		uint32_t count = spool->queue_len;
+		memcpy(fds, spool->queue, count * sizeof(int));
+		spool->queue_len = 0U;
+
+		pthread_mutex_unlock(&spool->lock);
+
+		uint32_t i;
+		for (i = 0U; i < count; i++) {
+			fdatasync(fds[i]);
+			close(fds[i]);
+		}
+
+		pthread_mutex_lock(&spool->lock);
+	}
+
+	pthread_mutex_unlock(&spool->lock);
+
+	return NULL;
+}
+
+/**
+ * @brief передача дескриптора потоку синхронизации
+ * @details дескриптор закрывается потоком после fdatasync()
+ */
+static void
+sync_request(log_spool_t *spool, int fd)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&spool->lock);
+	if (spool->queue_len < SPOOL_SYNC_QUEUE) {
+		spool->queue[spool->queue_len++] = fd;
+		queued = true;
+		pthread_cond_signal(&spool->cond);
+	}
+	pthread_mutex_unlock(&spool->lock);
+
+	if (!queued) {
+		/* диск не успевает: данные остаются в page cache до фоновой записи ядром */
+		close(fd);
+	}
+}
+
+static void
+segment_path(const log_spool_t *spool, uint32_t index, char path[], size_t size)
+{
+	snprintf(path, size, "%s/spool_%02u.seg", spool->dir, index);
+}
+
+static void
+segment_close(log_spool_t *spool)
+{
+	if (spool->map != NULL) {
+		munmap(spool->map, spool->segment_size);
+		spool->map = NULL;
+	}
+
+	if (spool->fd >= 0) {
+		if (spool->dirty) {
+			sync_request(spool, spool->fd);
+		} else {
+			close(spool->fd);
+		}
+		spool->fd = -1;
+	}
+}
+
+static bool
+segment_open(log_spool_t *spool)
+{
+	bool result = false;
+
+	do {
+		char path[SPOOL_FILE_LEN];
+		segment_path(spool, (uint32_t)(spool->seq % spool->segments), path, sizeof(path));
+
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+		if (fd < 0) {
+			log_err("spool: cannot open \"%s\"", path);
+			break;
+		}
+
+		if (ftruncate(fd, (off_t)spool->segment_size) == -1) {
+			log_err("spool: cannot ftruncate()");
+			close(fd);
+			break;
+		}
+
+		void *map =
+		    mmap(NULL, spool->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			log_err("spool: cannot mmap()");
+			close(fd);
+			break;
+		}
+
+		spool->fd = fd;
+		spool->map = (uint8_t *)map;
+
+		/* сегмент переиспользуется: старые данные за used не читаются */
+		spool_segment_t *hdr = (spool_segment_t *)map;
+		hdr->used = 0U;
+		memcpy(hdr->magic, SPOOL_MAGIC, sizeof(hdr->magic));
+		hdr->version = SPOOL_VERSION;
+		hdr->hdr_size = sizeof(spool_segment_t);
+		hdr->seq = spool->seq;
+		hdr->size = spool->segment_size;
+		__atomic_store_n(&hdr->used, sizeof(spool_segment_t), __ATOMIC_RELEASE);
+
+		spool->used = sizeof(spool_segment_t);
+		spool->dirty = true;
+		spool->names_written = 0U;
+		memset(spool->formats, 0, sizeof(spool->formats));
+		spool->formats_count = 0U;
+
+		result = true;
+	} while (false);
+
+	return result;
+}
+
+log_spool_t *
+log_spool_open(const char dir[], size_t segment_size, uint32_t segments)
+{
+	log_spool_t *spool = NULL;
+
+	do {
+		if ((segments == 0U) || (segment_size < (2U * SPOOL_TEXT_LEN)) ||
+		    (strlen(dir) >= SPOOL_PATH_LEN)) {
+			log_err("spool: invalid parameters");
+			break;
+		}
+
+		if ((mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP) == -1) && (errno != EEXIST)) {
+			log_err("spool: cannot create \"%s\"", dir);
+			break;
+		}
+
+		spool = calloc(1U, sizeof(log_spool_t));
+		if (spool == NULL) {
+			log_err("spool: out of memory");
+			break;
+		}
+
+		strcpy(spool->dir, dir);
+		spool->segment_size = segment_size;
+		spool->segments = segments;
+		spool->fd = -1;
+
+		/* продолжаем после самого свежего сегмента, чтобы не затереть лог до сбоя */
+		uint32_t i;
+		for (i = 0U; i < segments; i++) {
+			char path[SPOOL_FILE_LEN];
+			uint64_t seq;
+
+			segment_path(spool, i, path, sizeof(path));
+			if (log_spool_segment_seq(path, &seq) && (seq >= spool->seq)) {
+				spool->seq = seq + 1U;
+			}
+		}
+
+		pthread_mutex_init(&spool->lock, NULL);
+		pthread_cond_init(&spool->cond, NULL);
+
+		if (pthread_create(&spool->thread, NULL, sync_thread, spool) != 0) {
+			log_err("spool: cannot create sync thread");
+			free(spool);
+			spool = NULL;
+			break;
+		}
+
+		if (!segment_open(spool)) {
+			log_spool_close(spool);
+			spool = NULL;
+			break;
+		}
+
+		spool->last_sync = svc_get_monotime();
+	} while (false);
+
+	return spool;
+}
+
+void
+log_spool_close(log_spool_t *spool)
+{
+	if (spool == NULL) {
+		return;
+	}
+
+	if (spool_attached == spool) {
+		spool_attached = NULL;
+	}
+
+	segment_close(spool);
+
+	/* поток досинхронизирует очередь и завершится */
+	pthread_mutex_lock(&spool->lock);
+	spool->stop = true;
+	pthread_cond_signal(&spool->cond);
+	pthread_mutex_unlock(&spool->lock);
+
+	pthread_join(spool->thread, NULL);
+
+	free(spool);
+}
+
+void
+log_spool_forget(log_spool_t *spool)
+{
+	if (spool == NULL) {
+		return;
+	}
+
+	if (spool_attached == spool) {
+		spool_attached = NULL;
+	}
+
+	if (spool->map != NULL) {
+		munmap(spool->map, spool->segment_size);
+	}
+
+	if (spool->fd >= 0) {
+		close(spool->fd);
+	}
+
+	/* после fork() поток один: мьютекс мог быть скопирован захваченным */
+	uint32_t i;
+	for (i = 0U; (i < spool->queue_len) && (i < SPOOL_SYNC_QUEUE); i++) {
+		close(spool->queue[i]);
+	}
+
+	free(spool);
+}
+
+void
+log_spool_attach(log_spool_t *spool)
+{
+	spool_attached = spool;
+}
+
+void
+log_spool_tick(log_spool_t *spool)
+{
+	if ((spool == NULL) || (spool->fd < 0)) {
+		return;
+	}
+
+	uint64_t now = svc_get_monotime();
+	if (spool->dirty && ((now - spool->last_sync) >= SPOOL_SYNC_PERIOD)) {
+		int fd = dup(spool->fd);
+		if (fd >= 0) {
+			sync_request(spool, fd);
+		}
+
+		spool->dirty = false;
+		spool->last_sync = now;
+	}
+}
+
+static uint16_t
+name_id(log_spool_t *spool, const char name[])
+{
+	uint32_t i;
+
+	for (i = 0U; i < spool->names_count; i++) {
+		if (strncmp(spool->names[i], name, SPOOL_NAME_LEN - 1U) == 0) {
+			return (uint16_t)i;
+		}
+	}
+
+	if (spool->names_count == SPOOL_NAMES_MAX) {
+		return SPOOL_NAME_UNKNOWN;
+	}
+
+	strncpy(spool->names[i], name, SPOOL_NAME_LEN - 1U);
+	spool->names_count++;
+
+	return (uint16_t)i;
+}
+
+/**
+ * @brief поиск строки формата в таблице сегмента
+ * @param slot [out] ячейка таблицы: найденная или свободная
+ * @retval true - формат уже записан в сегмент
+ */
+static bool
+format_find(log_spool_t *spool, const char format[], uint32_t *slot)
+{
+	uint32_t h = (uint32_t)(((uintptr_t)format >> 3U) * 2654435761U) & SPOOL_FORMATS_MASK;
+
+	while (spool->formats[h].format != NULL) {
+		if (spool->formats[h].format == format) {
+			break;
+		}
+		h = (h + 1U) & SPOOL_FORMATS_MASK;
+	}
+
+	*slot = h;
+
+	return spool->formats[h].format != NULL;
+}
+
+static void
+entry_put(log_spool_t *spool, uint8_t type, enum log_level level, uint16_t id, uint64_t date,
+	  const void *data, size_t len)
+{
+	spool_entry_t *entry = (spool_entry_t *)&spool->map[spool->used];
+
+	entry->type = type;
+	entry->level = (uint8_t)level;
+	entry->id = id;
+	entry->len = (uint32_t)len;
+	entry->date = date;
+	memcpy(&entry[1], data, len);
+
+	spool->used += spool_entry_size(len);
+}
+
+void
+spool_put(const char name[], enum log_level level, uint64_t date, bool binary,
+	  const uint8_t msg[], size_t len)
+{
+	log_spool_t *spool = spool_attached;
+
+	if ((spool == NULL) || (spool->map == NULL)) {
+		return;
+	}
+
+	static char text[SPOOL_TEXT_LEN];
+	const char *format = NULL;
+	uint32_t slot = 0U;
+	bool new_format = false;
+
+	if (binary) {
+		if (len < sizeof(uint64_t)) {
+			return;
+		}
+		format = log_bin_format_ptr(msg, len);
+		if (format == NULL) {
+			/* испорченный указатель не разыменовываем, пишем заглушку текстом */
+			len = log_bin_format(text, sizeof(text), msg, len);
+			msg = (const uint8_t *)text;
+			binary = false;
+		}
+	}
+
+	uint16_t id = name_id(spool, name);
+
+	/* места должно хватить на имя, формат и сообщение вместе,
+	 * двоичное сообщение может быть сохранено текстом */
+	size_t need = spool_entry_size(SPOOL_NAME_LEN);
+	if (binary) {
+		need += spool_entry_size(strlen(format) + 1U);
+		need += spool_entry_size((len > SPOOL_TEXT_LEN) ? len : SPOOL_TEXT_LEN);
+	} else {
+		need += spool_entry_size(len);
+	}
+
+	if ((spool->used + need) > spool->segment_size) {
+		segment_close(spool);
+		spool->seq++;
+		if (!segment_open(spool)) {
+			return;
+		}
+	}
+
+	if (binary) {
+		new_format = !format_find(spool, format, &slot);
+		if (new_format && ((spool->formats_count * 4U) >= (SPOOL_FORMATS_MAX * 3U))) {
+			/* таблица заполнена: сохраняем готовый текст */
+			len = log_bin_format(text, sizeof(text), msg, len);
+			msg = (const uint8_t *)text;
+			binary = false;
+			new_format = false;
+		}
+	}
+
+	if ((id != SPOOL_NAME_UNKNOWN) && ((spool->names_written & (1ULL << id)) == 0U)) {
+		const char *n = spool->names[id];
+		entry_put(spool, SPOOL_ENTRY_NAME, LOG_INF, id, date, n, strlen(n) + 1U);
+		spool->names_written |= 1ULL << id;
+	}
+
+	if (binary) {
+		if (new_format) {
+			spool->formats[slot].format = format;
+			spool->formats[slot].id = (uint16_t)spool->formats_count++;
+			entry_put(spool, SPOOL_ENTRY_FORMAT, LOG_INF, spool->formats[slot].id, date,
+				  format, strlen(format) + 1U);
+		}
+
+		/* указатель на формат заменяется номером */
+		spool_entry_t *entry = (spool_entry_t *)&spool->map[spool->used];
+		entry_put(spool, SPOOL_ENTRY_BINARY, level, id, date, msg, len);
+		uint64_t fmt_id = spool->formats[slot].id;
+		memcpy(&entry[1], &fmt_id, sizeof(fmt_id));
+	} else {
+		entry_put(spool, SPOOL_ENTRY_TEXT, level, id, date, msg, len);
+	}
+
+	spool->dirty = true;
+
+	/* группа записей видна читателю целиком */
+	spool_segment_t *hdr = (spool_segment_t *)spool->map;
+	__atomic_store_n(&hdr->used, spool->used, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,193 @@
+/**
+ * @file spool_read.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Разбор сегментных файлов журнала
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <private/binary.h>
+#include <private/spool.h>
+
+/* максимальный размер двоичного сообщения и текста после форматирования */
+#define SPOOL_MSG_LEN (1024U)
+#define SPOOL_TEXT_LEN (1024U)
+
+static bool
+segment_valid(const spool_segment_t *hdr, size_t file_size)
+{
+	return (file_size >= sizeof(spool_segment_t)) &&
+	       (memcmp(hdr->magic, SPOOL_MAGIC, sizeof(hdr->magic)) == 0) &&
+	       (hdr->version == SPOOL_VERSION) && (hdr->hdr_size == sizeof(spool_segment_t)) &&
+	       (hdr->used >= sizeof(spool_segment_t)) && (hdr->used <= file_size);
+}
+
+bool
+log_spool_segment_seq(const char path[], uint64_t *seq)
+{
+	bool result = false;
+
+	do {
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			break;
+		}
+
+		spool_segment_t hdr;
+		struct stat st;
+		bool ok = (fstat(fd, &st) == 0) && (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+		close(fd);
+
+		if (!ok || !segment_valid(&hdr, (size_t)st.st_size)) {
+			break;
+		}
+
+		*seq = hdr.seq;
+		result = true;
+	} while (false);
+
+	return result;
+}
+
+/* строка с завершающим нулем внутри данных записи */
+static const char *
+entry_string(const spool_entry_t *entry)
+{
+	const char *s = (const char *)&entry[1];
+
+	if ((entry->len == 0U) || (s[entry->len - 1U] != '\0')) {
+		return NULL;
+	}
+
+	return s;
+}
+
+int32_t
+log_spool_decode(const char path[], log_spool_cb_t cb, void *arg)
+{
+	int32_t result = -1;
+	void *map = MAP_FAILED;
+	size_t size = 0U;
+	const char **formats = NULL;
+
+	do {
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			break;
+		}
+
+		struct stat st;
+		if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(spool_segment_t))) {
+			close(fd);
+			break;
+		}
+
+		size = (size_t)st.st_size;
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			break;
+		}
+
+		const spool_segment_t *hdr = (const spool_segment_t *)map;
+		if (!segment_valid(hdr, size)) {
+			break;
+		}
+
+		formats = calloc(SPOOL_FORMATS_MAX, sizeof(char *));
+		if (formats == NULL) {
+			break;
+		}
+
+		const char *names[SPOOL_NAMES_MAX] = {NULL};
+		const uint8_t *data = (const uint8_t *)map;
+		size_t used = __atomic_load_n(&hdr->used, __ATOMIC_ACQUIRE);
+		size_t pos = sizeof(spool_segment_t);
+		int32_t count = 0;
+
+		while ((pos + sizeof(spool_entry_t)) <= used) {
+			const spool_entry_t *entry = (const spool_entry_t *)&data[pos];
+			if ((entry->len > (used - pos)) || ((pos + spool_entry_size(entry->len)) > used)) {
+				/* запись повреждена, дальше разбирать нельзя */
+				break;
+			}
+			pos += spool_entry_size(entry->len);
+
+			log_spool_msg_t msg = {
+			    .date = entry->date,
+			    .level = (enum log_level)entry->level,
+			    .name = ((entry->id < SPOOL_NAMES_MAX) && (names[entry->id] != NULL))
+					? names[entry->id]
+					: "?",
+			    .text = NULL,
+			};
+
+			static char text[SPOOL_TEXT_LEN];
+
+			switch (entry->type) {
+			case SPOOL_ENTRY_NAME:
+				if (entry->id < SPOOL_NAMES_MAX) {
+					names[entry->id] = entry_string(entry);
+				}
+				break;
+
+			case SPOOL_ENTRY_FORMAT:
+				if (entry->id < SPOOL_FORMATS_MAX) {
+					formats[entry->id] = entry_string(entry);
+				}
+				break;
+
+			case SPOOL_ENTRY_TEXT: {
+				size_t len = (entry->len < (sizeof(text) - 1U)) ? entry->len
+										: (sizeof(text) - 1U);
+				memcpy(text, &entry[1], len);
+				text[len] = '\0';
+				msg.text = text;
+				break;
+			}
+
+			case SPOOL_ENTRY_BINARY: {
+				/* номер формата указывает на строку в сегменте */
+				static uint8_t bin_msg[SPOOL_MSG_LEN];
+				uint64_t word;
+
+				if ((entry->len < sizeof(word)) || (entry->len > sizeof(bin_msg))) {
+					break;
+				}
+
+				memcpy(bin_msg, &entry[1], entry->len);
+				memcpy(&word, bin_msg, sizeof(word));
+				if ((word >= SPOOL_FORMATS_MAX) || (formats[word] == NULL)) {
+					break;
+				}
+
+				log_bin_format_with(text, sizeof(text), formats[word], bin_msg,
+						    entry->len);
+				msg.text = text;
+				break;
+			}
+
+			default:
+				break;
+			}
+
+			if (msg.text != NULL) {
+				cb(&msg, arg);
+				count++;
+			}
+		}
+
+		result = count;
+	} while (false);
+
+	free(formats);
+	if (map != MAP_FAILED) {
+		munmap(map, size);
+	}
+
+	return result;
+}
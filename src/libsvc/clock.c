@@ -0,0 +1,197 @@
+/**
+ * @file clock.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Источник монотонного времени на счетчике процессора
+ */
+
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include <log/log.h>
+#include <svc/clock.h>
+#include <svc/svc.h>
+
+/* ns = base_ns + ((ticks - base_ticks) * mult) >> CLOCK_SHIFT */
+#define CLOCK_SHIFT (32U)
+
+/* интервал калибровки TSC по CLOCK_MONOTONIC_RAW */
+#define CLOCK_CALIBRATE_TIME (50ULL * TIME_MS)
+#define CLOCK_CALIBRATE_TRIES (3U)
+
+static struct {
+	uint64_t mult; /* 0 - счетчик не используется */
+	uint64_t base_ticks;
+	uint64_t base_ns;
+	const char *source;
+} svc_clock = {0ULL, 0ULL, 0ULL, "clock_gettime"};
+
+static uint64_t
+clock_raw(void)
+{
+	struct timespec ts;
+	uint64_t result = 0ULL;
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0) {
+		result = (uint64_t)ts.tv_nsec + ((uint64_t)ts.tv_sec * TIME_S);
+	}
+
+	return result;
+}
+
+#if defined(__aarch64__)
+
+static inline uint64_t
+clock_ticks(void)
+{
+	uint64_t ticks;
+
+	/* isb: счетчик не читается раньше предшествующих инструкций */
+	__asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) : : "memory");
+
+	return ticks;
+}
+
+static uint64_t
+clock_freq(void)
+{
+	uint64_t freq;
+
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+
+	return freq;
+}
+
+#elif defined(__x86_64__)
+
+static inline uint64_t
+clock_ticks(void)
+{
+	return __rdtsc();
+}
+
+static bool
+tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000007U, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+
+	return (edx & (1U << 8U)) != 0U;
+}
+
+/* частота TSC по CLOCK_MONOTONIC_RAW, медиана из нескольких замеров */
+static uint64_t
+clock_freq(void)
+{
+	uint64_t f[CLOCK_CALIBRATE_TRIES];
+	uint32_t i;
+
+	if (!tsc_invariant()) {
+		return 0ULL;
+	}
+
+	for (i = 0U; i < CLOCK_CALIBRATE_TRIES; i++) {
+		/* отметка часов берется посередине между двумя чтениями счетчика */
+		uint64_t c0 = clock_ticks();
+		uint64_t t0 = clock_raw();
+		c0 += (clock_ticks() - c0) / 2ULL;
+
+		struct timespec ts = {0, (long)CLOCK_CALIBRATE_TIME};
+		nanosleep(&ts, NULL);
+
+		uint64_t c1 = clock_ticks();
+		uint64_t t1 = clock_raw();
+		c1 += (clock_ticks() - c1) / 2ULL;
+
+		f[i] = (t1 > t0) ? (uint64_t)(((unsigned __int128)(c1 - c0) * TIME_S) / (t1 - t0))
+				 : 0ULL;
+	}
+
+	/* медиана отсекает замер, прерванный вытеснением */
+	uint32_t j;
+	for (i = 1U; i < CLOCK_CALIBRATE_TRIES; i++) {
+		for (j = i; (j > 0U) && (f[j - 1U] > f[j]); j--) {
+			uint64_t t = f[j];
+			f[j] = f[j - 1U];
+			f[j - 1U] = t;
+		}
+	}
+
+	return f[CLOCK_CALIBRATE_TRIES / 2U];
+}
+
+#endif
+
+#if defined(__aarch64__) || defined(__x86_64__)
+
+bool
+svc_clock_init(void)
+{
+	uint64_t freq = clock_freq();
+
+	if (freq == 0ULL) {
+		log_inf("clock: counter not available, using clock_gettime()");
+		return false;
+	}
+
+	uint64_t mult = (TIME_S << CLOCK_SHIFT) / freq;
+
+	/* продолжение шкалы CLOCK_MONOTONIC_RAW: ранние отметки остаются сравнимы */
+	svc_clock.base_ticks = clock_ticks();
+	svc_clock.base_ns = clock_raw();
+	svc_clock.mult = mult;
+#if defined(__aarch64__)
+	svc_clock.source = "cntvct_el0";
+#else
+	svc_clock.source = "tsc";
+#endif
+
+	log_inf("clock: %s, %llu Hz", svc_clock.source, freq);
+
+	return true;
+}
+
+uint64_t
+svc_get_monotime(void)
+{
+	if (svc_clock.mult == 0ULL) {
+		return clock_raw();
+	}
+
+	uint64_t ticks = clock_ticks() - svc_clock.base_ticks;
+
+	return svc_clock.base_ns +
+	       (uint64_t)(((unsigned __int128)ticks * svc_clock.mult) >> CLOCK_SHIFT);
+}
+
+#else
+
+bool
+svc_clock_init(void)
+{
+	log_inf("clock: counter not supported, using clock_gettime()");
+
+	return false;
+}
+
+uint64_t
+svc_get_monotime(void)
+{
+	return clock_raw();
+}
+
+#endif
+
+const char *
+svc_clock_source(void)
+{
+	return svc_clock.source;
+}
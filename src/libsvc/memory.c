@@ -0,0 +1,74 @@
+/**
+ * @file memory.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Размещение областей общей памяти
+ */
+
+#include <sys/mman.h>
+
+#include <log/log.h>
+#include <svc/memory.h>
+
+#define HUGE_PAGE_SIZE (2U * 1024U * 1024U)
+
+static uint32_t mem_flags = 0U;
+
+void
+svc_mem_set_flags(uint32_t flags)
+{
+	mem_flags = flags;
+}
+
+uint32_t
+svc_mem_get_flags(void)
+{
+	return mem_flags;
+}
+
+void *
+svc_mem_map(int fd, size_t size)
+{
+	int flags = MAP_SHARED;
+
+	if (mem_flags & SVC_MEM_POPULATE) {
+		flags |= MAP_POPULATE;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+	do {
+		if (map == MAP_FAILED) {
+			break;
+		}
+
+		if ((mem_flags & SVC_MEM_HUGE) && (size >= HUGE_PAGE_SIZE)) {
+			/* tmpfs отдаст большие страницы, только если смонтирован с huge= */
+			if (madvise(map, size, MADV_HUGEPAGE) != 0) {
+				log_dbg("madvise(MADV_HUGEPAGE) failed");
+			}
+		}
+
+		if (mem_flags & SVC_MEM_LOCK) {
+			if (mlock(map, size) != 0) {
+				log_warn("mlock() %zu bytes failed, check RLIMIT_MEMLOCK", size);
+			}
+		}
+	} while (false);
+
+	return map;
+}
+
+bool
+svc_mem_lock_all(void)
+{
+	bool result = true;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		log_warn("mlockall() failed, check RLIMIT_MEMLOCK");
+		result = false;
+	}
+
+	return result;
+}
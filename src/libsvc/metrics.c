@@ -0,0 +1,59 @@
+/**
+ * @file metrics.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Счетчики и показатели сервиса
+ */
+
+#include <log/log.h>
+#include <svc/metrics.h>
+#include <svc/svc.h>
+
+/* сюда пишут показатели, не влезшие в таблицу, и процессы без контекста */
+static svc_metric_t metric_dummy;
+
+svc_metric_t *
+svc_metric(const char name[], enum svc_metric_type type)
+{
+	svc_metric_t *result = &metric_dummy;
+
+	do {
+		svc_context_t *ctx = (svc_context_t *)get_svc_context();
+		if (ctx == NULL) {
+			break;
+		}
+
+		svc_metrics_t *metrics = &ctx->metrics;
+		uint32_t count = metrics->count;
+		uint32_t i;
+
+		/* после перезапуска сервиса показатель уже есть в контексте */
+		for (i = 0U; i < count; i++) {
+			if (strncmp(metrics->metric[i].name, name, SVC_METRIC_NAME_LEN) == 0) {
+				result = &metrics->metric[i];
+				break;
+			}
+		}
+
+		if (i < count) {
+			break;
+		}
+
+		if (count == SVC_METRICS_MAX) {
+			log_warn("metric \"%s\": table is full", name);
+			break;
+		}
+
+		svc_metric_t *m = &metrics->metric[count];
+		strncpy(m->name, name, SVC_METRIC_NAME_LEN - 1U);
+		m->type = (uint32_t)type;
+		m->value = 0ULL;
+
+		__atomic_store_n(&metrics->count, count + 1U, __ATOMIC_RELEASE);
+
+		result = m;
+	} while (false);
+
+	return result;
+}
@@ -0,0 +1,332 @@
+/**
+ * @file ring.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Кольцевой буфер записей в общей памяти
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <log/log.h>
+#include <svc/memory.h>
+#include <svc/ring.h>
+
+#define RING_MAGIC (0x52494E475F444154ULL)
+#define RING_GUARD (0x52494E4747554152ULL)
+
+#define CACHE_LINE (64U)
+
+#define RING_PREFIX "RING_RC_"
+
+/*
+ * Очередь с последовательностью на каждой ячейке: писатели резервируют
+ * ячейку CAS-ом tail, читатели - CAS-ом head. Ячейка свободна для записи
+ * позиции pos, когда seq == pos, и готова к чтению, когда seq == pos + 1.
+ */
+
+typedef struct {
+	uint64_t magic;
+	uint32_t size;
+	uint32_t count;
+	uint8_t __pad0[CACHE_LINE - 16U];
+
+	/* сторона писателей */
+	uint64_t tail;
+	uint64_t overflow;
+	uint8_t __pad1[CACHE_LINE - 16U];
+
+	/* сторона читателей */
+	uint64_t head;
+	uint8_t __pad2[CACHE_LINE - 8U];
+} ring_header_t;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t data[];
+} ring_cell_t;
+
+static inline size_t
+cell_size(size_t size)
+{
+	return (sizeof(ring_cell_t) + size + (sizeof(uint64_t) - 1U)) & ~(sizeof(uint64_t) - 1U);
+}
+
+static inline size_t
+calc_ring_size(size_t size, size_t count)
+{
+	return sizeof(ring_header_t) + (cell_size(size) * count);
+}
+
+static inline ring_cell_t *
+ring_cell(ring_t *ring, uint64_t pos)
+{
+	uint8_t *cells = (uint8_t *)ring->map + sizeof(ring_header_t);
+
+	return (ring_cell_t *)(void *)&cells[cell_size(ring->size) * (pos & (ring->count - 1U))];
+}
+
+bool
+ring_init(const char name[], size_t size, size_t count)
+{
+	bool result = false;
+
+	do {
+		if ((count == 0U) || ((count & (count - 1U)) != 0U)) {
+			log_err("ring \"%s\": count %zu is not a power of two", name, count);
+			break;
+		}
+
+		char shm_name[256];
+		snprintf(shm_name, sizeof(shm_name), "/" RING_PREFIX "%s", name);
+		int fd = shm_open(shm_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			log_err("shm_open() \"%s\" error", name);
+			break;
+		}
+
+		size_t map_size = calc_ring_size(size, count);
+
+		if (ftruncate(fd, (off_t)map_size) == -1) {
+			log_err("cannot ftruncate()");
+			close(fd);
+			break;
+		}
+
+		void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			log_err("cannot mmap()");
+			break;
+		}
+
+		ring_header_t *hdr = map;
+		hdr->size = (uint32_t)size;
+		hdr->count = (uint32_t)count;
+		hdr->tail = 0ULL;
+		hdr->head = 0ULL;
+		hdr->overflow = 0ULL;
+
+		ring_t ring = {RING_GUARD, map, size, count};
+		uint64_t pos;
+		for (pos = 0ULL; pos < count; pos++) {
+			ring_cell(&ring, pos)->seq = pos;
+		}
+
+		__atomic_store_n(&hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+		munmap(map, map_size);
+
+		result = true;
+	} while (false);
+
+	return result;
+}
+
+bool
+ring_open(const char name[], ring_t *ring)
+{
+	bool result = false;
+
+	do {
+		char shm_name[256];
+		snprintf(shm_name, sizeof(shm_name), "/" RING_PREFIX "%s", name);
+		int fd = shm_open(shm_name, O_RDWR, S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			log_err("shm_open() \"%s\" error", name);
+			break;
+		}
+
+		void *map =
+		    mmap(NULL, sizeof(ring_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			log_err("cannot mmap()");
+			close(fd);
+			break;
+		}
+
+		ring_header_t header;
+		memcpy(&header, map, sizeof(header));
+		munmap(map, sizeof(ring_header_t));
+
+		if (header.magic != RING_MAGIC) {
+			close(fd);
+			log_err("invalid ring magic");
+			break;
+		}
+
+		map = svc_mem_map(fd, calc_ring_size(header.size, header.count));
+		close(fd);
+		if (map == MAP_FAILED) {
+			log_err("cannot mmap()");
+			break;
+		}
+
+		ring->guard = RING_GUARD;
+		ring->map = map;
+		ring->size = header.size;
+		ring->count = header.count;
+
+		result = true;
+	} while (false);
+
+	return result;
+}
+
+static int32_t
+push_one(ring_t *ring, const void *data, size_t size)
+{
+	ring_header_t *hdr = ring->map;
+	ring_cell_t *cell;
+	uint64_t pos = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+
+	while (true) {
+		cell = ring_cell(ring, pos);
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - pos);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&hdr->tail, &pos, pos + 1U, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* читатель отстал на целый круг */
+			__atomic_add_fetch(&hdr->overflow, 1U, __ATOMIC_RELAXED);
+			return 0;
+		} else {
+			pos = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (size > ring->size) {
+		size = ring->size;
+	}
+	memcpy(cell->data, data, size);
+
+	__atomic_store_n(&cell->seq, pos + 1U, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static int32_t
+pop_one(ring_t *ring, void *data, size_t size)
+{
+	ring_header_t *hdr = ring->map;
+	ring_cell_t *cell;
+	uint64_t pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+
+	while (true) {
+		cell = ring_cell(ring, pos);
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - (pos + 1U));
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&hdr->head, &pos, pos + 1U, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* пусто */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (size > ring->size) {
+		size = ring->size;
+	}
+	memcpy(data, cell->data, size);
+
+	/* ячейка свободна для записи на следующем круге */
+	__atomic_store_n(&cell->seq, pos + ring->count, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int32_t
+ring_push(ring_t *ring, const void *data, size_t size)
+{
+	if (ring->guard != RING_GUARD) {
+		log_err("ring guard error!");
+		return -1;
+	}
+
+	return push_one(ring, data, size);
+}
+
+int32_t
+ring_pop(ring_t *ring, void *data, size_t size)
+{
+	if (ring->guard != RING_GUARD) {
+		log_err("ring guard error!");
+		return -1;
+	}
+
+	return pop_one(ring, data, size);
+}
+
+size_t
+ring_push_batch(ring_t *ring, const void *data, size_t count)
+{
+	size_t i = 0U;
+
+	if (ring->guard != RING_GUARD) {
+		log_err("ring guard error!");
+	} else {
+		const uint8_t *rec = data;
+
+		for (i = 0U; i < count; i++) {
+			if (push_one(ring, &rec[i * ring->size], ring->size) == 0) {
+				break;
+			}
+		}
+
+		if (i + 1U < count) {
+			/* первая неудачная запись уже учтена в push_one() */
+			ring_header_t *hdr = ring->map;
+			__atomic_add_fetch(&hdr->overflow, count - i - 1U, __ATOMIC_RELAXED);
+		}
+	}
+
+	return i;
+}
+
+size_t
+ring_pop_batch(ring_t *ring, void *data, size_t count)
+{
+	size_t i = 0U;
+
+	if (ring->guard != RING_GUARD) {
+		log_err("ring guard error!");
+	} else {
+		uint8_t *rec = data;
+
+		for (i = 0U; i < count; i++) {
+			if (pop_one(ring, &rec[i * ring->size], ring->size) == 0) {
+				break;
+			}
+		}
+	}
+
+	return i;
+}
+
+uint64_t
+ring_overflow(ring_t *ring)
+{
+	uint64_t result = 0ULL;
+
+	if (ring->guard != RING_GUARD) {
+		log_err("ring guard error!");
+	} else {
+		ring_header_t *hdr = ring->map;
+		result = __atomic_load_n(&hdr->overflow, __ATOMIC_RELAXED);
+	}
+
+	return result;
+}
@@ -0,0 +1,126 @@
+/**
+ * @file sched.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Планирование и ограничения ресурсов сервиса
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <log/log.h>
+#include <svc/sched.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_GROUP "rhex"
+
+#define CPUS_MAX (32U)
+
+static bool
+write_file(const char path[], const char value[])
+{
+	bool result = false;
+
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		size_t len = strlen(value);
+		result = (write(fd, value, len) == (ssize_t)len);
+		close(fd);
+	}
+
+	return result;
+}
+
+/**
+ * @brief перенос процесса в собственную группу с ограничением памяти
+ * @details cgroup v2 (единая иерархия) или контроллер memory cgroup v1
+ */
+static bool
+cgroup_join(const char name[], uint64_t mem_limit)
+{
+	char dir[256];
+	char path[300];
+	char value[32];
+	bool v2 = (access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0);
+
+	if (v2) {
+		/* контроллер memory должен быть разрешен для подгрупп */
+		write_file(CGROUP_ROOT "/cgroup.subtree_control", "+memory");
+		mkdir(CGROUP_ROOT "/" CGROUP_GROUP, S_IRWXU);
+		write_file(CGROUP_ROOT "/" CGROUP_GROUP "/cgroup.subtree_control", "+memory");
+		snprintf(dir, sizeof(dir), CGROUP_ROOT "/" CGROUP_GROUP "/%s", name);
+	} else {
+		mkdir(CGROUP_ROOT "/memory/" CGROUP_GROUP, S_IRWXU);
+		snprintf(dir, sizeof(dir), CGROUP_ROOT "/memory/" CGROUP_GROUP "/%s", name);
+	}
+
+	if ((mkdir(dir, S_IRWXU) == -1) && (errno != EEXIST)) {
+		log_warn("cannot create cgroup \"%s\"", dir);
+		return false;
+	}
+
+	snprintf(value, sizeof(value), "%llu", (unsigned long long)mem_limit);
+	snprintf(path, sizeof(path), "%s/%s", dir, v2 ? "memory.max" : "memory.limit_in_bytes");
+	if (!write_file(path, value)) {
+		log_warn("cannot set memory limit for \"%s\"", name);
+		return false;
+	}
+
+	/* "0" - текущий процесс */
+	snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+	if (!write_file(path, "0")) {
+		log_warn("cannot move \"%s\" to cgroup", name);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+svc_sched_apply(const char name[], const svc_sched_t *sched)
+{
+	bool result = true;
+
+	if (sched->cpus != 0U) {
+		cpu_set_t set;
+		uint32_t cpu;
+
+		CPU_ZERO(&set);
+		for (cpu = 0U; cpu < CPUS_MAX; cpu++) {
+			if (sched->cpus & (1U << cpu)) {
+				CPU_SET(cpu, &set);
+			}
+		}
+
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			log_warn("cannot set cpu mask 0x%x", sched->cpus);
+			result = false;
+		}
+	}
+
+	if ((sched->policy == SCHED_FIFO) || (sched->policy == SCHED_RR)) {
+		struct sched_param param = {.sched_priority = sched->priority};
+
+		/* fork() в сервисе не должен наследовать реальное время */
+		if (sched_setscheduler(0, sched->policy | SCHED_RESET_ON_FORK, &param) != 0) {
+			log_warn("cannot set realtime priority %i", sched->priority);
+			result = false;
+		}
+	} else if (sched->nice != 0) {
+		if (setpriority(PRIO_PROCESS, 0, sched->nice) != 0) {
+			log_warn("cannot set nice %i", sched->nice);
+			result = false;
+		}
+	}
+
+	if (sched->mem_limit > 0ULL) {
+		if (!cgroup_join(name, sched->mem_limit)) {
+			result = false;
+		}
+	}
+
+	return result;
+}
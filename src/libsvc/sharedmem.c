@@ -7,24 +7,36 @@
  */
 
 #include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <log/log.h>
+#include <svc/memory.h>
 #include <svc/sharedmem.h>
+#include <svc/svc.h>
 
-#define SHM_COPIES (4U)
 #define SHM_MAGIC (0x53484D5F44415441ULL)
 #define SHM_GUARD (0x53484D4755415244ULL)
 
-#define SHM_START_IDX (0xFFFFFFFEU)
+/*
+ * Чтение слота, занятого писателем: сначала короткие повторы с паузой
+ * процессора, потом с уступкой планировщику. Ошибка - только если слот
+ * занят дольше SHM_READ_TIMEOUT (писатель завис или упал посреди записи).
+ */
+#define SHM_READ_SPINS (64U)
+#define SHM_READ_TIMEOUT (10ULL * TIME_MS)
 
 #define SHM_PREFIX "SHM_RC_"
 
 typedef struct {
+	uint32_t seq; /* нечетное значение - идет запись слота */
 	uint32_t index;
-	uint32_t size;
 	uint64_t offset;
 } shm_slot_t;
 
@@ -32,12 +44,45 @@ typedef struct {
 	uint64_t magic;
 	uint32_t size;
 	uint32_t copies;
-	uint32_t index;
-	uint32_t __pad;
+	uint32_t index;	  /* futex: ожидание публикации нового индекса */
+	uint32_t waiters; /* число читателей, спящих в shm_map_wait() */
 
-	shm_slot_t slot[SHM_COPIES];
+	shm_slot_t slot[SHM_COPIES_MAX];
 } shm_header_t;
 
+static inline void
+cpu_relax(void)
+{
+#if defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield" ::: "memory");
+#elif defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/* ожидание освобождения слота писателем, false - слот занят слишком долго */
+static bool
+read_backoff(uint32_t retry, uint64_t *deadline)
+{
+	if (retry < SHM_READ_SPINS) {
+		cpu_relax();
+		return true;
+	}
+
+	uint64_t now = svc_get_monotime();
+	if (*deadline == 0ULL) {
+		*deadline = now + SHM_READ_TIMEOUT;
+	} else if (now >= *deadline) {
+		return false;
+	}
+
+	sched_yield();
+
+	return true;
+}
+
 static inline size_t
 align_size(size_t size)
 {
@@ -51,11 +96,16 @@ calc_shm_size(size_t copy_size, size_t copies)
 }
 
 bool
-shm_map_init(const char name[], size_t size)
+shm_map_init(const char name[], size_t size, uint32_t copies)
 {
 	bool result = false;
 
 	do {
+		if (!SHM_COPIES_VALID(copies)) {
+			log_err("shm \"%s\": invalid copies count %u", name, copies);
+			break;
+		}
+
 		char shm_name[256];
 		snprintf(shm_name, sizeof(shm_name), "/" SHM_PREFIX "%s", name);
 		int fd = shm_open(shm_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
@@ -64,14 +114,14 @@ shm_map_init(const char name[], size_t size)
 			break;
 		}
 
-		size_t map_size = calc_shm_size(size, SHM_COPIES);
+		size_t map_size = calc_shm_size(size, copies);
 
 		if (ftruncate(fd, (off_t)map_size) == -1) {
 			log_err("cannot ftruncate()");
 			break;
 		}
 
-		void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		void *map = svc_mem_map(fd, map_size);
 		close(fd);
 		if (map == MAP_FAILED) {
 			log_err("cannot mmap()");
@@ -81,13 +131,14 @@ shm_map_init(const char name[], size_t size)
 		shm_header_t *header = map;
 		header->magic = SHM_MAGIC;
 		header->size = (uint32_t)size;
-		header->copies = SHM_COPIES;
+		header->copies = copies;
 		header->index = SHM_START_IDX;
+		header->waiters = 0U;
 
 		uint32_t slot;
-		for (slot = 0U; slot < SHM_COPIES; slot++) {
+		for (slot = 0U; slot < copies; slot++) {
+			header->slot[slot].seq = 0U;
 			header->slot[slot].index = SHM_START_IDX;
-			header->slot[slot].size = 0U;
 
 			header->slot[slot].offset = (align_size(size) * slot);
 		}
@@ -129,10 +180,15 @@ shm_map_open(const char name[], shm_t *shm)
 			break;
 		}
 
+		if (!SHM_COPIES_VALID(header.copies)) {
+			close(fd);
+			log_err("invalid shm copies count");
+			break;
+		}
+
 		munmap(map, sizeof(shm_header_t));
 
-		map = mmap(NULL, calc_shm_size(header.size, SHM_COPIES), PROT_READ | PROT_WRITE,
-			   MAP_SHARED, fd, 0);
+		map = svc_mem_map(fd, calc_shm_size(header.size, header.copies));
 		close(fd);
 		if (map == MAP_FAILED) {
 			log_err("cannot mmap()");
@@ -142,6 +198,8 @@ shm_map_open(const char name[], shm_t *shm)
 		shm->guard = SHM_GUARD;
 		shm->map = map;
 		shm->size = header.size;
+		shm->copies = header.copies;
+		shm->wr_slot = -1;
 
 		result = true;
 	} while (false);
@@ -149,8 +207,21 @@ shm_map_open(const char name[], shm_t *shm)
 	return result;
 }
 
+static inline void *
+slot_data(shm_header_t *hdr, size_t slot)
+{
+	union {
+		shm_header_t *h;
+		uint64_t *u64;
+	} p;
+
+	p.h = &hdr[1];
+
+	return &p.u64[(hdr->slot[slot].offset) / sizeof(uint64_t *)];
+}
+
 int32_t
-shm_map_read(shm_t *shm, void **data)
+shm_map_read(shm_t *shm, void *data, size_t size)
 {
 	int32_t result = 0;
 
@@ -168,48 +239,215 @@ shm_map_read(shm_t *shm, void **data)
 			break;
 		}
 
-		uint32_t index = hdr->index;
-		size_t slot = index % SHM_COPIES;
+		if (size > hdr->size) {
+			size = hdr->size;
+		}
+
+		uint64_t deadline = 0ULL;
+		uint32_t retry;
+		for (retry = 0U;; retry++) {
+			uint32_t index = __atomic_load_n(&hdr->index, __ATOMIC_ACQUIRE);
+			size_t slot = index & (shm->copies - 1U);
+
+			uint32_t seq = __atomic_load_n(&hdr->slot[slot].seq, __ATOMIC_ACQUIRE);
+			if ((seq & 1U) == 0U) {
+				memcpy(data, slot_data(hdr, slot), size);
+
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&hdr->slot[slot].seq, __ATOMIC_RELAXED) == seq) {
+					break;
+				}
+			}
+
+			/* писатель догнал читателя и пишет в этот слот */
+			if (!read_backoff(retry, &deadline)) {
+				log_warn("shm read: slot is always busy");
+				result = -1;
+				break;
+			}
+		}
+	} while (false);
+
+	return result;
+}
+
+/* seqlock: нечетный seq на время записи, читатели повторят чтение */
+static inline void
+slot_lock(shm_header_t *hdr, size_t slot)
+{
+	/* нечетный seq остается от писателя, упавшего посреди записи: после
+	 * перезапуска сервиса слот все равно должен стать нечетным */
+	uint32_t seq = __atomic_load_n(&hdr->slot[slot].seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->slot[slot].seq, (seq + 1U) | 1U, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+slot_unlock(shm_header_t *hdr, size_t slot)
+{
+	uint32_t seq = __atomic_load_n(&hdr->slot[slot].seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->slot[slot].seq, seq + 1U, __ATOMIC_RELEASE);
+}
+
+static inline void
+publish_index(shm_header_t *hdr, uint32_t index)
+{
+	/* seq_cst в паре с shm_map_wait(): либо читатель увидит новый индекс,
+	 * либо писатель увидит ожидающего и разбудит его */
+	__atomic_store_n(&hdr->index, index, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST) > 0U) {
+		syscall(SYS_futex, &hdr->index, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static void *
+begin_write(shm_t *shm, bool copy)
+{
+	void *result = NULL;
+
+	do {
+		if (shm->guard != SHM_GUARD) {
+			log_err("shm guard error!");
+			break;
+		}
+
+		if (shm->wr_slot >= 0) {
+			log_err("shm write is already in progress");
+			break;
+		}
+
+		shm_header_t *hdr = shm->map;
+
+		uint32_t last = __atomic_load_n(&hdr->index, __ATOMIC_RELAXED);
+		uint32_t index = last + 1U;
+		size_t slot = index & (shm->copies - 1U);
+
+		slot_lock(hdr, slot);
+		hdr->slot[slot].index = index;
 
-		union {
-			shm_header_t *h;
-			uint64_t *u64;
-		} p;
+		result = slot_data(hdr, slot);
 
-		p.h = &hdr[1];
-		*data = &p.u64[(hdr->slot[slot].offset) / sizeof(uint64_t *)];
+		/* писатель один: последний опубликованный слот сейчас не меняется */
+		size_t last_slot = last & (shm->copies - 1U);
+		if (copy && (last_slot != slot)) {
+			memcpy(result, slot_data(hdr, last_slot), shm->size);
+		}
+
+		shm->wr_slot = (int32_t)slot;
+		shm->wr_index = index;
 	} while (false);
 
 	return result;
 }
 
+void *
+shm_map_begin_write(shm_t *shm)
+{
+	return begin_write(shm, false);
+}
+
+void *
+shm_map_begin_update(shm_t *shm)
+{
+	return begin_write(shm, true);
+}
+
 int32_t
-shm_map_write(shm_t *shm, void *data, size_t size)
+shm_map_commit(shm_t *shm)
 {
 	int32_t result = 0;
 
 	if (shm->guard != SHM_GUARD) {
 		log_err("shm guard error!");
 		result = -1;
+	} else if (shm->wr_slot < 0) {
+		log_err("shm commit without write");
+		result = -1;
 	} else {
 		shm_header_t *hdr = shm->map;
 
-		uint32_t index = hdr->index;
-		index++;
-		size_t slot = index % SHM_COPIES;
+		slot_unlock(hdr, (size_t)shm->wr_slot);
+		publish_index(hdr, shm->wr_index);
 
-		union {
-			shm_header_t *h;
-			uint64_t *u64;
-		} p;
-		p.h = &hdr[1];
-		void *dst;
-		dst = &p.u64[(hdr->slot[slot].offset) / sizeof(uint64_t *)];
+		shm->wr_slot = -1;
+	}
+
+	return result;
+}
+
+int32_t
+shm_map_write(shm_t *shm, const void *data, size_t size)
+{
+	int32_t result = -1;
+
+	void *slot = shm_map_begin_write(shm);
+	if (slot != NULL) {
+		if (size > shm->size) {
+			size = shm->size;
+		}
+
+		memcpy(slot, data, size);
+
+		result = shm_map_commit(shm);
+	}
+
+	return result;
+}
 
-		memcpy(dst, data, size);
+uint32_t
+shm_map_index(shm_t *shm)
+{
+	uint32_t index = SHM_START_IDX;
 
-		hdr->index = index;
+	if (shm->guard != SHM_GUARD) {
+		log_err("shm guard error!");
+	} else {
+		shm_header_t *hdr = shm->map;
+		index = __atomic_load_n(&hdr->index, __ATOMIC_ACQUIRE);
 	}
 
+	return index;
+}
+
+int32_t
+shm_map_wait(shm_t *shm, uint32_t last_index, uint64_t timeout)
+{
+	int32_t result = 0;
+
+	do {
+		if (shm->guard != SHM_GUARD) {
+			log_err("shm guard error!");
+			result = -1;
+			break;
+		}
+
+		shm_header_t *hdr = shm->map;
+
+		struct timespec ts;
+		ts.tv_sec = (time_t)(timeout / TIME_S);
+		ts.tv_nsec = (long)(timeout % TIME_S);
+
+		__atomic_add_fetch(&hdr->waiters, 1U, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&hdr->index, __ATOMIC_SEQ_CST) == last_index) {
+			/* FUTEX_WAIT сам сверит значение индекса перед засыпанием */
+			if (syscall(SYS_futex, &hdr->index, FUTEX_WAIT, last_index,
+				    (timeout > 0ULL) ? &ts : NULL, NULL, 0) == -1) {
+				if ((errno != EAGAIN) && (errno != EINTR) &&
+				    (errno != ETIMEDOUT)) {
+					log_err("futex wait error");
+					result = -1;
+				}
+			}
+		}
+
+		__atomic_sub_fetch(&hdr->waiters, 1U, __ATOMIC_SEQ_CST);
+
+		if ((result == 0) &&
+		    (__atomic_load_n(&hdr->index, __ATOMIC_ACQUIRE) != last_index)) {
+			result = 1;
+		}
+	} while (false);
+
 	return result;
 }
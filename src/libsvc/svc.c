@@ -11,6 +11,7 @@
 #include <time.h>
 
 #include <log/log.h>
+#include <svc/memory.h>
 #include <svc/platform.h>
 #include <svc/svc.h>
 #include <svc/timerfd.h>
@@ -43,8 +44,7 @@ svc_create_context(const char svc_name[])
 			break;
 		}
 
-		void *map =
-		    mmap(NULL, sizeof(svc_context_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		void *map = svc_mem_map(fd, sizeof(svc_context_t));
 		close(fd);
 		if (map == MAP_FAILED) {
 			log_err("mmap() failed");
@@ -58,12 +58,12 @@ svc_create_context(const char svc_name[])
 }
 
 uint64_t
-svc_get_monotime(void)
+svc_get_time(void)
 {
 	struct timespec ts;
 	uint64_t result = 0ULL;
 
-	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0) {
+	if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
 		result = (uint64_t)ts.tv_nsec + ((uint64_t)ts.tv_sec * TIME_S);
 	}
 
@@ -71,23 +71,54 @@ svc_get_monotime(void)
 }
 
 uint64_t
-svc_get_time(void)
+svc_get_boottime(void)
 {
 	struct timespec ts;
 	uint64_t result = 0ULL;
 
-	if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+	if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0) {
 		result = (uint64_t)ts.tv_nsec + ((uint64_t)ts.tv_sec * TIME_S);
 	}
 
 	return result;
 }
 
+void
+svc_startup_mark(const char what[])
+{
+	uint64_t boot = svc_get_boottime();
+
+	log_inf("startup: %s at %llu.%03llu s", what, boot / TIME_S, (boot % TIME_S) / TIME_MS);
+}
+
 void
 svc_init_context(svc_context_t *ctx)
 {
 	svc_context = ctx;
 	ctx->watchdog = svc_get_monotime();
+	ctx->cycle_wake = 0ULL;
+	ctx->deadline_set = false;
+}
+
+void
+svc_set_context(svc_context_t *ctx)
+{
+	svc_context = ctx;
+}
+
+void
+svc_set_deadline(uint64_t deadline)
+{
+	/* пульс до срока, иначе супервизор может сравнить новый срок со старым пульсом */
+	__atomic_store_n(&svc_context->heartbeat, svc_get_monotime(), __ATOMIC_RELAXED);
+	__atomic_store_n(&svc_context->deadline, deadline, __ATOMIC_RELEASE);
+	svc_context->deadline_set = true;
+}
+
+void
+svc_heartbeat(void)
+{
+	__atomic_store_n(&svc_context->heartbeat, svc_get_monotime(), __ATOMIC_RELAXED);
 }
 
 static inline bool
@@ -107,17 +138,121 @@ check_watchdog(const svc_context_t *ctx)
 	return result;
 }
 
+bool
+svc_check(void)
+{
+	return check_watchdog(get_svc_context());
+}
+
+static inline uint32_t
+hist_bucket(uint64_t ns)
+{
+	uint64_t us = ns / TIME_US;
+	uint32_t bucket = 0U;
+
+	while ((us > 0ULL) && (bucket < (SVC_HIST_BUCKETS - 1U))) {
+		us >>= 1U;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+uint64_t
+svc_hist_percentile(const uint64_t hist[SVC_HIST_BUCKETS], uint32_t pct)
+{
+	uint64_t total = 0ULL;
+	uint32_t i;
+
+	for (i = 0U; i < SVC_HIST_BUCKETS; i++) {
+		total += hist[i];
+	}
+
+	if (total == 0ULL) {
+		return 0ULL;
+	}
+
+	uint64_t rank = (total * pct + 99ULL) / 100ULL;
+	uint64_t count = 0ULL;
+
+	for (i = 0U; i < (SVC_HIST_BUCKETS - 1U); i++) {
+		count += hist[i];
+		if (count >= rank) {
+			break;
+		}
+	}
+
+	return (1ULL << i) * TIME_US;
+}
+
+static void
+timing_work(svc_timing_t *t, uint64_t work)
+{
+	t->work_sum += work;
+	if (work > t->work_max) {
+		t->work_max = work;
+	}
+	t->work_hist[hist_bucket(work)]++;
+}
+
+static void
+timing_wake(svc_timing_t *t, uint64_t period, uint64_t exp)
+{
+	/* таймер взведен с TFD_TIMER_ABSTIME на кратные периоду моменты
+	 * CLOCK_REALTIME, поэтому опоздание - остаток от деления */
+	uint64_t late = svc_get_time() % period;
+
+	t->cycles++;
+	t->overruns += exp - 1ULL;
+	t->late_sum += late;
+	if (late > t->late_max) {
+		t->late_max = late;
+	}
+	t->late_hist[hist_bucket(late)]++;
+}
+
+static void
+cycle_wake_up(svc_context_t *ctx, uint64_t exp)
+{
+	if (ctx->cycle_wake == 0ULL) {
+		svc_startup_mark("first cycle");
+	} else if (exp > 0ULL) {
+		/* первое чтение возвращает все периоды с начала эпохи */
+		timing_wake(&ctx->timing, ctx->period, exp);
+	}
+
+	ctx->cycle_wake = svc_get_monotime();
+	__atomic_store_n(&ctx->heartbeat, ctx->cycle_wake, __ATOMIC_RELAXED);
+
+	if (!ctx->deadline_set) {
+		svc_set_deadline(SVC_DEADLINE_PERIODS * ctx->period);
+	}
+}
+
+static void
+cycle_work_done(svc_context_t *ctx)
+{
+	if (ctx->cycle_wake != 0ULL) {
+		timing_work(&ctx->timing, svc_get_monotime() - ctx->cycle_wake);
+	}
+}
+
 bool
 svc_cycle(void)
 {
 	bool result = true;
 
-	const svc_context_t *ctx = get_svc_context();
+	svc_context_t *ctx = svc_context;
 
 	if (ctx->period > 0ULL) {
-		if (!timerfd_wait(ctx->timerfd)) {
+		cycle_work_done(ctx);
+
+		uint64_t exp = 0ULL;
+		if (!timerfd_read(ctx->timerfd, &exp)) {
 			result = false;
 		}
+
+		cycle_wake_up(ctx, exp);
 	}
 
 	if (!check_watchdog(ctx)) {
@@ -126,3 +261,29 @@ svc_cycle(void)
 
 	return result;
 }
+
+bool
+svc_task_cycle(int (*step)(void))
+{
+	bool result = false;
+
+	svc_context_t *ctx = svc_context;
+
+	do {
+		uint64_t exp;
+		if (!timerfd_read(ctx->timerfd, &exp)) {
+			break;
+		}
+
+		cycle_wake_up(ctx, exp);
+
+		if (!check_watchdog(ctx)) {
+			break;
+		}
+
+		result = (step() == 0);
+		cycle_work_done(ctx);
+	} while (false);
+
+	return result;
+}
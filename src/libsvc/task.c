@@ -0,0 +1,111 @@
+/**
+ * @file task.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Периодические сервисы как задачи общего цикла
+ */
+
+#include <sys/epoll.h>
+
+#include <log/log.h>
+#include <svc/task.h>
+#include <svc/timerfd.h>
+
+#define TASK_EVENTS_MAX (16U)
+
+int
+svc_task_main(const svc_task_t *task)
+{
+	if ((task->start != NULL) && (task->start() != 0)) {
+		return 1;
+	}
+
+	while (svc_cycle()) {
+		if (task->step() != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* журнал пишется в буфер текущего контекста */
+static void
+task_switch(svc_context_t *ctx)
+{
+	svc_set_context(ctx);
+	log_init();
+}
+
+int
+svc_tasks_run(svc_context_t *const ctx[], const svc_task_t *const task[], size_t count)
+{
+	int result = 1;
+
+	/* контекст процесса, в нем журналируются ошибки самого цикла */
+	svc_context_t *own = (svc_context_t *)get_svc_context();
+
+	do {
+		int epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			log_err("cannot create epoll");
+			break;
+		}
+
+		size_t i;
+		for (i = 0U; i < count; i++) {
+			svc_init_context(ctx[i]);
+			log_init();
+
+			ctx[i]->timerfd = timerfd_init(ctx[i]->period, ctx[i]->period);
+			if (ctx[i]->timerfd < 0) {
+				break;
+			}
+
+			if ((task[i]->start != NULL) && (task[i]->start() != 0)) {
+				log_err("task start failed");
+				break;
+			}
+
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.u64 = i;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx[i]->timerfd, &ev) == -1) {
+				log_err("cannot add timer to epoll");
+				break;
+			}
+		}
+
+		task_switch(own);
+
+		if (i < count) {
+			break;
+		}
+
+		bool running = true;
+		while (running) {
+			struct epoll_event events[TASK_EVENTS_MAX];
+
+			int n = epoll_wait(epfd, events, TASK_EVENTS_MAX, -1);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				log_err("epoll_wait error");
+				break;
+			}
+
+			int e;
+			for (e = 0; (e < n) && running; e++) {
+				size_t t = (size_t)events[e].data.u64;
+
+				task_switch(ctx[t]);
+				running = svc_task_cycle(task[t]->step);
+				task_switch(own);
+			}
+		}
+	} while (false);
+
+	return result;
+}
@@ -42,13 +42,12 @@ timerfd_init(uint64_t start_nsec, uint64_t period_nsec)
 }
 
 bool
-timerfd_wait(int fd)
+timerfd_read(int fd, uint64_t *expirations)
 {
 	int result = true;
-	uint64_t exp;
 	int s;
 
-	s = read(fd, &exp, sizeof(uint64_t));
+	s = read(fd, expirations, sizeof(uint64_t));
 
 	if (s != sizeof(uint64_t)) {
 		log_err("timerfd read");
@@ -57,3 +56,11 @@ timerfd_wait(int fd)
 
 	return result;
 }
+
+bool
+timerfd_wait(int fd)
+{
+	uint64_t exp;
+
+	return timerfd_read(fd, &exp);
+}
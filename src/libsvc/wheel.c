@@ -0,0 +1,270 @@
+/**
+ * @file wheel.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Иерархическое колесо таймеров сервиса
+ */
+
+#include <poll.h>
+
+#include <log/log.h>
+#include <svc/svc.h>
+#include <svc/wheel.h>
+
+#define WHEEL_MASK (SVC_WHEEL_SLOTS - 1U)
+
+/* дальше последнего уровня сроки не различаются, таймер ждет в последней ячейке */
+#define WHEEL_RANGE (1ULL << (SVC_WHEEL_BITS * SVC_WHEEL_LEVELS))
+
+static inline void
+list_init(svc_timer_t *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static inline void
+list_add(svc_timer_t *head, svc_timer_t *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static inline void
+list_del(svc_timer_t *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/* перенос всего списка на новую голову */
+static inline void
+list_splice(svc_timer_t *head, svc_timer_t *list)
+{
+	if (head->next == head) {
+		list_init(list);
+		return;
+	}
+
+	list->next = head->next;
+	list->prev = head->prev;
+	list->next->prev = list;
+	list->prev->next = list;
+	list_init(head);
+}
+
+static inline uint32_t
+slot_index(uint64_t tick, uint32_t level)
+{
+	return (uint32_t)(tick >> (SVC_WHEEL_BITS * level)) & WHEEL_MASK;
+}
+
+void
+svc_wheel_init(svc_wheel_t *w, uint64_t resolution, uint64_t now)
+{
+	uint32_t l, s;
+
+	w->resolution = (resolution > 0ULL) ? resolution : 1ULL;
+	w->tick = now / w->resolution;
+	w->count = 0U;
+
+	for (l = 0U; l < SVC_WHEEL_LEVELS; l++) {
+		for (s = 0U; s < SVC_WHEEL_SLOTS; s++) {
+			list_init(&w->slot[l][s]);
+		}
+	}
+}
+
+void
+svc_timer_init(svc_timer_t *timer, svc_timer_cb_t cb, void *arg)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires = 0ULL;
+	timer->cb = cb;
+	timer->arg = arg;
+}
+
+/* ячейка по расстоянию до срока, как в колесе таймеров ядра */
+static void
+wheel_insert(svc_wheel_t *w, svc_timer_t *timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta = expires - w->tick;
+	uint32_t level;
+
+	if ((int64_t)delta < 0) {
+		/* срок прошел: сработает на следующем тике */
+		expires = w->tick;
+		delta = 0ULL;
+	} else if (delta >= WHEEL_RANGE) {
+		expires = w->tick + WHEEL_RANGE - 1ULL;
+		delta = WHEEL_RANGE - 1ULL;
+	}
+
+	for (level = 0U; level < (SVC_WHEEL_LEVELS - 1U); level++) {
+		if (delta < (1ULL << (SVC_WHEEL_BITS * (level + 1U)))) {
+			break;
+		}
+	}
+
+	list_add(&w->slot[level][slot_index(expires, level)], timer);
+}
+
+void
+svc_timer_arm(svc_wheel_t *w, svc_timer_t *timer, uint64_t expires)
+{
+	if (svc_timer_pending(timer)) {
+		list_del(timer);
+		w->count--;
+	}
+
+	/* округление вверх: таймер не срабатывает раньше срока */
+	timer->expires = (expires + w->resolution - 1ULL) / w->resolution;
+	wheel_insert(w, timer);
+	w->count++;
+}
+
+void
+svc_timer_cancel(svc_wheel_t *w, svc_timer_t *timer)
+{
+	if (svc_timer_pending(timer)) {
+		list_del(timer);
+		w->count--;
+	}
+}
+
+/* перенос ячейки уровня level на ближние уровни, возвращает номер ячейки */
+static uint32_t
+wheel_cascade(svc_wheel_t *w, uint32_t level)
+{
+	uint32_t index = slot_index(w->tick, level);
+	svc_timer_t list;
+
+	/* список отцепляется целиком: вставка может вернуть таймер в эту же ячейку */
+	list_splice(&w->slot[level][index], &list);
+
+	while (list.next != &list) {
+		svc_timer_t *timer = list.next;
+		list_del(timer);
+		wheel_insert(w, timer);
+	}
+
+	return index;
+}
+
+uint32_t
+svc_wheel_run(svc_wheel_t *w, uint64_t now)
+{
+	uint64_t now_tick = now / w->resolution;
+	uint32_t fired = 0U;
+
+	while (w->tick <= now_tick) {
+		if (w->count == 0U) {
+			/* пустое колесо не прокручивается по тикам */
+			w->tick = now_tick + 1ULL;
+			break;
+		}
+
+		uint32_t index = slot_index(w->tick, 0U);
+
+		if (index == 0U) {
+			/* оборот уровня: таймеры следующего уровня раскладываются ближе */
+			uint32_t level;
+			for (level = 1U; level < SVC_WHEEL_LEVELS; level++) {
+				if (wheel_cascade(w, level) != 0U) {
+					break;
+				}
+			}
+		}
+
+		/* таймер, взведенный обработчиком на оборот вперед, попадает в
+		 * эту же ячейку и не должен сработать сейчас */
+		svc_timer_t list;
+		list_splice(&w->slot[0U][index], &list);
+		w->tick++;
+
+		while (list.next != &list) {
+			svc_timer_t *timer = list.next;
+			list_del(timer);
+			w->count--;
+			fired++;
+			timer->cb(timer, timer->arg);
+		}
+	}
+
+	return fired;
+}
+
+uint64_t
+svc_wheel_next(const svc_wheel_t *w)
+{
+	uint64_t next = UINT64_MAX;
+	uint32_t level;
+
+	if (w->count == 0U) {
+		return UINT64_MAX;
+	}
+
+	/*
+	 * На нулевом уровне сроки меньше оборота, ближайшие - в первой непустой
+	 * ячейке после текущей. В ячейке старшего уровня может лежать таймер на
+	 * полный оборот вперед, поэтому там просматриваются все ячейки.
+	 */
+	for (level = 0U; level < SVC_WHEEL_LEVELS; level++) {
+		uint32_t start = slot_index(w->tick, level);
+		uint32_t i;
+
+		for (i = 0U; i < SVC_WHEEL_SLOTS; i++) {
+			const svc_timer_t *head = &w->slot[level][(start + i) & WHEEL_MASK];
+			const svc_timer_t *timer;
+
+			for (timer = head->next; timer != head; timer = timer->next) {
+				if (timer->expires < next) {
+					next = timer->expires;
+				}
+			}
+
+			if ((level == 0U) && (head->next != head)) {
+				break;
+			}
+		}
+	}
+
+	/* просроченный таймер ждет в текущей ячейке */
+	if (next < w->tick) {
+		next = w->tick;
+	}
+
+	return next * w->resolution;
+}
+
+bool
+svc_wheel_wait(svc_wheel_t *w, int fd, uint64_t max_wait)
+{
+	uint64_t now = svc_get_monotime();
+	uint64_t next = svc_wheel_next(w);
+	uint64_t wait = (next > now) ? (next - now) : 0ULL;
+
+	if (wait > max_wait) {
+		wait = max_wait;
+	}
+
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int timeout = (int)((wait + TIME_MS - 1ULL) / TIME_MS);
+
+	int n = poll(&pfd, (fd >= 0) ? 1U : 0U, timeout);
+	if ((n < 0) && (errno != EINTR)) {
+		log_err("poll error");
+		return false;
+	}
+
+	svc_wheel_run(w, svc_get_monotime());
+
+	return true;
+}
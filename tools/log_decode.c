@@ -0,0 +1,149 @@
+/**
+ * @file log_decode.c
+ * @author Алексей Хохлов <root@amper.me>
+ * @copyright WTFPL License
+ * @date 2021
+ * @brief Разбор сегментных файлов журнала, снятых с устройства
+ *
+ * Принимает каталог спулера или отдельные сегменты, сортирует их по
+ * номеру и печатает сообщения в порядке записи.
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <log/spool.h>
+#include <svc/platform.h>
+
+#define SEGMENTS_MAX (1024U)
+#define PATH_LEN (512U)
+
+typedef struct {
+	char path[PATH_LEN];
+	uint64_t seq;
+} segment_t;
+
+static segment_t segments[SEGMENTS_MAX];
+static size_t segment_count = 0U;
+
+static const char *level_names[] = {
+    [LOG_DBG] = "dbg", [LOG_INF] = "inf", [LOG_WARN] = "wrn", [LOG_ERR] = "err", [LOG_EXC] = "exc",
+};
+
+static enum log_level min_level = LOG_DBG;
+
+static void
+add_segment(const char path[])
+{
+	uint64_t seq;
+
+	if (!log_spool_segment_seq(path, &seq)) {
+		fprintf(stderr, "%s: not a log segment\n", path);
+		return;
+	}
+
+	if (segment_count == SEGMENTS_MAX) {
+		fprintf(stderr, "%s: too many segments\n", path);
+		return;
+	}
+
+	snprintf(segments[segment_count].path, PATH_LEN, "%s", path);
+	segments[segment_count].seq = seq;
+	segment_count++;
+}
+
+static void
+add_path(const char path[])
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		add_segment(path);
+		return;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if ((len > 4U) && (strcmp(&de->d_name[len - 4U], ".seg") == 0)) {
+			char seg_path[PATH_LEN];
+			snprintf(seg_path, sizeof(seg_path), "%s/%s", path, de->d_name);
+			add_segment(seg_path);
+		}
+	}
+
+	closedir(dir);
+}
+
+static int
+segment_cmp(const void *a, const void *b)
+{
+	const segment_t *sa = (const segment_t *)a;
+	const segment_t *sb = (const segment_t *)b;
+
+	return (sa->seq > sb->seq) - (sa->seq < sb->seq);
+}
+
+static void
+print_msg(const log_spool_msg_t *msg, void *arg)
+{
+	(void)arg;
+
+	if (msg->level < min_level) {
+		return;
+	}
+
+	time_t sec = (time_t)(msg->date / TIME_S);
+	struct tm tm;
+	char date[32];
+
+	gmtime_r(&sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	const char *level = (msg->level <= LOG_EXC) ? level_names[msg->level] : "???";
+
+	printf("%s.%03u [%10s ] %s: %s\n", date, (unsigned)((msg->date % TIME_S) / TIME_MS),
+	       msg->name, level, msg->text);
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		switch (opt) {
+		case 'l':
+			min_level = (enum log_level)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-l min_level] <spool dir | segment>...\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-l min_level] <spool dir | segment>...\n", argv[0]);
+		return 1;
+	}
+
+	int i;
+	for (i = optind; i < argc; i++) {
+		add_path(argv[i]);
+	}
+
+	qsort(segments, segment_count, sizeof(segment_t), segment_cmp);
+
+	int result = 0;
+	size_t s;
+	for (s = 0U; s < segment_count; s++) {
+		if (log_spool_decode(segments[s].path, print_msg, NULL) < 0) {
+			fprintf(stderr, "%s: cannot decode\n", segments[s].path);
+			result = 1;
+		}
+	}
+
+	return result;
+}